@@ -0,0 +1,3 @@
+int quickZoneXfer;
+int quartzBox;
+int unrelated;
@@ -0,0 +1,4 @@
+int fooWidget;
+int barWidget;
+int widgetCount;
+int gadget;
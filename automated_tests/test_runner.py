@@ -11,7 +11,7 @@ import os
 import sys
 import json
 import subprocess as sp
-from hamcrest import assert_that, has_length, has_item
+from hamcrest import assert_that, has_length, has_item, equal_to
 
 sys.dont_write_bytecode = True
 os.environ["PYTHONDONTWRITEBYTECODE"] = "1"
@@ -76,6 +76,13 @@ def run(rdm, project_dir, test_dir, test_files, rc_command, expected_locations):
         expected_location = Location.from_str(expected_location_string.format(test_dir))
         assert_that(actual_locations, has_item(expected_location))
 
+def run_output(rdm, project_dir, test_dir, test_files, rc_command, expected_output):
+    print 'running test'
+    actual_output = [line for line in run_rc([c.format(test_dir) for c in rc_command]).split("\n")
+                     if len(line) > 0]
+    # Commands that list names are compared line by line, in order
+    assert_that(actual_output, equal_to([o.format(test_dir) for o in expected_output]))
+
 def setup_rdm(test_dir, test_files):
     rdm = sp.Popen(["rdm", "-n", socket_file, "-d", "~/.rtags_dev", "-o", "-B", "-C", "--log-flush" ],
                    stdout=sp.PIPE, stderr=sp.STDOUT)
@@ -99,6 +106,9 @@ def test_generator():
         rdm = setup_rdm(test_dir, test_files)
         for e in expectations:
             test_generator.__name__ = os.path.basename(test_dir)
-            yield run, rdm, project_dir, test_dir, test_files, e["rc-command"], e["expectation"]
+            if "output" in e:
+                yield run_output, rdm, project_dir, test_dir, test_files, e["rc-command"], e["output"]
+            else:
+                yield run, rdm, project_dir, test_dir, test_files, e["rc-command"], e["expectation"]
         rdm.terminate()
         rdm.wait()
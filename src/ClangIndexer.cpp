@@ -16,6 +16,7 @@
 #define RTAGS_SINGLE_THREAD
 #include "ClangIndexer.h"
 
+#include <sys/resource.h>
 #include <unistd.h>
 #if CINDEX_VERSION >= CINDEX_VERSION_ENCODE(0, 25)
 #include <clang-c/Documentation.h>
@@ -30,6 +31,8 @@
 #include "rct/SHA256.h"
 #include "RTags.h"
 #include "RTagsVersion.h"
+#include "UnitFile.h"
+#include "UsrFilter.h"
 #include "VisitFileMessage.h"
 #include "VisitFileResponseMessage.h"
 #include "Location.h"
@@ -76,27 +79,70 @@ struct VerboseVisitorUserData {
 
 Flags<Server::Option> ClangIndexer::sServerOpts;
 Path ClangIndexer::sServerSandboxRoot;
-ClangIndexer::ClangIndexer()
+ClangIndexer::ClangIndexer(const std::shared_ptr<Connection> &connection)
     : mCurrentTranslationUnit(String::npos), mLastCursor(clang_getNullCursor()),
-      mLastCallExprSymbol(0), mVisitFileResponseMessageFileId(0),
-      mVisitFileResponseMessageVisit(0), mParseDuration(0), mVisitDuration(0), mBlocked(0),
-      mAllowed(0), mIndexed(1), mVisitFileTimeout(0), mIndexDataMessageTimeout(0),
-      mFileIdsQueried(0), mFileIdsQueriedTime(0), mCursorsVisited(0), mLogFile(0),
-      mConnection(Connection::create(RClient::NumOptions)), mUnionRecursion(false),
-      mInTemplateFunction(0)
+      mLastCallExprSymbol(0), mVisitFileResponseReceived(false), mParseDuration(0),
+      mVisitDuration(0), mBlocked(0), mAllowed(0), mIndexed(1), mVisitFileTimeout(0),
+      mIndexDataMessageTimeout(0), mFileIdsQueried(0), mFileIdsQueriedTime(0),
+      mFileIdsClaimed(0), mCursorsVisited(0), mLogFile(0),
+      mConnection(connection ? connection : Connection::create(RClient::NumOptions)),
+      mFinishedKey(0), mUnionRecursion(false), mDeclarationsOnly(false), mInTemplateFunction(0)
 {
-    mConnection->newMessage().connect(std::bind(&ClangIndexer::onMessage, this,
-                                                std::placeholders::_1, std::placeholders::_2));
+    mNewMessageKey = mConnection->newMessage().connect(std::bind(&ClangIndexer::onMessage, this,
+                                                                 std::placeholders::_1, std::placeholders::_2));
 }
 
 ClangIndexer::~ClangIndexer()
 {
+    // the connection is reused for the next job when rp runs as a worker
+    mConnection->newMessage().disconnect(mNewMessageKey);
+    if (mFinishedKey)
+        mConnection->finished().disconnect(mFinishedKey);
     if (mLogFile)
         fclose(mLogFile);
 }
 
+// Peak RSS in kilobytes. On Linux the high water mark is reset for each job
+// so an rp worker reports what the job needed, elsewhere it's the peak of
+// the whole process.
+static void resetPeakRss()
+{
+#ifdef OS_Linux
+    if (FILE *f = fopen("/proc/self/clear_refs", "w")) {
+        fputs("5", f);
+        fclose(f);
+    }
+#endif
+}
+
+static uint32_t peakRss()
+{
+#ifdef OS_Linux
+    if (FILE *f = fopen("/proc/self/status", "r")) {
+        char line[256];
+        unsigned long kb = 0;
+        while (fgets(line, sizeof(line), f)) {
+            if (sscanf(line, "VmHWM: %lu kB", &kb) == 1)
+                break;
+        }
+        fclose(f);
+        if (kb)
+            return kb;
+    }
+#endif
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage))
+        return 0;
+#ifdef OS_Darwin
+    return usage.ru_maxrss / 1024;
+#else
+    return usage.ru_maxrss;
+#endif
+}
+
 bool ClangIndexer::exec(const String &data)
 {
+    resetPeakRss();
     Deserializer deserializer(data);
     uint16_t protocolVersion;
     deserializer >> protocolVersion;
@@ -137,6 +183,10 @@ bool ClangIndexer::exec(const String &data)
     if (sServerOpts & Server::NoRealPath) {
         Path::setRealPathEnabled(false);
     }
+    if (!mRemoteDataDir.isEmpty()) {
+        mDataDir = mRemoteDataDir;
+        sServerOpts &= ~Server::PCHEnabled; // the pch would be gone by the next job
+    }
 
 #if 0
     while (true) {
@@ -154,7 +204,9 @@ bool ClangIndexer::exec(const String &data)
 
     const uint64_t parseTime = Rct::currentTimeMs();
 
-    if (niceValue != INT_MIN) {
+    static bool niced = false;
+    if (niceValue != INT_MIN && !niced) {
+        niced = true;
         errno = 0;
         if (nice(niceValue) == -1) {
             error() << "Failed to nice rp" << Rct::strerror();
@@ -191,7 +243,7 @@ bool ClangIndexer::exec(const String &data)
 
     Location::init(blockedFiles);
     Location::set(mSourceFile, mSources.front().fileId);
-    while (true) {
+    while (!mConnection->isConnected()) {
         if (mConnection->connectUnix(socketFile, connectTimeout))
             break;
         if (!--connectAttempts) {
@@ -203,6 +255,7 @@ bool ClangIndexer::exec(const String &data)
     // mLogFile = fopen(String::format("/tmp/%s", mSourceFile.fileName()).constData(), "w");
     mIndexDataMessage.setProject(mProject);
     mIndexDataMessage.setIndexerJobFlags(indexerJobFlags);
+    mDeclarationsOnly = indexerJobFlags & IndexerJob::Declarations;
     mIndexDataMessage.setParseTime(parseTime);
     mIndexDataMessage.setFileId(mSources.front().fileId);
     mIndexDataMessage.setId(id);
@@ -210,7 +263,10 @@ bool ClangIndexer::exec(const String &data)
     assert(mConnection->isConnected());
     assert(mSources.front().fileId);
     mIndexDataMessage.files()[mSources.front().fileId] |= IndexDataMessage::Visited;
-    parse() && visit() && diagnose();
+    if (parse()) {
+        claimIncludes();
+        visit() && diagnose();
+    }
     String message = mSourceFile.toTilde();
     String err;
 
@@ -223,13 +279,22 @@ bool ClangIndexer::exec(const String &data)
             break;
         }
     }
-    if (!hasUnit || !writeFiles(RTags::encodeSourceFilePath(mDataDir, mProject, 0), err)) {
+    const Path root = RTags::encodeSourceFilePath(mDataDir, mProject, 0);
+    if (!hasUnit || !writeFiles(root, err)) {
         message += " error";
         if (!err.isEmpty())
             message += (' ' + err);
     } else {
         writeDuration = sw.elapsed();
-    }
+        IndexerCost cost;
+        cost.parse = mParseDuration;
+        cost.visit = mVisitDuration;
+        cost.write = writeDuration;
+        cost.peakRss = peakRss();
+        mIndexDataMessage.setCost(cost);
+    }
+    if (!mRemoteDataDir.isEmpty())
+        packUnits(root);
     message += String::format<16>(" in %lldms. ", mTimer.elapsed());
     if (mSources.size() > 1) {
         message += String::format("(%zu builds) ", mSources.size());
@@ -244,6 +309,8 @@ bool ClangIndexer::exec(const String &data)
         String queryData;
         if (mFileIdsQueried)
             queryData = String::format(", %d queried %dms", mFileIdsQueried, mFileIdsQueriedTime);
+        if (mFileIdsClaimed > 1)
+            queryData += String::format(", %d round trips saved", mFileIdsClaimed - 1);
         const char *format = "(%d syms, %d symNames, %d includes, %d of %d files, symbols: %d of %d, %d cursors, %zu bytes written%s%s) (%d/%d/%dms)";
         message += String::format<1024>(format, cursorCount, symbolNameCount,
                                         mIndexDataMessage.includes().size(), mIndexed,
@@ -257,6 +324,8 @@ bool ClangIndexer::exec(const String &data)
         message += " (dirty)";
     } else if (mIndexDataMessage.indexerJobFlags() & IndexerJob::Reindex) {
         message += " (reindex)";
+    } else if (mDeclarationsOnly) {
+        message += " (declarations)";
     }
 
 
@@ -266,7 +335,7 @@ bool ClangIndexer::exec(const String &data)
         error() << "Couldn't send IndexDataMessage" << mSourceFile;
         return false;
     }
-    mConnection->finished().connect(std::bind(&EventLoop::quit, EventLoop::eventLoop()));
+    mFinishedKey = mConnection->finished().connect(std::bind(&EventLoop::quit, EventLoop::eventLoop()));
     if (EventLoop::eventLoop()->exec(mIndexDataMessageTimeout) == EventLoop::Timeout) {
         error() << "Timed out sending IndexDataMessage" << mSourceFile;
         return false;
@@ -281,8 +350,8 @@ void ClangIndexer::onMessage(const std::shared_ptr<Message> &msg, const std::sha
 {
     assert(msg->messageId() == VisitFileResponseMessage::MessageId);
     const std::shared_ptr<VisitFileResponseMessage> vm = std::static_pointer_cast<VisitFileResponseMessage>(msg);
-    mVisitFileResponseMessageVisit = vm->visit();
-    mVisitFileResponseMessageFileId = vm->fileId();
+    mVisitFileResponses = vm->files();
+    mVisitFileResponseReceived = true;
     assert(EventLoop::eventLoop());
     EventLoop::eventLoop()->quit();
 }
@@ -336,32 +405,26 @@ Location ClangIndexer::createLocation(const Path &sourceFile, unsigned int line,
     }
 
     ++mFileIdsQueried;
-    VisitFileMessage msg(resolved, mProject, mIndexDataMessage.fileId());
+    VisitFileMessage msg(List<Path>() << resolved, mProject, mIndexDataMessage.fileId(), mIndexDataMessage.id());
 
-    mVisitFileResponseMessageFileId = UINT_MAX;
-    mVisitFileResponseMessageVisit = false;
+    mVisitFileResponseReceived = false;
     mConnection->send(msg);
     StopWatch sw;
     EventLoop::eventLoop()->exec(mVisitFileTimeout);
     const int elapsed = sw.elapsed();
     mFileIdsQueriedTime += elapsed;
-    switch (mVisitFileResponseMessageFileId) {
-    case 0:
-        return Location();
-    case UINT_MAX:
+    if (!mVisitFileResponseReceived || mVisitFileResponses.size() != 1) {
         // timed out.
-        if (mVisitFileResponseMessageFileId == UINT_MAX) {
-            error() << "Error getting fileId for" << resolved << mLastCursor
-                    << elapsed << mVisitFileTimeout;
-        }
+        error() << "Error getting fileId for" << resolved << mLastCursor
+                << elapsed << mVisitFileTimeout;
         exit(1);
-    default:
-        id = mVisitFileResponseMessageFileId;
-        break;
     }
-    assert(id);
+    id = mVisitFileResponses.front().first;
+    if (!id)
+        return Location();
+    const bool visit = mVisitFileResponses.front().second;
     Flags<IndexDataMessage::FileFlag> &flags = mIndexDataMessage.files()[id];
-    if (mVisitFileResponseMessageVisit) {
+    if (visit) {
         flags |= IndexDataMessage::Visited;
         ++mIndexed;
     }
@@ -371,12 +434,82 @@ Location ClangIndexer::createLocation(const Path &sourceFile, unsigned int line,
     if (resolved != sourceFile)
         Location::set(sourceFile, id);
 
-    if (blockedPtr && !mVisitFileResponseMessageVisit) {
+    if (blockedPtr && !visit) {
         *blockedPtr = true;
     }
     return Location(id, line, col);
 }
 
+void ClangIndexer::inclusionVisitor(CXFile includedFile, CXSourceLocation *, unsigned, CXClientData userData)
+{
+    const Path file = RTags::eatString(clang_getFileName(includedFile));
+    if (!file.isEmpty())
+        static_cast<Set<Path> *>(userData)->insert(file);
+}
+
+void ClangIndexer::claimIncludes()
+{
+    // Claim every file the translation units include with a single
+    // VisitFileMessage instead of one round trip per file while visiting.
+    Set<Path> included;
+    for (const auto &unit : mTranslationUnits) {
+        if (unit->unit)
+            clang_getInclusions(unit->unit, inclusionVisitor, &included);
+    }
+
+    List<Path> resolved;
+    Map<Path, List<Path> > aliases;
+    for (const Path &file : included) {
+        if (Location::fileId(file))
+            continue;
+        bool ok;
+        const Path path = file.resolved(Path::RealPath, Path(), &ok);
+        if (!ok)
+            continue;
+        if (const uint32_t id = Location::fileId(path)) {
+            Location::set(file, id);
+            continue;
+        }
+        List<Path> &list = aliases[path];
+        if (list.isEmpty())
+            resolved.append(path);
+        if (path != file)
+            list.append(file);
+    }
+    if (resolved.isEmpty())
+        return;
+
+    VisitFileMessage msg(resolved, mProject, mIndexDataMessage.fileId(), mIndexDataMessage.id());
+    mVisitFileResponseReceived = false;
+    mConnection->send(msg);
+    StopWatch sw;
+    EventLoop::eventLoop()->exec(mVisitFileTimeout);
+    const int elapsed = sw.elapsed();
+    mFileIdsQueriedTime += elapsed;
+    ++mFileIdsQueried;
+    if (!mVisitFileResponseReceived || mVisitFileResponses.size() != resolved.size()) {
+        error() << "Error getting fileIds for" << resolved.size() << "files"
+                << elapsed << mVisitFileTimeout;
+        exit(1);
+    }
+    mFileIdsClaimed = resolved.size();
+
+    for (size_t i=0; i<resolved.size(); ++i) {
+        const uint32_t id = mVisitFileResponses.at(i).first;
+        if (!id)
+            continue;
+        Flags<IndexDataMessage::FileFlag> &flags = mIndexDataMessage.files()[id];
+        if (mVisitFileResponses.at(i).second) {
+            flags |= IndexDataMessage::Visited;
+            ++mIndexed;
+        }
+        const Path &path = resolved.at(i);
+        Location::set(path, id);
+        for (const Path &alias : aliases.value(path))
+            Location::set(alias, id);
+    }
+}
+
 static inline void tokenize(const char *buf, int start,
                             int *templateStart, int *templateEnd,
                             int *sectionCount, int sections[1024])
@@ -735,6 +868,10 @@ CXChildVisitResult ClangIndexer::indexVisitor(CXCursor cursor)
         }
     }
 
+    // The full pass that follows picks up references and literals
+    if (mDeclarationsOnly && (type == RTags::Type_Reference || type == RTags::Type_Literal))
+        return CXChildVisit_Recurse;
+
     CXChildVisitResult visitResult = CXChildVisit_Recurse;
     switch (type) {
     case RTags::Type_Cursor:
@@ -1860,6 +1997,8 @@ bool ClangIndexer::parse()
         pch = false;
         break;
     }
+    if (mDeclarationsOnly)
+        flags |= CXTranslationUnit_SkipFunctionBodies;
 
     List<CXUnsavedFile> unsavedFiles(mUnsavedFiles.size() + 1);
     int unsavedIndex = 0;
@@ -1940,6 +2079,20 @@ static inline void encodeSymbols(Map<Location, Symbol> &symbols)
     }
 }
 
+void ClangIndexer::packUnits(const Path &root)
+{
+    for (const auto &file : mIndexDataMessage.files()) {
+        if (!(file.second & IndexDataMessage::Visited))
+            continue;
+        String unitRoot = root;
+        unitRoot << file.first;
+        const String unit = Path(unitRoot + "/unit").readAll();
+        if (!unit.isEmpty())
+            mIndexDataMessage.units()[file.first] = unit;
+    }
+    Path::rmdir(root);
+}
+
 bool ClangIndexer::writeFiles(const Path &root, String &error)
 {
     size_t bytesWritten = 0;
@@ -1947,25 +2100,26 @@ bool ClangIndexer::writeFiles(const Path &root, String &error)
     const bool hasRoot = Sandbox::hasRoot();
     const uint32_t fileId = mSources.front().fileId;
 
-    auto process = [&](Hash<uint32_t, std::shared_ptr<Unit> >::const_iterator unit) {
+    auto process = [&](Hash<uint32_t, std::shared_ptr<Unit> >::const_iterator unit, const String &info) {
         assert(mIndexDataMessage.files().value(unit->first) & IndexDataMessage::Visited);
         String unitRoot = root;
         unitRoot << unit->first;
         Path::mkdir(unitRoot, Path::Recursive);
         const Path path = Location::path(unit->first);
-        if (unit->first != fileId) {
-            FILE *f = fopen((unitRoot + "/info").constData(), "w");
-            if (!f)
-                return false;
-            bytesWritten += fprintf(f, "%s\nIndexed by %s at %llu\n",
-                                    path.constData(),
-                                    p.constData(), static_cast<unsigned long long>(mIndexDataMessage.parseTime()));
-            fclose(f);
-        }
 
         auto uit = mUnsavedFiles.find(path);
         if (uit == mUnsavedFiles.end()) {
             Path::rm(unitRoot + "/unsaved");
+            // Only files that haven't been touched since we started parsing
+            // are known to have the content we indexed. The time is checked
+            // again after hashing since a write while we read would pair the
+            // new content with the old time.
+            const uint64_t lastModified = path.lastModifiedMs();
+            if (lastModified && lastModified < mIndexDataMessage.parseTime()) {
+                const uint64_t hash = RTags::contentHash(path);
+                if (hash && path.lastModifiedMs() == lastModified)
+                    mIndexDataMessage.contentHashes()[unit->first] = std::make_pair(lastModified, hash);
+            }
         } else {
             FILE *f = fopen((unitRoot + "/unsaved").constData(), "w");
             if (!f)
@@ -1981,47 +2135,40 @@ bool ClangIndexer::writeFiles(const Path &root, String &error)
         //           << unit->second->targets.size()
         //           << unit->second->usrs.size()
         //           << unit->second->symbolNames.size();
-        uint32_t fileMapOpts = 0;
-        if (ClangIndexer::serverOpts() & Server::NoFileLock)
-            fileMapOpts |= FileMap<int, int>::NoLock;
-
         if (hasRoot) {
             encodeSymbols(unit->second->symbols);
             Sandbox::encode(unit->second->usrs);
             Sandbox::encode(unit->second->symbolNames);
         }
 
-        size_t w;
-        // for (const char *name : { "/symbols", "/targets", "/usrs", "/symnames", "/tokens" }) {
-        //     if (Path::exists(unitRoot + "/symbols"))
-        //         ::error() << (unitRoot + name) << "already exists";
-        // }
-        if (!(w = FileMap<Location, Symbol>::write(unitRoot + "/symbols", unit->second->symbols, fileMapOpts))) {
-            error = "Failed to write symbols";
-            return false;
-        }
-        bytesWritten += w;
-
-        if (!(w = FileMap<String, Set<Location> >::write(unitRoot + "/targets", convertTargets(unit->second->targets, hasRoot), fileMapOpts))) {
-            error = "Failed to write targets";
-            return false;
-        }
-        bytesWritten += w;
-
-        if (!(w += FileMap<String, Set<Location> >::write(unitRoot + "/usrs", unit->second->usrs, fileMapOpts))) {
-            error = "Failed to write usrs";
-            return false;
-        }
-        bytesWritten += w;
-
-        if (!(w += FileMap<String, Set<Location> >::write(unitRoot + "/symnames", unit->second->symbolNames, fileMapOpts))) {
-            error = "Failed to write symbolNames";
-            return false;
-        }
-        bytesWritten += w;
-
-        if (!(w += FileMap<uint32_t, Token>::write(unitRoot + "/tokens", unit->second->tokens, fileMapOpts))) {
-            error = "Failed to write symbolNames";
+        // All maps go into one unit file that is published with a single
+        // rename so rdm never sees a half updated unit.
+        Map<UnitFile::Section, String> sections;
+        sections[UnitFile::Symbols] = FileMap<Location, Symbol>::encode(unit->second->symbols);
+
+        Map<Location, SymbolCore> cores;
+        for (const auto &symbol : unit->second->symbols)
+            cores[symbol.first] = SymbolCore(symbol.second);
+        sections[UnitFile::SymbolCores] = FileMap<Location, SymbolCore>::encode(cores);
+        const Map<String, Set<Location> > targets = convertTargets(unit->second->targets, hasRoot);
+        sections[UnitFile::Targets] = FileMap<String, Set<Location> >::encode(targets);
+        sections[UnitFile::Usrs] = FileMap<String, Set<Location> >::encode(unit->second->usrs);
+        {
+            List<uint64_t> hashes;
+            hashes.reserve(targets.size() + unit->second->usrs.size());
+            for (const auto &usr : targets)
+                hashes.append(UsrFilter::hash(usr.first));
+            for (const auto &usr : unit->second->usrs)
+                hashes.append(UsrFilter::hash(usr.first));
+            sections[UnitFile::UsrsFilter] = UsrFilter::create(hashes);
+        }
+        sections[UnitFile::SymbolNames] = FileMap<String, Set<Location> >::encode(unit->second->symbolNames);
+        sections[UnitFile::Tokens] = FileMap<uint32_t, Token>::encode(unit->second->tokens);
+        sections[UnitFile::Info] = info;
+
+        const size_t w = UnitFile::write(unitRoot + "/unit", sections);
+        if (!w) {
+            error = "Failed to write " + unitRoot + "/unit";
             return false;
         }
         bytesWritten += w;
@@ -2044,7 +2191,8 @@ bool ClangIndexer::writeFiles(const Path &root, String &error)
         }
         if (it->first == fileId) {
             self = it;
-        } else if (!process(it)) {
+        } else if (!process(it, String::format("%s\nIndexed by %s at %llu\n", Location::path(it->first).constData(),
+                                               p.constData(), static_cast<unsigned long long>(mIndexDataMessage.parseTime())))) {
             return false;
         }
     }
@@ -2053,31 +2201,16 @@ bool ClangIndexer::writeFiles(const Path &root, String &error)
         for (const std::shared_ptr<Unit> &t : templateSpecializationTargets) {
             self->second->targets.unite(t->targets);
         }
-        if (!process(self)) {
+        String info;
+        for (const Source &source : mSources) {
+            const String args = Sandbox::encoded(String::join(source.toCommandLine(Source::Default|Source::IncludeCompiler|Source::IncludeSourceFile), ' '));
+            info += p + '\n' + args + '\n';
+        }
+        info += String::format<64>("Indexed at %llu\n", static_cast<unsigned long long>(mIndexDataMessage.parseTime()));
+        if (!process(self, info)) {
             return false;
         }
     }
-    String sourceRoot = root;
-    sourceRoot << fileId;
-    Path::mkdir(sourceRoot, Path::Recursive);
-    sourceRoot << "/info";
-    FILE *f = fopen(sourceRoot.constData(), "w");
-    if (!f) {
-        return false;
-    }
-
-    for (const Source &source : mSources) {
-        const String args = Sandbox::encoded(String::join(source.toCommandLine(Source::Default|Source::IncludeCompiler|Source::IncludeSourceFile), ' '));
-
-        bytesWritten += fprintf(f, "%s\n%s\n", p.constData(), args.constData());
-    }
-    bytesWritten += fprintf(f, "Indexed at %llu\n", static_cast<unsigned long long>(mIndexDataMessage.parseTime()));
-
-    if (!templateSpecializationTargets.isEmpty()) {
-
-    }
-
-    fclose(f);
     mIndexDataMessage.setBytesWritten(bytesWritten);
     return true;
 }
@@ -2302,7 +2435,8 @@ bool ClangIndexer::diagnose()
                         clang_disposeSourceRangeList(skipped);
                     }
 #endif
-                    tokenize(file, it.first, path);
+                    if (!mDeclarationsOnly)
+                        tokenize(file, it.first, path);
                 }
             }
         }
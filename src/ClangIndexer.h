@@ -26,24 +26,32 @@
 #include "RTags.h"
 #include "Server.h"
 #include "Symbol.h"
+#include "VisitFileResponseMessage.h"
 #include <unordered_set>
 
 struct Unit;
 class ClangIndexer
 {
 public:
-    ClangIndexer();
+    ClangIndexer(const std::shared_ptr<Connection> &connection = std::shared_ptr<Connection>());
     ~ClangIndexer();
 
     bool exec(const String &data);
+    // tell rdm that this rp won't take any more jobs after this one
+    void setWorkerExit(bool on) { mIndexDataMessage.setFlag(IndexDataMessage::WorkerExit, on); }
+    // rp --remote, write the unit files here instead of rdm's data dir and
+    // send them with the IndexDataMessage
+    void setRemoteDataDir(const Path &dir) { mRemoteDataDir = dir; }
     static Flags<Server::Option> serverOpts() { return sServerOpts; }
     static const Path &serverSandboxRoot() { return sServerSandboxRoot; }
 private:
     bool diagnose();
     bool visit();
     bool parse();
+    void claimIncludes();
     void tokenize(CXFile file, uint32_t fileId, const Path &path);
     bool writeFiles(const Path &root, String &error);
+    void packUnits(const Path &root);
 
     void addFileSymbol(uint32_t file);
     int symbolLength(CXCursorKind kind, const CXCursor &cursor);
@@ -129,6 +137,7 @@ private:
     static CXChildVisitResult visitorHelper(CXCursor cursor, CXCursor, CXClientData userData);
     static CXChildVisitResult verboseVisitor(CXCursor cursor, CXCursor, CXClientData userData);
     static CXChildVisitResult resolveAutoTypeRefVisitor(CXCursor cursor, CXCursor, CXClientData data);
+    static void inclusionVisitor(CXFile includedFile, CXSourceLocation *, unsigned, CXClientData userData);
 
     void onMessage(const std::shared_ptr<Message> &msg, const std::shared_ptr<Connection> &conn);
 
@@ -178,19 +187,21 @@ private:
     CXCursor mLastCursor;
     Symbol *mLastCallExprSymbol;
     Location mLastClass;
-    uint32_t mVisitFileResponseMessageFileId;
-    bool mVisitFileResponseMessageVisit;
+    VisitFileResponseMessage::Files mVisitFileResponses;
+    bool mVisitFileResponseReceived;
     Path mSocketFile;
     StopWatch mTimer;
     int mParseDuration, mVisitDuration, mBlocked, mAllowed,
         mIndexed, mVisitFileTimeout, mIndexDataMessageTimeout,
-        mFileIdsQueried, mFileIdsQueriedTime, mCursorsVisited;
+        mFileIdsQueried, mFileIdsQueriedTime, mFileIdsClaimed, mCursorsVisited;
     UnsavedFiles mUnsavedFiles;
     List<String> mDebugLocations;
     FILE *mLogFile;
     std::shared_ptr<Connection> mConnection;
-    Path mDataDir;
+    unsigned int mNewMessageKey, mFinishedKey;
+    Path mDataDir, mRemoteDataDir;
     bool mUnionRecursion;
+    bool mDeclarationsOnly;
 
     struct Scope {
         enum ScopeType {
@@ -0,0 +1,205 @@
+/* This file is part of RTags (http://rtags.net).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <http://www.gnu.org/licenses/>. */
+
+
+#include "DependencyIndex.h"
+
+#include "Project.h"
+
+DependencyIndex::DependencyIndex()
+    : mStale(true), mRemoved(0), mClosureBytes(0), mHits(0), mMisses(0), mBuilds(0)
+{
+}
+
+Set<uint32_t> DependencyIndex::closure(const Dependencies &dependencies, uint32_t fileId, Direction direction)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    Set<uint32_t> ret;
+    const std::shared_ptr<const Bits> closure = bits(dependencies, fileId, direction);
+    if (!closure)
+        return ret;
+    for (size_t word=0; word<closure->size(); ++word) {
+        uint64_t value = closure->at(word);
+        while (value) {
+            const uint32_t index = (word << 6) + __builtin_ctzll(value);
+            value &= value - 1;
+            if (const uint32_t file = mFileIds.at(index))
+                ret.insert(file);
+        }
+    }
+    return ret;
+}
+
+bool DependencyIndex::contains(const Dependencies &dependencies, uint32_t fileId, Direction direction, uint32_t other)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    const std::shared_ptr<const Bits> closure = bits(dependencies, fileId, direction);
+    const uint32_t index = indexOf(other);
+    return closure && index != UINT32_MAX && test(*closure, index);
+}
+
+std::shared_ptr<const DependencyIndex::Bits> DependencyIndex::bits(const Dependencies &dependencies, uint32_t fileId, Direction direction)
+{
+    // edgeChanged() dropped the closures a change could affect and build()
+    // only renumbers after dropping all of them, the ones that are left
+    // don't need the arrays to be current
+    const auto cached = mClosures[direction].find(fileId);
+    if (cached != mClosures[direction].end()) {
+        ++mHits;
+        return cached->second;
+    }
+    if (mStale)
+        build(dependencies);
+    const uint32_t start = indexOf(fileId);
+    if (start == UINT32_MAX)
+        return std::shared_ptr<const Bits>();
+    ++mMisses;
+
+    const List<uint32_t> &offsets = mOffsets[direction];
+    const List<uint32_t> &edges = mEdges[direction];
+    std::shared_ptr<Bits> closure = std::make_shared<Bits>((mFileIds.size() + 63) / 64, 0);
+    List<uint32_t> stack;
+    stack.append(start);
+    while (!stack.isEmpty()) {
+        const uint32_t index = stack.back();
+        stack.pop_back();
+        for (uint32_t edge = offsets.at(index); edge < offsets.at(index + 1); ++edge) {
+            const uint32_t neighbor = edges.at(edge);
+            uint64_t &word = (*closure)[neighbor >> 6];
+            const uint64_t bit = 1ull << (neighbor & 63);
+            if (!(word & bit)) {
+                word |= bit;
+                stack.append(neighbor);
+            }
+        }
+    }
+
+    const size_t bytes = closure->size() * sizeof(uint64_t);
+    if (mClosureBytes + bytes > MaxClosureBytes) {
+        mClosures[Includes].clear();
+        mClosures[Dependents].clear();
+        mClosureBytes = 0;
+    }
+    mClosures[direction][fileId] = closure;
+    mClosureBytes += bytes;
+    return closure;
+}
+
+void DependencyIndex::build(const Dependencies &dependencies)
+{
+    ++mBuilds;
+    mStale = false;
+    if (mRemoved > mFileIds.size() / 2) {
+        // Renumbering invalidates every closure
+        mIndexes.clear();
+        mFileIds.clear();
+        mRemoved = 0;
+        mClosures[Includes].clear();
+        mClosures[Dependents].clear();
+        mClosureBytes = 0;
+    }
+    for (uint32_t index=0; index<mFileIds.size(); ++index) {
+        const uint32_t fileId = mFileIds.at(index);
+        if (fileId && !dependencies.contains(fileId)) {
+            mIndexes.remove(fileId);
+            mFileIds[index] = 0;
+            ++mRemoved;
+        }
+    }
+    for (const auto &dep : dependencies) {
+        if (!mIndexes.contains(dep.first)) {
+            mIndexes[dep.first] = mFileIds.size();
+            mFileIds.append(dep.first);
+        }
+    }
+
+    const uint32_t count = mFileIds.size();
+    for (const Direction direction : { Includes, Dependents }) {
+        List<uint32_t> &offsets = mOffsets[direction];
+        List<uint32_t> &edges = mEdges[direction];
+        offsets.clear();
+        offsets.resize(count + 1, 0);
+        for (const auto &dep : dependencies) {
+            const Dependencies &neighbors = direction == Includes ? dep.second->includes : dep.second->dependents;
+            offsets[mIndexes.value(dep.first) + 1] = neighbors.size();
+        }
+        for (uint32_t index=0; index<count; ++index)
+            offsets[index + 1] += offsets.at(index);
+        edges.resize(offsets.at(count));
+        for (const auto &dep : dependencies) {
+            const Dependencies &neighbors = direction == Includes ? dep.second->includes : dep.second->dependents;
+            uint32_t edge = offsets.at(mIndexes.value(dep.first));
+            for (const auto &neighbor : neighbors) {
+                assert(mIndexes.contains(neighbor.first));
+                edges[edge++] = mIndexes.value(neighbor.first);
+            }
+        }
+    }
+}
+
+void DependencyIndex::edgeChanged(uint32_t includer, uint32_t includee)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    mStale = true;
+    // Only closures that reach the edge can change: the includes of files
+    // that include includer and the dependents of files includee includes.
+    const struct {
+        Direction direction;
+        uint32_t fileId;
+    } affected[] = { { Includes, includer }, { Dependents, includee } };
+    for (const auto &it : affected) {
+        const uint32_t index = indexOf(it.fileId);
+        Hash<uint32_t, std::shared_ptr<const Bits> > &closures = mClosures[it.direction];
+        auto closure = closures.begin();
+        while (closure != closures.end()) {
+            if (closure->first == it.fileId || (index != UINT32_MAX && test(*closure->second, index))) {
+                mClosureBytes -= closure->second->size() * sizeof(uint64_t);
+                closure = closures.erase(closure);
+            } else {
+                ++closure;
+            }
+        }
+    }
+}
+
+void DependencyIndex::fileRemoved(uint32_t fileId)
+{
+    edgeChanged(fileId, fileId);
+}
+
+void DependencyIndex::clear()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    mStale = true;
+    mIndexes.clear();
+    mFileIds.clear();
+    mRemoved = 0;
+    for (const Direction direction : { Includes, Dependents }) {
+        mOffsets[direction].clear();
+        mEdges[direction].clear();
+        mClosures[direction].clear();
+    }
+    mClosureBytes = 0;
+}
+
+String DependencyIndex::toString() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return String::format<256>("%zu files, %zu edges, %zu cached closures (%zu bytes), %llu hits, %llu misses, %llu builds",
+                               mFileIds.size() - mRemoved, mEdges[Includes].size(),
+                               mClosures[Includes].size() + mClosures[Dependents].size(), mClosureBytes,
+                               static_cast<unsigned long long>(mHits), static_cast<unsigned long long>(mMisses),
+                               static_cast<unsigned long long>(mBuilds));
+}
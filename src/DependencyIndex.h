@@ -0,0 +1,89 @@
+/* This file is part of RTags (http://rtags.net).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <http://www.gnu.org/licenses/>. */
+
+
+#ifndef DependencyIndex_h
+#define DependencyIndex_h
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+
+#include "rct/Hash.h"
+#include "rct/List.h"
+#include "rct/Set.h"
+#include "RTags.h"
+
+/*
+ * Transitive closures over a project's DependencyNodes. The graph is copied
+ * into flat adjacency arrays (compressed sparse rows) when a closure is
+ * needed and the graph changed since the last copy. Closures are kept as
+ * bitsets over the same dense file indexes so testing whether a file is in
+ * one is a single bit probe. A file keeps its index until the arrays are
+ * renumbered which only happens when many files have been removed, closures
+ * that a change can't affect stay cached.
+ */
+class DependencyIndex
+{
+public:
+    enum Direction {
+        Includes, // files the file includes, directly or not
+        Dependents // files that include the file, directly or not
+    };
+
+    DependencyIndex();
+
+    // Neither contain fileId itself unless it's part of a cycle
+    Set<uint32_t> closure(const Dependencies &dependencies, uint32_t fileId, Direction direction);
+    bool contains(const Dependencies &dependencies, uint32_t fileId, Direction direction, uint32_t other);
+
+    // includer started or stopped including includee
+    void edgeChanged(uint32_t includer, uint32_t includee);
+    void fileRemoved(uint32_t fileId);
+    void clear();
+
+    String toString() const;
+private:
+    enum {
+        MaxClosureBytes = 64 * 1024 * 1024
+    };
+    typedef List<uint64_t> Bits;
+    static bool test(const Bits &bits, uint32_t index)
+    {
+        return (index >> 6) < bits.size() && (bits.at(index >> 6) & (1ull << (index & 63)));
+    }
+    void build(const Dependencies &dependencies);
+    // Called with mMutex held, only builds on a miss
+    std::shared_ptr<const Bits> bits(const Dependencies &dependencies, uint32_t fileId, Direction direction);
+    uint32_t indexOf(uint32_t fileId) const
+    {
+        const auto it = mIndexes.find(fileId);
+        return it == mIndexes.end() ? UINT32_MAX : it->second;
+    }
+
+    mutable std::mutex mMutex;
+    bool mStale;
+    Hash<uint32_t, uint32_t> mIndexes; // fileId -> dense index
+    List<uint32_t> mFileIds; // dense index -> fileId, 0 for removed files
+    uint32_t mRemoved;
+    // mOffsets[direction][index] .. mOffsets[direction][index + 1] is the
+    // range of mEdges[direction] with the neighbors of index
+    List<uint32_t> mOffsets[2], mEdges[2];
+    Hash<uint32_t, std::shared_ptr<const Bits> > mClosures[2];
+    size_t mClosureBytes;
+    uint64_t mHits, mMisses, mBuilds;
+};
+
+#endif
@@ -17,16 +17,122 @@
 #define FileMap_h
 
 #include <assert.h>
+#include <ctype.h>
 #include <fcntl.h>
+#include <stdio.h>
 #include <sys/file.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <strings.h>
+#include <unistd.h>
+#include <algorithm>
 #include <functional>
 #include <limits>
+#include <memory>
+#include <type_traits>
 
 #include "Location.h"
 #include "rct/Serializer.h"
 
+/*
+ * FileMaps are never modified in place. They are written to a temporary file
+ * next to their final path and renamed into place so readers can map them
+ * without any locking and always see either the old or the new file. They're
+ * derived from the sources and can be rebuilt so they aren't synced, only
+ * what can't be is, see FileMapSync.
+ */
+inline Path fileMapTempPath(const Path &path)
+{
+    return path + ".tmp";
+}
+
+inline bool publishFileMap(const Path &path)
+{
+    const Path tmp = fileMapTempPath(path);
+    if (rename(tmp.constData(), path.constData())) {
+        unlink(tmp.constData());
+        return false;
+    }
+    return true;
+}
+
+enum FileMapSync {
+    NoSync,
+    Sync // survives power loss, for the project files
+};
+
+inline bool writeFileMapData(const Path &path, const String &data, FileMapSync sync = NoSync)
+{
+    const Path tmp = fileMapTempPath(path);
+    FILE *f = fopen(tmp.constData(), "w");
+    if (!f)
+        return false;
+    const bool ok = (fwrite(data.constData(), data.size(), 1, f) && !fflush(f)
+                     && (sync == NoSync || !fsync(fileno(f))));
+    fclose(f);
+    if (!ok || !publishFileMap(path)) {
+        unlink(tmp.constData());
+        return false;
+    }
+    return true;
+}
+
+/*
+ * A non-owning reference to a serialized String inside a mapped FileMap. Only
+ * valid for as long as the FileMap it came from.
+ */
+class StringView
+{
+public:
+    StringView()
+        : mData(0), mSize(0)
+    {}
+    StringView(const char *data, uint32_t size)
+        : mData(data), mSize(size)
+    {}
+
+    const char *data() const { return mData; }
+    uint32_t size() const { return mSize; }
+    bool isEmpty() const { return !mSize; }
+    String toString() const { return String(mData, mSize); }
+
+    int compare(const char *str, size_t size) const
+    {
+        const int cmp = memcmp(mData, str, std::min<size_t>(mSize, size));
+        if (cmp)
+            return cmp;
+        if (mSize < size)
+            return -1;
+        return mSize > size ? 1 : 0;
+    }
+    int compare(const String &str) const { return compare(str.constData(), str.size()); }
+    bool operator==(const String &str) const { return mSize == str.size() && !memcmp(mData, str.constData(), mSize); }
+    bool operator!=(const String &str) const { return !operator==(str); }
+
+    bool startsWith(const String &str, String::CaseSensitivity cs = String::CaseSensitive) const
+    {
+        if (str.size() > mSize)
+            return false;
+        if (cs == String::CaseInsensitive)
+            return !strncasecmp(mData, str.constData(), str.size());
+        return !memcmp(mData, str.constData(), str.size());
+    }
+
+    bool contains(const String &str, String::CaseSensitivity cs = String::CaseSensitive) const
+    {
+        const char *end = mData + mSize;
+        if (cs == String::CaseInsensitive) {
+            return std::search(mData, end, str.constData(), str.constData() + str.size(), [](char l, char r) {
+                    return tolower(static_cast<unsigned char>(l)) == tolower(static_cast<unsigned char>(r));
+                }) != end;
+        }
+        return std::search(mData, end, str.constData(), str.constData() + str.size()) != end;
+    }
+private:
+    const char *mData;
+    uint32_t mSize;
+};
+
 template <typename T> inline static int compare(const T &l, const T &r)
 {
     if (l < r)
@@ -51,7 +157,7 @@ class FileMap
 {
 public:
     FileMap()
-        : mPointer(0), mSize(0), mCount(0), mValuesOffset(0), mFD(-1), mOptions(0)
+        : mPointer(0), mSize(0), mCount(0), mValuesOffset(0), mFD(-1)
     {}
 
     ~FileMap()
@@ -59,15 +165,16 @@ public:
         if (mFD != -1) {
             assert(mPointer);
             munmap(const_cast<char*>(mPointer), mSize);
-            if (!(mOptions & NoLock))
-                lock(mFD, Unlock);
             int ret;
             eintrwrap(ret, close(mFD));
         }
     }
 
-    void init(const char *pointer, uint32_t size)
+    // owner keeps pointer valid for as long as this FileMap, e.g. the mapping
+    // of a UnitFile that pointer is a section of
+    void init(const char *pointer, uint32_t size, const std::shared_ptr<const void> &owner = std::shared_ptr<const void>())
     {
+        mOwner = owner;
         mPointer = pointer;
         mSize = size;
         memcpy(&mCount, mPointer, sizeof(uint32_t));
@@ -76,9 +183,9 @@ public:
 
     enum Options {
         None = 0x0,
-        NoLock = 0x1
+        DontPublish = 0x1 // leave the data in fileMapTempPath(path), see publishFileMap()
     };
-    bool load(const Path &path, uint32_t options, String *error = 0)
+    bool load(const Path &path, String *error = 0)
     {
         eintrwrap(mFD, open(path.constData(), O_RDONLY));
         if (mFD == -1) {
@@ -88,16 +195,6 @@ public:
             }
             return false;
         }
-        if (!(options & NoLock) && !lock(mFD, Read)) {
-            if (error) {
-                *error = Rct::strerror();
-                *error << " " << __LINE__;
-            }
-
-            close(mFD);
-            mFD = -1;
-            return false;
-        }
 
         struct stat st;
         if (fstat(mFD, &st)) {
@@ -105,7 +202,6 @@ public:
                 *error = Rct::strerror();
                 *error << " " << __LINE__;
             }
-            lock(mFD, Unlock);
             int ret;
             eintrwrap(ret, close(mFD));
             mFD = -1;
@@ -119,14 +215,12 @@ public:
                 *error = Rct::strerror();
                 *error << " " << __LINE__;
             }
-            lock(mFD, Unlock);
             int ret;
             eintrwrap(ret, close(mFD));
             mFD = -1;
             return false;
         }
 
-        mOptions = options;
         init(pointer, st.st_size);
         return true;
     }
@@ -157,6 +251,53 @@ public:
         return read<Value>(valuesSegment(), index);
     }
 
+    // Only meaningful for String keys, no copy is made
+    StringView keyViewAt(uint32_t index) const
+    {
+        static_assert(std::is_same<Key, String>::value, "keyViewAt() requires String keys");
+        assert(index >= 0 && index < mCount);
+        uint32_t offset, size;
+        memcpy(&offset, keysSegment() + (sizeof(uint32_t) * index), sizeof(offset));
+        memcpy(&size, mPointer + offset, sizeof(size));
+        return StringView(mPointer + offset + sizeof(uint32_t), size);
+    }
+
+    class KeyViewIterator
+    {
+    public:
+        KeyViewIterator(const FileMap *map, uint32_t index)
+            : mMap(map), mIndex(index)
+        {}
+
+        StringView operator*() const { return mMap->keyViewAt(mIndex); }
+        uint32_t index() const { return mIndex; }
+        KeyViewIterator &operator++() { ++mIndex; return *this; }
+        KeyViewIterator operator++(int) { KeyViewIterator ret = *this; ++mIndex; return ret; }
+        bool operator==(const KeyViewIterator &other) const { return mIndex == other.mIndex; }
+        bool operator!=(const KeyViewIterator &other) const { return mIndex != other.mIndex; }
+    private:
+        const FileMap *mMap;
+        uint32_t mIndex;
+    };
+
+    class KeyViewRange
+    {
+    public:
+        KeyViewRange(const FileMap *map, uint32_t from, uint32_t to)
+            : mBegin(map, from), mEnd(map, to)
+        {}
+        KeyViewIterator begin() const { return mBegin; }
+        KeyViewIterator end() const { return mEnd; }
+    private:
+        const KeyViewIterator mBegin, mEnd;
+    };
+
+    // Iterates keys [from, count())
+    KeyViewRange keyViews(uint32_t from = 0) const
+    {
+        return KeyViewRange(this, std::min(from, mCount), mCount);
+    }
+
     uint32_t lowerBound(const Key &k, bool *match = 0) const
     {
         if (!mCount) {
@@ -170,7 +311,7 @@ public:
 
         do {
             const int mid = lower + ((upper - lower) / 2);
-            const int cmp = compare<Key>(k, keyAt(mid));
+            const int cmp = compareKeyAt(k, mid, std::is_same<Key, String>());
             if (cmp < 0) {
                 upper = mid - 1;
             } else if (cmp > 0) {
@@ -235,55 +376,38 @@ public:
         }
         return out;
     }
-    static size_t write(const Path &path, const Map<Key, Value> &map, uint32_t options)
+    static size_t write(const Path &path, const Map<Key, Value> &map, uint32_t options = None)
     {
-        int fd = open(path.constData(), O_RDWR|O_CREAT, 0644);
+        const Path tmp = fileMapTempPath(path);
+        int fd = open(tmp.constData(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
         if (fd == -1) {
             if (!Path::mkdir(path.parentDir(), Path::Recursive))
                 return 0;
-            fd = open(path.constData(), O_RDWR|O_CREAT, 0644);
+            fd = open(tmp.constData(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
             if (fd == -1)
                 return 0;
         }
-        if (!(options & NoLock) && !lock(fd, Write)) {
-            ::close(fd);
-            return 0;
-        }
         const String data = encode(map);
-        bool ok = ::ftruncate(fd, data.size()) != -1;
+        const bool ok = ::write(fd, data.constData(), data.size()) == static_cast<ssize_t>(data.size());
+        ::close(fd);
         if (!ok) {
-            if (!(options & NoLock))
-                lock(fd, Unlock);
-            ::close(fd);
+            unlink(tmp.constData());
             return 0;
         }
-
-        ok = ::write(fd, data.constData(), data.size()) == static_cast<ssize_t>(data.size());
-        if (!(options & NoLock))
-            ok = lock(fd, Unlock) && ok;
-
-        ::close(fd);
-        if (!ok)
-            unlink(path.constData());
-        return ok ? data.size() : 0;
+        if (!(options & DontPublish) && !publishFileMap(path))
+            return 0;
+        return data.size();
     }
 private:
-    enum Mode {
-        Read = F_RDLCK,
-        Write = F_WRLCK,
-        Unlock = F_UNLCK
-    };
-    static bool lock(int fd, Mode mode)
+    int compareKeyAt(const Key &key, uint32_t index, std::false_type) const
+    {
+        return compare<Key>(key, keyAt(index));
+    }
+    int compareKeyAt(const Key &key, uint32_t index, std::true_type) const
     {
-        struct flock fl;
-        memset(&fl, 0, sizeof(fl));
-        fl.l_type = mode;
-        fl.l_whence = SEEK_SET;
-        fl.l_pid = getpid();
-        int ret;
-        eintrwrap(ret, fcntl(fd, F_SETLKW, &fl));
-        return ret != -1;
+        return -keyViewAt(index).compare(key);
     }
+
     const char *valuesSegment() const { return mPointer + mValuesOffset; }
     const char *keysSegment() const { return mPointer + (sizeof(uint32_t) * 2); }
 
@@ -308,7 +432,7 @@ private:
     uint32_t mCount;
     uint32_t mValuesOffset;
     int mFD;
-    uint32_t mOptions;
+    std::shared_ptr<const void> mOwner;
 };
 
 #endif
@@ -0,0 +1,121 @@
+/* This file is part of RTags (http://rtags.net).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include "FileMapCache.h"
+
+FileMapCache::FileMapCache(size_t maxSize)
+    : mMaxSize(maxSize), mSize(0), mHits(0), mMisses(0)
+{
+}
+
+std::shared_ptr<void> FileMapCache::find(const void *owner, uint32_t type, uint32_t fileId, uint32_t generation)
+{
+    const Key key = { owner, fileId, type };
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto it = mEntries.find(key);
+    if (it == mEntries.end()) {
+        ++mMisses;
+        return std::shared_ptr<void>();
+    }
+    const std::shared_ptr<Entry> entry = it->second;
+    if (entry->generation != generation) {
+        removeEntry(it);
+        ++mMisses;
+        return std::shared_ptr<void>();
+    }
+    ++mHits;
+    mList.remove(entry);
+    mList.append(entry);
+    return entry->fileMap;
+}
+
+void FileMapCache::insert(const void *owner, uint32_t type, uint32_t fileId, uint32_t generation,
+                          const std::shared_ptr<void> &fileMap, size_t mapped)
+{
+    assert(fileMap);
+    const Key key = { owner, fileId, type };
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (mapped > mMaxSize)
+        return;
+    auto it = mEntries.find(key);
+    if (it != mEntries.end()) {
+        // another thread loaded the same map in the meantime, keep the newest generation
+        if (it->second->generation > generation)
+            return;
+        removeEntry(it);
+    }
+    auto entry = std::make_shared<Entry>(key, generation, fileMap);
+    mEntries[key] = entry;
+    mList.append(entry);
+    std::pair<size_t, uint32_t> &file = mFiles[std::make_pair(owner, fileId)];
+    if (!file.second++) {
+        file.first = mapped;
+        mSize += mapped;
+    }
+    while (mSize > mMaxSize) {
+        const std::shared_ptr<Entry> e = mList.first();
+        assert(e);
+        removeEntry(mEntries.find(e->key));
+    }
+}
+
+void FileMapCache::remove(const void *owner, uint32_t fileId)
+{
+    const Key key = { owner, fileId, 0 };
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto it = mEntries.lower_bound(key);
+    while (it != mEntries.end() && it->first.owner == owner && it->first.fileId == fileId)
+        removeEntry(it++);
+}
+
+void FileMapCache::remove(const void *owner)
+{
+    const Key key = { owner, 0, 0 };
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto it = mEntries.lower_bound(key);
+    while (it != mEntries.end() && it->first.owner == owner)
+        removeEntry(it++);
+}
+
+void FileMapCache::clear()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    while (!mEntries.isEmpty())
+        removeEntry(mEntries.begin());
+}
+
+void FileMapCache::removeEntry(Map<Key, std::shared_ptr<Entry> >::iterator it)
+{
+    assert(it != mEntries.end());
+    auto file = mFiles.find(std::make_pair(it->first.owner, it->first.fileId));
+    assert(file != mFiles.end());
+    if (!--file->second.second) {
+        mSize -= file->second.first;
+        mFiles.erase(file);
+    }
+    mList.remove(it->second);
+    mEntries.erase(it);
+}
+
+String FileMapCache::toString() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    const uint64_t total = mHits + mMisses;
+    return String::format<256>("%zu file maps of %zu files, %.1f/%.1fmb mapped, %llu hits, %llu misses (%.1f%% hit rate)",
+                               mEntries.size(), mFiles.size(), mSize / (1024.0 * 1024.0), mMaxSize / (1024.0 * 1024.0),
+                               static_cast<unsigned long long>(mHits),
+                               static_cast<unsigned long long>(mMisses),
+                               total ? (static_cast<double>(mHits) * 100.0 / total) : 0.0);
+}
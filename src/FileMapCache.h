@@ -0,0 +1,86 @@
+/* This file is part of RTags (http://rtags.net).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef FileMapCache_h
+#define FileMapCache_h
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+
+#include "rct/EmbeddedLinkedList.h"
+#include "rct/Map.h"
+#include "rct/String.h"
+
+/*
+ * Server wide LRU of loaded FileMaps that outlives a single query. Entries are
+ * keyed by owner (the Project), file map type and fileId and carry the
+ * generation of the file they were loaded at. A lookup with a different
+ * generation is a miss. Thread safe.
+ *
+ * The cache is bounded by the bytes its entries keep mapped. The FileMaps of
+ * one file share the mapping of its unit file so that is counted once per
+ * file, for as long as any of them is cached.
+ */
+class FileMapCache
+{
+public:
+    FileMapCache(size_t maxSize);
+
+    std::shared_ptr<void> find(const void *owner, uint32_t type, uint32_t fileId, uint32_t generation);
+    // mapped is the size of the mapping fileMap keeps alive
+    void insert(const void *owner, uint32_t type, uint32_t fileId, uint32_t generation,
+                const std::shared_ptr<void> &fileMap, size_t mapped);
+    void remove(const void *owner, uint32_t fileId);
+    void remove(const void *owner);
+    void clear();
+
+    String toString() const;
+private:
+    struct Key {
+        const void *owner;
+        uint32_t fileId, type;
+        bool operator<(const Key &other) const
+        {
+            if (owner != other.owner)
+                return owner < other.owner;
+            if (fileId != other.fileId)
+                return fileId < other.fileId;
+            return type < other.type;
+        }
+    };
+    struct Entry {
+        Entry(const Key &k, uint32_t g, const std::shared_ptr<void> &f)
+            : key(k), generation(g), fileMap(f)
+        {}
+        const Key key;
+        const uint32_t generation;
+        const std::shared_ptr<void> fileMap;
+
+        std::shared_ptr<Entry> next, prev;
+    };
+    void removeEntry(Map<Key, std::shared_ptr<Entry> >::iterator it);
+
+    mutable std::mutex mMutex;
+    const size_t mMaxSize;
+    size_t mSize;
+    Map<Key, std::shared_ptr<Entry> > mEntries;
+    // owner and fileId -> mapped bytes and number of entries
+    Map<std::pair<const void *, uint32_t>, std::pair<size_t, uint32_t> > mFiles;
+    EmbeddedLinkedList<std::shared_ptr<Entry> > mList;
+    uint64_t mHits, mMisses;
+};
+
+#endif
@@ -37,29 +37,29 @@ int FindSymbolsJob::execute()
 {
     int ret = 2;
     if (std::shared_ptr<Project> proj = project()) {
-        Set<Symbol> symbols;
-        auto inserter = [proj, this, &symbols](Project::SymbolMatchType type,
-                                               const String &symbolName,
-                                               const Set<Location> &locations) {
+        // The order of the output depends on all matches so they have to be
+        // collected, but only the symbols that make it past --max are sorted.
+        Set<Location> matches;
+        auto inserter = [this, &matches](Project::SymbolMatchType type,
+                                         const String &symbolName,
+                                         const Set<Location> &locations) {
             if (type == Project::StartsWith) {
                 const size_t paren = symbolName.indexOf('(');
                 if (paren == String::npos || paren != string.size() || RTags::isFunctionVariable(symbolName))
                     return;
             }
-            for (const auto &it : locations) {
-                const Symbol sym = proj->findSymbol(it);
-                if (!sym.isNull() || sym.flags & Symbol::FileSymbol)
-                    symbols.insert(sym);
+            for (Location location : locations) {
+                if (filterLocation(location))
+                    matches.insert(location);
             }
         };
         proj->findSymbols(string, inserter, queryFlags(), fileFilter());
-        if (!symbols.isEmpty()) {
-            const List<RTags::SortedSymbol> sorted = proj->sort(symbols, queryFlags());
-            const Flags<WriteFlag> writeFlags = fileFilter() ? Unfiltered : NoWriteFlags;
+        if (!matches.isEmpty() && !isAborted()) {
+            const List<RTags::SortedSymbol> sorted = proj->sort(matches, queryFlags(), queryMessage()->max());
             const int count = sorted.size();
             ret = count ? 0 : 1;
-            for (int i=0; i<count; ++i) {
-                write(sorted.at(i).location, writeFlags);
+            for (int i=0; i<count && !isFull() && !isAborted(); ++i) {
+                write(sorted.at(i).location, Unfiltered);
             }
         }
     }
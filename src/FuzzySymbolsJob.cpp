@@ -0,0 +1,217 @@
+/* This file is part of RTags (http://rtags.net).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include "FuzzySymbolsJob.h"
+
+#include <ctype.h>
+#include <string.h>
+#include <algorithm>
+#include <set>
+
+#include "Project.h"
+#include "QueryMessage.h"
+#include "rct/Hash.h"
+#include "rct/Log.h"
+#include "RTags.h"
+
+static inline Flags<QueryJob::JobFlag> jobFlags(Flags<QueryMessage::Flag> queryFlags)
+{
+    return (queryFlags & QueryMessage::Elisp
+            ? QueryJob::QuoteOutput|QueryJob::QuietJob|QueryJob::WriteUnfiltered
+            : QueryJob::QuietJob|QueryJob::WriteUnfiltered);
+}
+
+FuzzySymbolsJob::FuzzySymbolsJob(const std::shared_ptr<QueryMessage> &query, const std::shared_ptr<Project> &proj)
+    : QueryJob(query, proj, ::jobFlags(query->flags())), string(query->query())
+{
+}
+
+static inline bool isBoundary(const char *name, size_t idx)
+{
+    if (!idx)
+        return true;
+    const char prev = name[idx - 1];
+    switch (prev) {
+    case ':':
+    case '_':
+    case '(':
+    case ' ':
+    case ',':
+    case '&':
+    case '*':
+    case '~':
+        return true;
+    default:
+        break;
+    }
+    return isupper(static_cast<unsigned char>(name[idx])) && islower(static_cast<unsigned char>(prev));
+}
+
+int FuzzySymbolsJob::score(const String &pattern, const String &lowerPattern, const char *name, size_t size)
+{
+    enum {
+        MatchScore = 1,
+        CaseScore = 1,
+        BoundaryScore = 8,
+        ConsecutiveScore = 5,
+        MaxGapPenalty = 5,
+        ExactScore = 10
+    };
+    const char *end = name + size;
+    const char *pos = name;
+    const size_t count = lowerPattern.size();
+    int ret = 0;
+    size_t last = String::npos;
+    for (size_t i=0; i<count; ++i) {
+        // memchr is vectorized in libc, look for both cases and take the first
+        const char lower = lowerPattern.at(i);
+        const char upper = static_cast<char>(toupper(static_cast<unsigned char>(lower)));
+        const char *found = static_cast<const char*>(memchr(pos, lower, end - pos));
+        if (upper != lower) {
+            if (const char *u = static_cast<const char*>(memchr(pos, upper, (found ? found : end) - pos)))
+                found = u;
+        }
+        if (!found)
+            return -1;
+
+        const size_t idx = found - name;
+        ret += MatchScore;
+        if (*found == pattern.at(i))
+            ret += CaseScore;
+        if (isBoundary(name, idx))
+            ret += BoundaryScore;
+        if (last != String::npos) {
+            if (idx == last + 1) {
+                ret += ConsecutiveScore;
+            } else {
+                ret -= std::min<int>(idx - last - 1, MaxGapPenalty);
+            }
+        }
+        last = idx;
+        pos = found + 1;
+    }
+    if (size == count)
+        ret += ExactScore;
+    ret -= static_cast<int>(size / 16); // prefer shorter names
+    return ret;
+}
+
+struct Candidate
+{
+    int score;
+    String name;
+
+    bool operator<(const Candidate &other) const
+    {
+        // the worse candidate is the smaller one
+        return score < other.score || (score == other.score && name > other.name);
+    }
+};
+
+int FuzzySymbolsJob::execute()
+{
+    std::shared_ptr<Project> proj = project();
+    if (!proj || string.isEmpty())
+        return 1;
+
+    int max = queryMessage()->max();
+    if (max <= 0)
+        max = DefaultMax;
+
+    enum {
+        Definition = 0x1,
+        Container = 0x2,
+        DefinitionBonus = 6,
+        ContainerBonus = 2
+    };
+    auto bonus = [](unsigned int flags) {
+        return (flags & Definition ? DefinitionBonus : 0) + (flags & Container ? ContainerBonus : 0);
+    };
+
+    const String lowerPattern = string.toLower();
+    // the best names so far, worst first, and what their locations turned out to be
+    std::set<Candidate> best;
+    Hash<String, unsigned int> flags;
+    int scanned = 0;
+    bool aborted = false;
+    auto visitor = [&](const StringView &name, const std::function<Set<Location>()> &locations) {
+        if (!(++scanned % 10000) && (aborted = isAborted()))
+            return false;
+        const int s = score(string, lowerPattern, name.data(), name.size());
+        if (s < 0)
+            return true;
+        if (best.size() == static_cast<size_t>(max) && s + DefinitionBonus + ContainerBonus < best.begin()->score)
+            return true;
+
+        // Names can show up more than once when they're in more than one
+        // segment of the index or in the per-file map of a dirty file.
+        String key = name.toString();
+        const auto existing = flags.find(key);
+        const unsigned int old = existing != flags.end() ? existing->second : 0;
+        if (old == (Definition|Container))
+            return true;
+
+        // The kind and path filters decide whether a name is a candidate at
+        // all so they have to run before it can push out another one.
+        unsigned int found = old;
+        bool matched = false;
+        for (Location loc : locations()) {
+            if (!filterLocation(loc))
+                continue;
+            const SymbolCore core = proj->findSymbolCore(loc);
+            if (core.isNull() || !filterKind(core))
+                continue;
+            matched = true;
+            if (core.isDefinition())
+                found |= Definition;
+            if (core.isContainer())
+                found |= Container;
+        }
+        if (existing != flags.end()) {
+            if (found != old) {
+                best.erase(Candidate { s + bonus(old), key });
+                best.insert(Candidate { s + bonus(found), key });
+                existing->second = found;
+            }
+            return true;
+        }
+        if (!matched)
+            return true;
+        Candidate candidate { s + bonus(found), std::move(key) };
+        if (best.size() == static_cast<size_t>(max)) {
+            if (!(*best.begin() < candidate))
+                return true;
+            flags.remove(best.begin()->name);
+            best.erase(best.begin());
+        }
+        flags[candidate.name] = found;
+        best.insert(std::move(candidate));
+        return true;
+    };
+    proj->visitSymbolNames(fileFilter(), visitor);
+    if (aborted || isAborted())
+        return 1;
+
+    const bool elisp = queryFlags() & QueryMessage::Elisp;
+    if (elisp)
+        write("(list", IgnoreMax | DontQuote);
+    for (auto it = best.rbegin(); it != best.rend(); ++it) {
+        if (!write(it->name))
+            break;
+    }
+    if (elisp)
+        write(")", IgnoreMax | DontQuote);
+    return best.empty() ? 1 : 0;
+}
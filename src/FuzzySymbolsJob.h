@@ -0,0 +1,42 @@
+/* This file is part of RTags (http://rtags.net).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef FuzzySymbolsJob_h
+#define FuzzySymbolsJob_h
+
+#include "QueryJob.h"
+#include "rct/String.h"
+
+class QueryMessage;
+class FuzzySymbolsJob : public QueryJob
+{
+public:
+    FuzzySymbolsJob(const std::shared_ptr<QueryMessage> &query, const std::shared_ptr<Project> &project);
+
+    enum { DefaultMax = 100 };
+
+    /*
+     * Returns the score of name as a fuzzy match of pattern, a higher score is
+     * a better match. Returns -1 if pattern isn't a case insensitive
+     * subsequence of name. lowerPattern is pattern in lower case.
+     */
+    static int score(const String &pattern, const String &lowerPattern, const char *name, size_t size);
+protected:
+    virtual int execute() override;
+private:
+    const String string;
+};
+
+#endif
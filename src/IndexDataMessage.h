@@ -43,7 +43,8 @@ public:
         None = 0x0,
         ParseFailure = 0x1,
         InclusionError = 0x2,
-        UsedPCH = 0x4
+        UsedPCH = 0x4,
+        WorkerExit = 0x8 // rp exits after sending this message
     };
     Flags<Flag> flags() const { return mFlags; }
     void setFlags(Flags<Flag> f) { mFlags = f; }
@@ -102,6 +103,20 @@ public:
     size_t bytesWritten() const { return mBytesWritten; }
     void setBytesWritten(size_t bytes) { mBytesWritten = bytes; }
 
+    const IndexerCost &cost() const { return mCost; }
+    void setCost(const IndexerCost &cost) { mCost = cost; }
+
+    // fileId -> (last modified, RTags::contentHash) of the visited files as
+    // they were parsed
+    typedef Hash<uint32_t, std::pair<uint64_t, uint64_t> > ContentHashes;
+    ContentHashes &contentHashes() { return mContentHashes; }
+    const ContentHashes &contentHashes() const { return mContentHashes; }
+
+    // fileId -> unit file, only sent by rp --remote which can't write to
+    // rdm's data dir
+    Hash<uint32_t, String> &units() { return mUnits; }
+    const Hash<uint32_t, String> &units() const { return mUnits; }
+
     SourceList sources() const { return mSources; }
     void setSources(const SourceList &srcs) { mSources = srcs; }
 private:
@@ -116,6 +131,9 @@ private:
     Hash<uint32_t, Flags<FileFlag> > mFiles;
     Flags<Flag> mFlags;
     size_t mBytesWritten;
+    IndexerCost mCost;
+    ContentHashes mContentHashes;
+    Hash<uint32_t, String> mUnits;
     SourceList mSources;
 };
 
@@ -126,7 +144,7 @@ inline void IndexDataMessage::encode(Serializer &serializer) const
 {
     serializer << mProject << mParseTime << mFileId << mId << mIndexerJobFlags << mMessage
                << mFixIts << mIncludes << mDiagnostics << mFiles << mFlags << mBytesWritten
-               << static_cast<uint32_t>(mSources.size());
+               << mCost << mContentHashes << mUnits << static_cast<uint32_t>(mSources.size());
     for (const Source &source : mSources) {
         source.encode(serializer, Source::IgnoreSandbox);
     }
@@ -135,7 +153,8 @@ inline void IndexDataMessage::encode(Serializer &serializer) const
 inline void IndexDataMessage::decode(Deserializer &deserializer)
 {
     deserializer >> mProject >> mParseTime >> mFileId >> mId >> mIndexerJobFlags >> mMessage
-                 >> mFixIts >> mIncludes >> mDiagnostics >> mFiles >> mFlags >> mBytesWritten;
+                 >> mFixIts >> mIncludes >> mDiagnostics >> mFiles >> mFlags >> mBytesWritten
+                 >> mCost >> mContentHashes >> mUnits;
 
     uint32_t size;
     deserializer >> size;
@@ -21,6 +21,7 @@
 #include "RTags.h"
 #include "Server.h"
 #include "RTagsVersion.h"
+#include "SystemUnitStore.h"
 
 uint64_t IndexerJob::sNextId = 1;
 IndexerJob::IndexerJob(const SourceList &s,
@@ -28,7 +29,7 @@ IndexerJob::IndexerJob(const SourceList &s,
                        const std::shared_ptr<Project> &p,
                        const UnsavedFiles &u)
     : id(0), flags(f),
-      project(p->path()), priority(0), unsavedFiles(u), crashCount(0)
+      project(p->path()), priority(0), unsavedFiles(u), crashCount(0), systemUnitKey(0)
 {
     sources.append(s.front());
     for (size_t i=1; i<s.size(); ++i) {
@@ -51,9 +52,13 @@ IndexerJob::IndexerJob(const SourceList &s,
         ++priority;
     } else if (flags & Reindex) {
         priority += 4;
+    } else if (flags & Declarations) {
+        ++priority; // ahead of the full passes that follow
     }
     Server *server = Server::instance();
     assert(server);
+    if (server->systemUnitStore())
+        systemUnitKey = SystemUnitStore::key(sources);
     if (server->isActiveBuffer(sources.begin()->fileId)) {
         priority += 8;
     } else if (DependencyNode *node = p->dependencyNode(sources.begin()->fileId)) {
@@ -186,6 +191,9 @@ String IndexerJob::dumpFlags(Flags<Flag> flags)
     if (flags & Compile) {
         ret += "Compile";
     }
+    if (flags & Declarations) {
+        ret += "Declarations";
+    }
     if (flags & Running) {
         ret += "Running";
     }
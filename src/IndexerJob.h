@@ -17,10 +17,37 @@
 #define IndexerJob_h
 
 #include "rct/Flags.h"
+#include "rct/Serializer.h"
 #include "rct/SignalSlot.h"
 #include "RTags.h"
 #include "Source.h"
 
+// What rp spent on a source, remembered so the longest jobs can be started
+// first and jobs aren't started when their memory isn't available
+struct IndexerCost
+{
+    IndexerCost()
+        : parse(0), visit(0), write(0), peakRss(0)
+    {}
+
+    uint32_t parse, visit, write; // milliseconds
+    uint32_t peakRss; // kilobytes
+
+    uint64_t total() const { return static_cast<uint64_t>(parse) + visit + write; }
+};
+
+inline Serializer &operator<<(Serializer &s, const IndexerCost &cost)
+{
+    s << cost.parse << cost.visit << cost.write << cost.peakRss;
+    return s;
+}
+
+inline Deserializer &operator>>(Deserializer &s, IndexerCost &cost)
+{
+    s >> cost.parse >> cost.visit >> cost.write >> cost.peakRss;
+    return s;
+}
+
 class IndexerJob
 {
 public:
@@ -29,12 +56,13 @@ public:
         Dirty = 0x001,
         Reindex = 0x002,
         Compile = 0x004,
+        Declarations = 0x008,
         Running = 0x010,
         Crashed = 0x020,
         Aborted = 0x040,
         Complete = 0x080,
         NoAbort = 0x100,
-        Type_Mask = Dirty|Compile|Reindex
+        Type_Mask = Dirty|Compile|Reindex|Declarations
     };
 
     static String dumpFlags(Flags<Flag> flags);
@@ -60,6 +88,7 @@ public:
     UnsavedFiles unsavedFiles;
     Set<uint32_t> visited;
     int crashCount;
+    uint64_t systemUnitKey; // see SystemUnitStore::key
     Signal<std::function<void(IndexerJob *)> > destroyed;
 private:
     static uint64_t sNextId;
@@ -0,0 +1,40 @@
+/* This file is part of RTags (http://rtags.net).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef JobRequestMessage_h
+#define JobRequestMessage_h
+
+#include "RTagsMessage.h"
+
+// Sent by rp --remote over rdm's tcp port whenever it's ready to run a job.
+// rdm answers with a JobResponseMessage once it has one.
+class JobRequestMessage : public RTagsMessage
+{
+public:
+    enum { MessageId = JobRequestId };
+
+    JobRequestMessage(const String &name = String())
+        : RTagsMessage(MessageId), mName(name)
+    {
+    }
+
+    const String &name() const { return mName; }
+    void encode(Serializer &serializer) const { serializer << mName; }
+    void decode(Deserializer &deserializer) { deserializer >> mName; }
+private:
+    String mName;
+};
+
+#endif
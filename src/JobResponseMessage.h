@@ -0,0 +1,40 @@
+/* This file is part of RTags (http://rtags.net).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef JobResponseMessage_h
+#define JobResponseMessage_h
+
+#include "RTagsMessage.h"
+
+// An IndexerJob for rp --remote, encoded the way a local rp reads it from
+// stdin without the leading size
+class JobResponseMessage : public RTagsMessage
+{
+public:
+    enum { MessageId = JobResponseId };
+
+    JobResponseMessage(const String &job = String())
+        : RTagsMessage(MessageId), mJob(job)
+    {
+    }
+
+    const String &job() const { return mJob; }
+    void encode(Serializer &serializer) const { serializer << mJob; }
+    void decode(Deserializer &deserializer) { deserializer >> mJob; }
+private:
+    String mJob;
+};
+
+#endif
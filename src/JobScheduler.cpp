@@ -15,45 +15,66 @@
 
 #include "JobScheduler.h"
 
+#include <unistd.h>
+#include <algorithm>
+
 #include "IndexDataMessage.h"
 #include "IndexerJob.h"
+#include "JobResponseMessage.h"
 #include "Project.h"
 #include "rct/Connection.h"
 #include "rct/Process.h"
 #include "Server.h"
+#include "SharedCache.h"
+#include "UnitFile.h"
 
 enum { MaxPriority = 10 };
 // we set the priority to be this when a job has been requested and we couldn't load it
 JobScheduler::JobScheduler()
-    : mProcrastination(0)
+    : mProcrastination(0), mRssTimer(0), mIdleTimer(0), mImports(0), mPendingCount(0),
+      mPendingCost(0), mPendingSequence(0), mMemoryBackoffs(0)
 {}
 
+static uint64_t residentSize(Process *process)
+{
+#ifdef OS_Linux
+    char file[64];
+    snprintf(file, sizeof(file), "/proc/%d/statm", static_cast<int>(process->pid()));
+    if (FILE *f = fopen(file, "r")) {
+        unsigned long size, resident;
+        const bool ok = fscanf(f, "%lu %lu", &size, &resident) == 2;
+        fclose(f);
+        if (ok)
+            return (static_cast<uint64_t>(resident) * sysconf(_SC_PAGESIZE)) / 1024;
+    }
+#else
+    (void)process;
+#endif
+    return 0;
+}
+
 JobScheduler::~JobScheduler()
 {
-    mPendingJobs.deleteAll();
     if (!mActiveByProcess.isEmpty()) {
         for (const auto &job : mActiveByProcess) {
             job.first->kill();
         }
     }
+    for (const auto &idle : mIdleProcesses)
+        idle.first->kill();
 }
 
 void JobScheduler::add(const std::shared_ptr<IndexerJob> &job)
 {
     assert(!(job->flags & ~IndexerJob::Type_Mask));
-    std::shared_ptr<Node> node(new Node({ 0, job, 0, 0, 0, String() }));
+    std::shared_ptr<Project> project = Server::instance()->project(job->project);
+    std::shared_ptr<Node> node(new Node({ 0, job, 0, String(),
+                    project ? project->estimatedCost(job->fileId()) : 0,
+                    project ? project->estimatedPeakRss(job->fileId()) : 0, 0,
+                    std::shared_ptr<Connection>(), false, 0, 0 }));
     node->job = job;
     // error() << job->priority << job->sourceFile << mProcrastination;
-    if (mPendingJobs.isEmpty() || job->priority > mPendingJobs.first()->job->priority) {
-        mPendingJobs.prepend(node);
-    } else {
-        std::shared_ptr<Node> after = mPendingJobs.last();
-        while (job->priority > after->job->priority) {
-            after = after->prev;
-            assert(after);
-        }
-        mPendingJobs.insert(node, after);
-    }
+    enqueue(node);
     assert(!mInactiveById.contains(job->id));
     mInactiveById[job->id] = node;
     // error() << "procrash" << mProcrastination << job->sourceFile;
@@ -61,6 +82,45 @@ void JobScheduler::add(const std::shared_ptr<IndexerJob> &job)
         startJobs();
 }
 
+void JobScheduler::enqueue(const std::shared_ptr<Node> &node)
+{
+    // Longest processing time first within a priority so the slow
+    // translation units don't end up being the tail of a full reindex.
+    node->priority = node->job->priority;
+    node->sequence = ++mPendingSequence;
+    mPendingJobs[node->priority].insert(node);
+    ++mPendingCount;
+    mPendingCost += node->cost;
+}
+
+void JobScheduler::dequeue(const std::shared_ptr<Node> &node)
+{
+    auto group = mPendingJobs.find(node->priority);
+    if (group == mPendingJobs.end() || !group->second.erase(node))
+        return;
+    if (group->second.empty())
+        mPendingJobs.erase(group);
+    --mPendingCount;
+    mPendingCost -= node->cost;
+}
+
+std::shared_ptr<JobScheduler::Node> JobScheduler::firstPending() const
+{
+    return mPendingJobs.empty() ? std::shared_ptr<Node>() : *mPendingJobs.begin()->second.begin();
+}
+
+std::shared_ptr<JobScheduler::Node> JobScheduler::nextPending(const std::shared_ptr<Node> &node) const
+{
+    auto group = mPendingJobs.find(node->priority);
+    if (group != mPendingJobs.end()) {
+        const auto it = group->second.upper_bound(node);
+        if (it != group->second.end())
+            return *it;
+    }
+    group = mPendingJobs.upper_bound(node->priority);
+    return group == mPendingJobs.end() ? std::shared_ptr<Node>() : *group->second.begin();
+}
+
 uint32_t JobScheduler::hasHeaderError(DependencyNode *node, Set<uint32_t> &seen) const
 {
     assert(node);
@@ -96,14 +156,14 @@ void JobScheduler::startJobs()
         return;
     }
     const auto &options = server->options();
-    std::shared_ptr<Node> jobNode = mPendingJobs.first();
+    std::shared_ptr<Node> jobNode = firstPending();
     auto cont = [&jobNode, this]() {
-        auto tmp = jobNode->next;
-        mPendingJobs.remove(jobNode);
+        auto tmp = nextPending(jobNode);
+        dequeue(jobNode);
         jobNode = tmp;
     };
 
-    while (mActiveByProcess.size() < options.jobCount && jobNode) {
+    while (jobNode && (mActiveByProcess.size() < options.jobCount || !mIdleRemoteWorkers.isEmpty())) {
         assert(jobNode);
         assert(jobNode->job);
         assert(!(jobNode->job->flags & (IndexerJob::Running|IndexerJob::Complete|IndexerJob::Crashed|IndexerJob::Aborted)));
@@ -122,24 +182,100 @@ void JobScheduler::startJobs()
                 //         << mHeaderErrorMaxJobs << mHeaderErrorJobIds;
                 if (options.headerErrorJobCount <= mHeaderErrorJobIds.size()) {
                     warning() << "Holding off on" << jobNode->job->sourceFile << "it's got a header error from" << Location::path(headerError);
-                    jobNode = jobNode->next;
+                    jobNode = nextPending(jobNode);
                     continue;
                 }
             }
         }
 
         const uint64_t jobId = jobNode->job->id;
+        const std::shared_ptr<SharedCache> cache = server->sharedCache();
+        if (cache && !jobNode->imported && jobNode->job->unsavedFiles.isEmpty()) {
+            // Every job has to ask the cache before it can go to rp
+            if (mImports >= std::max<size_t>(1, options.jobCount))
+                break;
+            ++mImports;
+            jobNode->imported = true;
+            jobNode->job->flags |= IndexerJob::Running;
+            jobNode->started = Rct::monoMs();
+            mInactiveById.remove(jobId);
+            mActiveById[jobId] = jobNode;
+            std::weak_ptr<JobScheduler> weak = shared_from_this();
+            cache->import(jobNode->job, project, [weak, jobId](const std::shared_ptr<IndexDataMessage> &msg) {
+                    if (std::shared_ptr<JobScheduler> scheduler = weak.lock())
+                        scheduler->importFinished(jobId, msg);
+                });
+            cont();
+            continue;
+        }
+
+        if (!mIdleRemoteWorkers.isEmpty() && jobNode->job->unsavedFiles.isEmpty()) {
+            std::shared_ptr<Connection> worker = *mIdleRemoteWorkers.begin();
+            mIdleRemoteWorkers.erase(mIdleRemoteWorkers.begin());
+            debug() << "Sending" << jobId << jobNode->job->fileId() << jobNode->job.get() << "to" << mRemoteWorkers.value(worker);
+            if (headerError)
+                letGo(jobNode, headerError);
+            startRemoteJob(jobNode, worker);
+            cont();
+            continue;
+        }
+
+        if (mActiveByProcess.size() >= options.jobCount) {
+            // Only remote workers are free and they don't get to see unsaved
+            // buffers
+            jobNode = nextPending(jobNode);
+            continue;
+        }
+
+        if (options.jobMemoryBudget > 0 && !mActiveByProcess.isEmpty()
+            && committedRss() + jobNode->peakRss > static_cast<uint64_t>(options.jobMemoryBudget) * 1024) {
+            // Leave it queued until a running job is done. Starting smaller
+            // jobs past it could starve it.
+            debug() << "Holding off on" << jobNode->job->sourceFile << "until"
+                    << jobNode->peakRss << "KB are available";
+            ++mMemoryBackoffs;
+            break;
+        }
+
+        if (!mIdleProcesses.isEmpty()) {
+            // the one that has been idle the shortest, the others get reaped
+            auto idle = mIdleProcesses.begin();
+            for (auto it = mIdleProcesses.begin(); it != mIdleProcesses.end(); ++it) {
+                if (it->second > idle->second)
+                    idle = it;
+            }
+            Process *process = idle->first;
+            mIdleProcesses.erase(idle);
+            debug() << "Reusing process for" << jobId << jobNode->job->fileId() << jobNode->job.get();
+            if (headerError)
+                letGo(jobNode, headerError);
+            startJob(jobNode, process);
+            cont();
+            continue;
+        }
+
         Process *process = new Process;
         debug() << "Starting process for" << jobId << jobNode->job->fileId() << jobNode->job.get();
         List<String> arguments;
         arguments << "--priority" << String::number(jobNode->job->priority);
+        if (options.rpWorkerJobs > 0) {
+            arguments << "--worker-jobs" << String::number(options.rpWorkerJobs);
+            if (options.rpWorkerMaxRss > 0)
+                arguments << "--worker-max-rss" << String::number(options.rpWorkerMaxRss);
+        }
 
         for (int i=logLevel().toInt(); i>0; --i)
             arguments << "-v";
 
         process->readyReadStdOut().connect([this](Process *proc) {
-                std::shared_ptr<Node> n = mActiveByProcess[proc];
-                assert(n);
+                std::shared_ptr<Node> n = mActiveByProcess.value(proc);
+                if (!n) {
+                    // rp worker between jobs
+                    const String out = proc->readAllStdOut();
+                    if (!out.isEmpty())
+                        error() << "Output from idle rp:" << '\n' << out;
+                    return;
+                }
                 n->stdOut.append(proc->readAllStdOut());
 
                 std::regex rx("@CRASH@([^@]*)@CRASH@");
@@ -161,13 +297,11 @@ void JobScheduler::startJobs()
             cont();
             continue;
         }
-        if (headerError) {
-            jobNode->job->priority = IndexerJob::HeaderError;
-            warning() << "Letting" << jobNode->job->sourceFile << "go even with a headerheader error from" << Location::path(headerError);
-            mHeaderErrorJobIds.insert(jobId);
-        }
+        if (headerError)
+            letGo(jobNode, headerError);
         process->finished().connect([this, jobId](Process *proc) {
                 EventLoop::deleteLater(proc);
+                mIdleProcesses.remove(proc);
                 auto n = mActiveByProcess.take(proc);
                 assert(!n || n->process == proc);
                 const String stdErr = proc->readAllStdErr();
@@ -181,35 +315,191 @@ void JobScheduler::startJobs()
                     n->process = 0;
                     assert(!(n->job->flags & IndexerJob::Aborted));
                     if (!(n->job->flags & IndexerJob::Complete) && proc->returnCode() != 0) {
-                        auto nodeById = mActiveById.take(jobId);
+                        auto nodeById = mActiveById.take(n->job->id);
                         assert(nodeById);
                         assert(nodeById == n);
                         // job failed, probably no IndexDataMessage coming
                         n->job->flags |= IndexerJob::Crashed;
-                        debug() << "job crashed" << jobId << n->job->fileId() << n->job.get();
+                        debug() << "job crashed" << n->job->id << n->job->fileId() << n->job.get();
                         auto msg = std::make_shared<IndexDataMessage>(n->job);
                         msg->setFlag(IndexDataMessage::ParseFailure);
                         jobFinished(n->job, msg);
                     }
                 }
-                mHeaderErrorJobIds.remove(jobId);
+                mHeaderErrorJobIds.remove(n ? n->job->id : jobId);
                 startJobs();
             });
 
-
-        jobNode->process = process;
-        assert(!(jobNode->job->flags & ~IndexerJob::Type_Mask));
-        jobNode->job->flags |= IndexerJob::Running;
-        process->write(jobNode->job->encode());
-        jobNode->started = Rct::monoMs();
-        mActiveByProcess[process] = jobNode;
-        // error() << "STARTING JOB" << node->job->sourceFile;
-        mInactiveById.remove(jobId);
-        mActiveById[jobId] = jobNode;
+        startJob(jobNode, process);
         cont();
     }
 }
 
+void JobScheduler::importFinished(uint64_t jobId, const std::shared_ptr<IndexDataMessage> &message)
+{
+    --mImports;
+    if (message) {
+        debug() << "Imported" << jobId << "from shared cache";
+        handleIndexDataMessage(message);
+    } else if (std::shared_ptr<Node> node = mActiveById.take(jobId)) {
+        // not in the cache, rp has to do it
+        node->job->flags &= ~IndexerJob::Running;
+        mInactiveById[jobId] = node;
+        enqueue(node);
+    }
+    if (!mProcrastination)
+        startJobs();
+}
+
+void JobScheduler::letGo(const std::shared_ptr<Node> &jobNode, uint32_t headerError)
+{
+    jobNode->job->priority = IndexerJob::HeaderError;
+    warning() << "Letting" << jobNode->job->sourceFile << "go even with a header error from" << Location::path(headerError);
+    mHeaderErrorJobIds.insert(jobNode->job->id);
+}
+
+void JobScheduler::startJob(const std::shared_ptr<Node> &jobNode, Process *process)
+{
+    const uint64_t jobId = jobNode->job->id;
+    jobNode->process = process;
+    assert(!(jobNode->job->flags & ~IndexerJob::Type_Mask));
+    jobNode->job->flags |= IndexerJob::Running;
+    process->write(jobNode->job->encode());
+    jobNode->started = Rct::monoMs();
+    mActiveByProcess[process] = jobNode;
+    // error() << "STARTING JOB" << node->job->sourceFile;
+    mInactiveById.remove(jobId);
+    mActiveById[jobId] = jobNode;
+    if (Server::instance()->options().jobMemoryBudget > 0 && !mRssTimer)
+        sampleRss();
+}
+
+void JobScheduler::startRemoteJob(const std::shared_ptr<Node> &jobNode, const std::shared_ptr<Connection> &worker)
+{
+    const uint64_t jobId = jobNode->job->id;
+    jobNode->remote = worker;
+    assert(!(jobNode->job->flags & ~IndexerJob::Type_Mask));
+    jobNode->job->flags |= IndexerJob::Running;
+    // the size is only needed on stdin
+    worker->send(JobResponseMessage(jobNode->job->encode().mid(sizeof(uint32_t))));
+    jobNode->started = Rct::monoMs();
+    mActiveByRemote[worker.get()] = jobNode;
+    mInactiveById.remove(jobId);
+    mActiveById[jobId] = jobNode;
+}
+
+void JobScheduler::addRemoteWorker(const std::shared_ptr<Connection> &conn, const String &name)
+{
+    if (!mRemoteWorkers.contains(conn)) {
+        mRemoteWorkers[conn] = name;
+        error() << "Remote rp worker" << name << "connected";
+    }
+    if (mActiveByRemote.contains(conn.get())) {
+        error() << "Remote rp worker" << name << "asked for a job while running one";
+        return;
+    }
+    mIdleRemoteWorkers.insert(conn);
+    if (!mProcrastination)
+        startJobs();
+}
+
+void JobScheduler::removeRemoteWorker(const std::shared_ptr<Connection> &conn)
+{
+    if (!mRemoteWorkers.contains(conn))
+        return;
+    error() << "Remote rp worker" << mRemoteWorkers.take(conn) << "disconnected";
+    mIdleRemoteWorkers.remove(conn);
+    if (std::shared_ptr<Node> node = mActiveByRemote.take(conn.get())) {
+        node->remote.reset();
+        auto nodeById = mActiveById.take(node->job->id);
+        assert(nodeById == node);
+        (void)nodeById;
+        // same as rp crashing, the job is retried
+        node->job->flags |= IndexerJob::Crashed;
+        debug() << "remote job crashed" << node->job->id << node->job->fileId() << node->job.get();
+        auto msg = std::make_shared<IndexDataMessage>(node->job);
+        msg->setFlag(IndexDataMessage::ParseFailure);
+        mHeaderErrorJobIds.remove(node->job->id);
+        jobFinished(node->job, msg);
+    }
+    if (!mProcrastination)
+        startJobs();
+}
+
+// rp --remote can't write to our data dir so the unit files come with the
+// IndexDataMessage
+// Only the files the job claimed, a remote worker can't be trusted to stick
+// to those
+static void writeUnits(const std::shared_ptr<Project> &project, const std::shared_ptr<IndexerJob> &job,
+                       const std::shared_ptr<IndexDataMessage> &message)
+{
+    for (const auto &unit : message->units()) {
+        if (!job->visited.contains(unit.first)) {
+            error() << "Ignoring unit for" << Location::path(unit.first) << "from" << job->sourceFile
+                    << "it didn't visit";
+            continue;
+        }
+        const Path path = project->sourceFilePath(unit.first, "unit");
+        Path::mkdir(path.parentDir(), Path::Recursive);
+        Path::rm(project->sourceFilePath(unit.first, "unsaved"));
+        String data = unit.second;
+        if (!UnitFile::setGeneration(data, UnitFile::readGeneration(path) + 1) || !writeFileMapData(path, data))
+            error() << "Failed to write" << path << "for" << Location::path(unit.first);
+    }
+    message->units().clear();
+}
+
+void JobScheduler::sampleRss()
+{
+    mRssTimer = 0;
+    if (mActiveByProcess.isEmpty())
+        return;
+    for (const auto &active : mActiveByProcess)
+        active.second->rss = std::max(active.second->rss, residentSize(active.first));
+    std::weak_ptr<JobScheduler> weak = shared_from_this();
+    mRssTimer = EventLoop::eventLoop()->registerTimer([weak](int) {
+            if (std::shared_ptr<JobScheduler> scheduler = weak.lock())
+                scheduler->sampleRss();
+        }, RssInterval, Timer::SingleShot);
+}
+
+void JobScheduler::reapIdleProcesses()
+{
+    mIdleTimer = 0;
+    const uint64_t now = Rct::monoMs();
+    uint64_t next = 0;
+    auto it = mIdleProcesses.begin();
+    while (it != mIdleProcesses.end()) {
+        if (now - it->second >= IdleProcessTimeout) {
+            debug() << "Reaping idle rp" << it->first->pid();
+            it->first->kill();
+            mIdleProcesses.erase(it++);
+        } else {
+            if (!next || it->second < next)
+                next = it->second;
+            ++it;
+        }
+    }
+    if (next) {
+        std::weak_ptr<JobScheduler> weak = shared_from_this();
+        mIdleTimer = EventLoop::eventLoop()->registerTimer([weak](int) {
+                if (std::shared_ptr<JobScheduler> scheduler = weak.lock())
+                    scheduler->reapIdleProcesses();
+            }, next + IdleProcessTimeout - now, Timer::SingleShot);
+    }
+}
+
+uint64_t JobScheduler::committedRss() const
+{
+    // A job is expected to grow to what it needed last time
+    uint64_t ret = 0;
+    for (const auto &active : mActiveByProcess)
+        ret += std::max(active.second->rss, active.second->peakRss);
+    for (const auto &idle : mIdleProcesses)
+        ret += residentSize(idle.first);
+    return ret;
+}
+
 void JobScheduler::handleIndexDataMessage(const std::shared_ptr<IndexDataMessage> &message)
 {
     auto node = mActiveById.take(message->id());
@@ -218,7 +508,41 @@ void JobScheduler::handleIndexDataMessage(const std::shared_ptr<IndexDataMessage
         return;
     }
     debug() << "job got index data message" << node->job->id << node->job->fileId() << node->job.get();
+    const bool remote = node->remote != nullptr;
+    if (remote) {
+        mActiveByRemote.remove(node->remote.get());
+        node->remote.reset();
+        mHeaderErrorJobIds.remove(node->job->id);
+        if (std::shared_ptr<Project> project = Server::instance()->project(node->job->project))
+            writeUnits(project, node->job, message);
+    }
+    if (node->process || remote) {
+        if (const std::shared_ptr<SharedCache> cache = Server::instance()->sharedCache()) {
+            if (std::shared_ptr<Project> project = Server::instance()->project(node->job->project))
+                cache->insert(node->job, project, message);
+        }
+        if (!message->cost().peakRss && node->rss) {
+            IndexerCost cost = message->cost();
+            cost.peakRss = node->rss;
+            message->setCost(cost);
+        }
+    }
+    const bool worker = node->process && Server::instance()->options().rpWorkerJobs > 0;
+    if (worker) {
+        // The rp keeps running, hand it the next job unless it told us it's
+        // about to exit.
+        mActiveByProcess.remove(node->process);
+        if (!(message->flags() & IndexDataMessage::WorkerExit)) {
+            mIdleProcesses[node->process] = Rct::monoMs();
+            if (!mIdleTimer)
+                reapIdleProcesses();
+        }
+        node->process = 0;
+        mHeaderErrorJobIds.remove(node->job->id);
+    }
     jobFinished(node->job, message);
+    if (worker && !mProcrastination)
+        startJobs();
 }
 
 void JobScheduler::jobFinished(const std::shared_ptr<IndexerJob> &job, const std::shared_ptr<IndexDataMessage> &message)
@@ -261,30 +585,71 @@ void JobScheduler::jobFinished(const std::shared_ptr<IndexerJob> &job, const std
     project->onJobFinished(job, message);
 }
 
+uint64_t JobScheduler::estimatedTimeLeft() const
+{
+    // The jobs are started longest first so spreading the total over the
+    // job slots is close, except that we can't finish before the longest
+    // running job does.
+    const unsigned long long now = Rct::monoMs();
+    uint64_t total = 0, longest = 0;
+    for (const auto &node : mActiveById) {
+        const uint64_t elapsed = now - node.second->started;
+        const uint64_t left = node.second->cost > elapsed ? node.second->cost - elapsed : 0;
+        total += left;
+        longest = std::max(longest, left);
+    }
+    // each priority's first is its most expensive
+    total += mPendingCost;
+    for (const auto &group : mPendingJobs)
+        longest = std::max(longest, (*group.second.begin())->cost);
+    const size_t jobCount = std::max<size_t>(1, Server::instance()->options().jobCount + mRemoteWorkers.size());
+    return std::max(longest, total / jobCount);
+}
+
 void JobScheduler::dump(const std::shared_ptr<Connection> &conn)
 {
-    if (!mPendingJobs.isEmpty()) {
+    if (!mPendingJobs.empty() || !mActiveById.isEmpty())
+        conn->write<128>("Estimated time left: %llums", static_cast<unsigned long long>(estimatedTimeLeft()));
+    if (!mPendingJobs.empty()) {
         conn->write("Pending:");
-        for (const auto &node : mPendingJobs) {
-            conn->write<128>("%s: %s %s",
-                             node->job->sourceFile.constData(),
-                             node->job->flags.toString().constData(),
-                             IndexerJob::dumpFlags(node->job->flags).constData());
+        for (const auto &group : mPendingJobs) {
+            for (const auto &node : group.second) {
+                conn->write<128>("%s: %s %s (~%llums)",
+                                 node->job->sourceFile.constData(),
+                                 node->job->flags.toString().constData(),
+                                 IndexerJob::dumpFlags(node->job->flags).constData(),
+                                 static_cast<unsigned long long>(node->cost));
+            }
         }
     }
     if (!mActiveById.isEmpty()) {
         conn->write("Active:");
         const unsigned long long now = Rct::monoMs();
         for (const auto &node : mActiveById) {
-            conn->write<128>("%s: %s %s %lldms",
+            conn->write<128>("%s: %s %s %lldms (~%llums)",
                              node.second->job->sourceFile.constData(),
                              node.second->job->flags.toString().constData(),
                              IndexerJob::dumpFlags(node.second->job->flags).constData(),
-                             now - node.second->started);
+                             now - node.second->started,
+                             static_cast<unsigned long long>(node.second->cost));
 
         }
     }
 
+    if (!mIdleProcesses.isEmpty())
+        conn->write<128>("Idle rp workers: %zu", mIdleProcesses.size());
+    if (!mRemoteWorkers.isEmpty()) {
+        conn->write<128>("Remote rp workers: %zu (%zu idle)", mRemoteWorkers.size(), mIdleRemoteWorkers.size());
+        for (const auto &active : mActiveByRemote)
+            conn->write<256>("%s: %s", mRemoteWorkers.value(active.second->remote).constData(), active.second->job->sourceFile.constData());
+    }
+
+    const int budget = Server::instance()->options().jobMemoryBudget;
+    if (budget > 0) {
+        conn->write<128>("Memory: %lluMB of %dMB committed, held jobs back %zu times",
+                         static_cast<unsigned long long>(committedRss() / 1024), budget, mMemoryBackoffs);
+    }
+
     if (!mHeaderErrorJobIds.isEmpty()) {
         conn->write("HeaderErrorJobs:");
         for (uint64_t headerErrorJobId : mHeaderErrorJobIds) {
@@ -312,7 +677,7 @@ void JobScheduler::abort(const std::shared_ptr<IndexerJob> &job)
         debug() << "Aborting inactive job" << job->sourceFile << job->fileId() << job->id << job.get();
         node = mInactiveById.take(job->id);
         assert(node);
-        mPendingJobs.remove(node);
+        dequeue(node);
     } else {
         debug() << "Aborting active job" << job->sourceFile << job->fileId() << job->id << job.get();
     }
@@ -321,6 +686,11 @@ void JobScheduler::abort(const std::shared_ptr<IndexerJob> &job)
         node->process->kill();
         mActiveByProcess.remove(node->process);
     }
+    if (node->remote) {
+        // Can't stop it, the worker asks for another job once it's done
+        mActiveByRemote.remove(node->remote.get());
+        node->remote.reset();
+    }
 }
 
 void JobScheduler::clearHeaderError(uint32_t file)
@@ -332,11 +702,12 @@ void JobScheduler::clearHeaderError(uint32_t file)
 // ### This is a linear lookup
 bool JobScheduler::increasePriority(uint32_t fileId)
 {
-    for (auto node = mPendingJobs.first(); node; node = node->next) {
+    for (auto node = firstPending(); node; node = nextPending(node)) {
         if (node->job->fileId() == fileId) {
             if (node->job->priority != IndexerJob::HeaderError) {
+                dequeue(node);
                 node->job->priority = MaxPriority;
-                mPendingJobs.moveToFront(node);
+                enqueue(node);
                 warning() << "Bumped priority for" << Location::path(fileId);
             }
 
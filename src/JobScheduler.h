@@ -16,9 +16,11 @@
 #ifndef JobScheduler_h
 #define JobScheduler_h
 
+#include <functional>
+#include <map>
 #include <memory>
+#include <set>
 
-#include "rct/EmbeddedLinkedList.h"
 #include "rct/Set.h"
 #include "rct/Hash.h"
 #include "rct/String.h"
@@ -61,26 +63,76 @@ public:
     Set<uint32_t> headerErrors() const { return mHeaderErrors; }
     bool increasePriority(uint32_t fileId);
     void startJobs();
-    size_t pendingJobCount() const { return mPendingJobs.size(); }
+    size_t pendingJobCount() const { return mPendingCount; }
     size_t activeJobCount() const { return mActiveById.size(); }
+    // Milliseconds until the queued and running jobs are done going by how
+    // long they took last time
+    uint64_t estimatedTimeLeft() const;
+    // Kilobytes the rp processes use or are expected to grow to, see
+    // --job-memory-budget
+    uint64_t committedRss() const;
+    // rp --remote connected over tcp and asking for a job
+    void addRemoteWorker(const std::shared_ptr<Connection> &conn, const String &name);
+    void removeRemoteWorker(const std::shared_ptr<Connection> &conn);
+    bool isRemoteWorker(const std::shared_ptr<Connection> &conn) const { return mRemoteWorkers.contains(conn); }
 private:
-    enum { HighPriority = 5 };
+    enum {
+        HighPriority = 5,
+        RssInterval = 1000,
+        IdleProcessTimeout = 60 * 1000 // ms an rp worker may wait for a job
+    };
+    void sampleRss();
+    void reapIdleProcesses();
     void jobFinished(const std::shared_ptr<IndexerJob> &job, const std::shared_ptr<IndexDataMessage> &message);
     struct Node {
         unsigned long long started;
         std::shared_ptr<IndexerJob> job;
         Process *process;
-        std::shared_ptr<Node> next, prev;
         String stdOut;
+        uint64_t cost; // see Project::estimatedCost
+        uint64_t peakRss, rss; // kilobytes, expected and the highest we've seen
+        std::shared_ptr<Connection> remote;
+        bool imported; // looked up in the shared cache
+        int priority; // the job's when it was queued, see enqueue()
+        uint64_t sequence;
+    };
+    // Longest processing time first within a priority, first come first
+    // served for the same cost
+    struct ByCost {
+        bool operator()(const std::shared_ptr<Node> &a, const std::shared_ptr<Node> &b) const
+        {
+            return a->cost > b->cost || (a->cost == b->cost && a->sequence < b->sequence);
+        }
     };
+    typedef std::set<std::shared_ptr<Node>, ByCost> PendingJobs;
+    void enqueue(const std::shared_ptr<Node> &node);
+    void dequeue(const std::shared_ptr<Node> &node);
+    std::shared_ptr<Node> firstPending() const;
+    // the one that would be started after node, node doesn't have to be
+    // queued anymore
+    std::shared_ptr<Node> nextPending(const std::shared_ptr<Node> &node) const;
+    void importFinished(uint64_t jobId, const std::shared_ptr<IndexDataMessage> &message);
+    // starts a job with a header error in one of its dependencies
+    void letGo(const std::shared_ptr<Node> &node, uint32_t headerError);
+    void startJob(const std::shared_ptr<Node> &node, Process *process);
+    void startRemoteJob(const std::shared_ptr<Node> &node, const std::shared_ptr<Connection> &worker);
     uint32_t hasHeaderError(DependencyNode *node, Set<uint32_t> &seen) const;
     uint32_t hasHeaderError(uint32_t file, const std::shared_ptr<Project> &project) const;
 
-    int mProcrastination;
+    int mProcrastination, mRssTimer, mIdleTimer;
+    size_t mImports; // jobs being looked up in the shared cache
+    size_t mPendingCount;
+    uint64_t mPendingCost; // sum of the pending jobs' Node::cost
+    uint64_t mPendingSequence;
+    size_t mMemoryBackoffs;
     Set<uint32_t> mHeaderErrors;
     Set<uint64_t> mHeaderErrorJobIds;
-    EmbeddedLinkedList<std::shared_ptr<Node> > mPendingJobs;
+    std::map<int, PendingJobs, std::greater<int> > mPendingJobs; // priority -> never empty
     Hash<Process *, std::shared_ptr<Node> > mActiveByProcess;
+    Hash<Process *, uint64_t> mIdleProcesses; // rp workers waiting for a job since, see --rp-worker-jobs
+    Hash<std::shared_ptr<Connection>, String> mRemoteWorkers; // -> name
+    Set<std::shared_ptr<Connection> > mIdleRemoteWorkers;
+    Hash<Connection *, std::shared_ptr<Node> > mActiveByRemote;
     Hash<uint64_t, std::shared_ptr<Node> > mActiveById, mInactiveById;
 };
 
@@ -20,6 +20,7 @@
 #include "rct/List.h"
 #include "rct/Log.h"
 #include "RTags.h"
+#include "Sandbox.h"
 #include "Server.h"
 
 const Flags<QueryJob::JobFlag> defaultFlags = (QueryJob::WriteUnfiltered | QueryJob::QuietJob);
@@ -85,48 +86,87 @@ int ListSymbolsJob::execute()
 Set<String> ListSymbolsJob::listSymbolsWithPathFilter(const std::shared_ptr<Project> &project, const List<Path> &paths) const
 {
     Set<String> out;
+    const String pattern = Sandbox::encoded(string);
     const bool wildcard = queryFlags() & QueryMessage::WildcardSymbolNames && (string.contains('*') || string.contains('?'));
     const bool stripParentheses = queryFlags() & QueryMessage::StripParentheses;
     const bool caseInsensitive = queryFlags() & QueryMessage::MatchCaseInsensitive;
+    const bool hasKindFilter = QueryJob::hasKindFilter();
     const String::CaseSensitivity cs = caseInsensitive ? String::CaseInsensitive : String::CaseSensitive;
-    for (size_t i=0; i<paths.size(); ++i) {
-        const Path file = paths.at(i);
-        const uint32_t fileId = Location::fileId(file);
+
+    // locations is only called if there's a kind filter
+    auto insert = [&](const StringView &name, const std::function<Set<Location>()> &locations) {
+        if (name.isEmpty())
+            return;
+        if (hasKindFilter) {
+            bool ok = false;
+            for (const Location &location : locations()) {
+                if (filterKind(project->findSymbolCore(location))) {
+                    ok = true;
+                    break;
+                }
+            }
+            if (!ok)
+                return;
+        }
+
+        const String symbolName = name.toString();
+        if (stripParentheses) {
+            const int paren = symbolName.indexOf('(');
+            if (paren == -1) {
+                out.insert(symbolName);
+            } else {
+                if (!RTags::isFunctionVariable(symbolName))
+                    out.insert(symbolName.left(paren));
+            }
+        } else {
+            out.insert(symbolName);
+        }
+    };
+
+    Set<uint32_t> fileIds;
+    size_t names = 0;
+    for (const Path &path : paths) {
+        const uint32_t fileId = Location::fileId(path);
         if (!fileId)
             continue;
-        auto symbols = project->openSymbols(fileId);
-        if (!symbols)
+        fileIds.insert(fileId);
+        if (auto symNames = project->openSymbolNames(fileId))
+            names += symNames->count();
+    }
+
+    // The trigrams of the symbol name index are worth it if they leave fewer
+    // names to look at than the files have
+    Set<uint32_t> scan;
+    if (pattern.isEmpty()
+        || !project->findSymbolNames(pattern, wildcard, cs, fileIds, names,
+                                     [&insert](const StringView &name, const Set<Location> &locations) {
+                                         insert(name, [&locations]() { return locations; });
+                                     }, scan)) {
+        scan = fileIds;
+    }
+
+    // Names are matched in the mapped keys, only the locations of the ones
+    // that match are decoded
+    String buffer;
+    for (uint32_t fileId : scan) {
+        auto symNames = project->openSymbolNames(fileId);
+        if (!symNames)
             continue;
-        const int count = symbols->count();
-        for (int j=0; j<count; ++j) {
-            const Symbol &symbol = symbols->valueAt(j);
-            if (!filterKind(symbol)) {
-                continue;
-            }
-            const String &symbolName = symbol.symbolName;
-            if (symbolName.isEmpty())
-                continue;
-            if (!string.isEmpty()) {
+        const auto keys = symNames->keyViews();
+        for (auto key = keys.begin(); key != keys.end(); ++key) {
+            const StringView name = *key;
+            if (!pattern.isEmpty()) {
                 if (wildcard) {
-                    if (!Project::matchSymbolName(string, symbolName, cs)) {
+                    buffer.assign(name.data(), name.size());
+                    if (!Project::matchSymbolName(pattern, buffer, cs)) {
                         continue;
                     }
-                } else if (!symbolName.contains(string, cs)) {
+                } else if (!name.contains(pattern, cs)) {
                     continue;
                 }
             }
-
-            if (stripParentheses) {
-                const int paren = symbolName.indexOf('(');
-                if (paren == -1) {
-                    out.insert(symbolName);
-                } else {
-                    if (!RTags::isFunctionVariable(symbolName))
-                        out.insert(symbolName.left(paren));
-                }
-            } else {
-                out.insert(symbolName);
-            }
+            const uint32_t index = key.index();
+            insert(name, [&symNames, index]() { return symNames->valueAt(index); });
         }
     }
     return out;
@@ -16,11 +16,15 @@
 #include "Project.h"
 
 #include <fnmatch.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
 #include <memory>
 #include <regex>
 
 #include "Diagnostic.h"
 #include "FileManager.h"
+#include "FileMapCache.h"
 #include "CompilerManager.h"
 #include "IndexDataMessage.h"
 #include "JobScheduler.h"
@@ -32,13 +36,15 @@
 #include "rct/Rct.h"
 #include "rct/ReadLocker.h"
 #include "rct/Thread.h"
+#include "rct/ThreadPool.h"
 #include "rct/Value.h"
 #include "RTags.h"
 #include "RTagsLogOutput.h"
 #include "Server.h"
+#include "SystemUnitStore.h"
 #include "RTagsVersion.h"
 
-enum { DirtyTimeout = 100, ReloadCompileCommandsTimeout = 500 };
+enum { DirtyTimeout = 100, ReloadCompileCommandsTimeout = 500, LogCompactionMinimum = 1024 * 1024 };
 
 class Dirty
 {
@@ -100,7 +106,21 @@ public:
         return time;
     }
 
-    Hash<uint32_t, uint64_t> mLastModified;
+    // A file that was touched since the source was parsed only counts if its
+    // content changed or the source was parsed before the content we have a
+    // hash for was written.
+    inline bool isModified(uint32_t fileId, uint64_t parsed)
+    {
+        const uint64_t modified = lastModified(fileId);
+        if (!modified)
+            return true;
+        if (modified <= parsed)
+            return false;
+        const uint64_t unchangedSince = mUnchanged.value(fileId);
+        return !unchangedSince || unchangedSince > parsed;
+    }
+
+    Hash<uint32_t, uint64_t> mLastModified, mUnchanged;
     Set<uint32_t> mDirty;
 };
 
@@ -128,8 +148,7 @@ public:
         const uint32_t fileId = sourceList.fileId();
         if (mMatch.isEmpty() || mMatch.match(Location::path(fileId))) {
             for (auto it : mProject->dependencies(fileId, Project::ArgDependsOn)) {
-                uint64_t depLastModified = lastModified(it);
-                if (!depLastModified || depLastModified > sourceList.parsed) {
+                if (isModified(it, sourceList.parsed)) {
                     ret = true;
                     insertDirtyFile(it);
                 }
@@ -164,8 +183,7 @@ public:
         for (auto it : mModified) {
             const auto &deps = it.second;
             if (deps.contains(sourceList.fileId())) {
-                const uint64_t depLastModified = lastModified(it.first);
-                if (!depLastModified || depLastModified > sourceList.parsed) {
+                if (isModified(it.first, sourceList.parsed)) {
                     // dependency is gone
                     ret = true;
                     insertDirtyFile(it.first);
@@ -239,7 +257,7 @@ static bool loadDependencies(DataFile &file, Dependencies &dependencies)
     return true;
 }
 
-static void saveDependencies(DataFile &file, const Dependencies &dependencies)
+static void saveDependencies(Serializer &file, const Dependencies &dependencies)
 {
     file << static_cast<int>(dependencies.size());
     for (const auto &it : dependencies) {
@@ -256,9 +274,33 @@ static void saveDependencies(DataFile &file, const Dependencies &dependencies)
     }
 }
 
+template <typename T>
+static void logValue(Serializer &serializer, const Hash<uint32_t, T> &hash, uint32_t fileId)
+{
+    const auto it = hash.find(fileId);
+    serializer << (it != hash.end());
+    if (it != hash.end())
+        serializer << it->second;
+}
+
+template <typename T>
+static void replayValue(Deserializer &deserializer, Hash<uint32_t, T> &hash, uint32_t fileId)
+{
+    bool found;
+    deserializer >> found;
+    if (found) {
+        deserializer >> hash[fileId];
+    } else {
+        hash.remove(fileId);
+    }
+}
+
 Project::Project(const Path &path)
     : mPath(path), mSourceFilePathBase(RTags::encodeSourceFilePath(Server::instance()->options().dataDir, path)),
-      mJobCounter(0), mJobsStarted(0), mBytesWritten(0), mSaveDirty(false)
+      mJobCounter(0), mJobsStarted(0), mSymbolNameIndex(ProjectIndex<Location>::Trigrams), mBytesWritten(0), mTotalCost(0), mTotalPeakRss(0), mSaveDirty(false), mLoaded(false),
+      mLog(0), mLogGeneration(0), mLogHeaderGeneration(0), mLogSize(0), mCheckpointSize(0), mSaving(false),
+      mCheckpoint(std::make_shared<Checkpoint>()), mActiveQueries(0),
+      mFileMapChanges(0)
 {
     Path srcPath = mPath;
     RTags::encodePath(srcPath);
@@ -266,17 +308,22 @@ Project::Project(const Path &path)
     const Path tmp = options.dataDir + srcPath;
     mProjectFilePath = tmp + "/project";
     mSourcesFilePath = tmp + "/sources";
+    mLogFilePath = tmp + "/project.log";
 }
 
 Project::~Project()
 {
     if (mSaveDirty)
         save();
+    if (mLog)
+        fclose(mLog);
     for (const auto &job : mActiveJobs) {
         assert(job.second);
         Server::instance()->jobScheduler()->abort(job.second);
     }
     mDependencies.deleteAll();
+    if (std::shared_ptr<FileMapCache> cache = Server::instance()->fileMapCache())
+        cache->remove(this);
 
     assert(EventLoop::isMainThread());
     mDirtyTimer.stop();
@@ -328,6 +375,18 @@ bool Project::readSources(const Path &path, IndexParseData &data, String *err)
 
 bool Project::init()
 {
+    if (mLoaded)
+        return true;
+
+    // A project without a sources file is new, one we failed to read is left
+    // unloaded so the next init() tries again
+    String err;
+    const bool restored = Project::readSources(mSourcesFilePath, mIndexParseData, &err);
+    if (!restored && !err.isEmpty()) {
+        error("Sources restore error %s: %s", mPath.constData(), err.constData());
+        return false;
+    }
+    mLoaded = true;
     const JobScheduler::JobScope scope(Server::instance()->jobScheduler());
     const Server::Options &options = Server::instance()->options();
     if (!(options.options & Server::NoFileSystemWatch)) {
@@ -344,13 +403,8 @@ bool Project::init()
     mDirtyTimer.timeout().connect(std::bind(&Project::onDirtyTimeout, this, std::placeholders::_1));
     mReloadCompileCommandsTimer.timeout().connect(std::bind(&Project::reloadCompileCommands, this));
 
-    String err;
-    if (!Project::readSources(mSourcesFilePath, mIndexParseData, &err)) {
-        if (!err.isEmpty())
-            error("Sources restore error %s: %s", mPath.constData(), err.constData());
-
+    if (!restored)
         return false;
-    }
 
     auto reindexAll = [this]() {
         mProjectFilePath.visit([](const Path &path) {
@@ -375,87 +429,67 @@ bool Project::init()
         return true;
     }
 
+    uint32_t previousGeneration;
+    uint64_t previousOffset;
+    file >> mLogGeneration >> previousGeneration >> previousOffset;
     {
         std::lock_guard<std::mutex> lock(mMutex);
-        file >> mVisitedFiles;
+        file >> mVisitedFiles >> mDeclarationsOnly >> mSystemUnits;
         Sandbox::decode(mVisitedFiles);
     }
-    file >> mDiagnostics;
+    file >> mDiagnostics >> mContentHashes >> mCosts;
     for (const auto &info : mIndexParseData.compileCommands)
         watch(Location::path(info.first), Watch_CompileCommands);
 
     if (!loadDependencies(file, mDependencies)) {
         mDependencies.deleteAll();
+        mDependencyIndex.clear();
+        mUsrFilters.clear();
         mVisitedFiles.clear();
+        mDeclarationsOnly.clear();
+        mSystemUnits.clear();
         mDiagnostics.clear();
+        mContentHashes.clear();
+        mCosts.clear();
+        mTotalCost = mTotalPeakRss = 0;
         error("Restore error %s: Failed to load dependencies.", mPath.constData());
         reindexAll();
         return true;
     }
 
-    for (const auto &dep : mDependencies) {
-        watchFile(dep.first);
-    }
-
     bool needsSave = false;
-    std::unique_ptr<ComplexDirty> dirty;
+    {
+        bool torn = false;
+        if (const size_t records = replayLog(previousGeneration, previousOffset, &torn)) {
+            warning() << "Replayed" << records << "records from" << mLogFilePath;
+            // fold them into the project file
+            needsSave = true;
+        } else if (torn) {
+            needsSave = true;
+        }
+    }
+    for (const auto &cost : mCosts) {
+        mTotalCost += cost.second.total();
+        mTotalPeakRss += cost.second.peakRss;
+    }
 
-    if (Server::instance()->suspended()) {
-        dirty.reset(new SuspendedDirty);
-    } else {
-        dirty.reset(new IfModifiedDirty(shared_from_this()));
+    for (const auto &dep : mDependencies) {
+        watchFile(dep.first);
     }
 
-    Set<uint32_t> missingFileMaps;
+    Set<uint32_t> dirty;
     {
-        List<uint32_t> removed;
-        int idx = 0;
-        bool outputDirty = false;
-        if (mDependencies.size() >= 100) {
-            logDirect(LogLevel::Error, String::format<128>("Restoring %s ", mPath.constData()), LogOutput::StdOut);
-            outputDirty = true;
-        }
-        const std::shared_ptr<Project> project = shared_from_this();
-        for (auto it : mDependencies) {
-            const Path path = Location::path(it.first);
-            if (!path.isFile()) {
-                warning() << path << "seems to have disappeared";
-                dirty.get()->insertDirtyFile(it.first);
-
-                const Set<uint32_t> dependents = dependencies(it.first, DependsOnArg);
-                for (auto dependent : dependents) {
-                    dirty.get()->insertDirtyFile(dependent);
-                }
-                removed << it.first;
-                needsSave = true;
-            } else {
-                String errorString;
-                if (!validate(it.first,  options.options & Server::ValidateFileMaps ? Validate : StatOnly, &errorString)) {
-                    if (!errorString.isEmpty()) {
-                        if (outputDirty) {
-                            outputDirty = false;
-                            logDirect(LogLevel::Error, String("\n"), LogOutput::StdOut);
-                        }
-                        error() << errorString;
-                    }
-                    if (hasSource(it.first) || hasSourceDependency(it.second, project)) {
-                        missingFileMaps.insert(it.first);
-                    } else {
-                        removed << it.first;
-                        needsSave = true;
-                    }
-                }
-            }
-            if (++idx % 100 == 0) {
-                outputDirty = true;
-                logDirect(LogLevel::Error, ".", 1, LogOutput::StdOut);
-                // error("%d/%d (%.2f%%)", idx, count, (idx / static_cast<double>(count)) * 100.0);
-            }
+        String err;
+        if (!mSymbolNameIndex.load(mSourceFilePathBase + fileMapName(SymbolNames), mDependencies,
+                                   [this](uint32_t fileId) { return unitFilePath(fileId); }, &err)
+            && !err.isEmpty()) {
+            error() << "Failed to load symbol name index for" << mPath << err;
         }
-        if (outputDirty)
-            logDirect(LogLevel::Error, "\n", 1, LogOutput::StdOut);
-        for (uint32_t r : removed) {
-            removeDependencies(r);
+        err.clear();
+        if (!mUsrIndex.load(mSourceFilePathBase + fileMapName(Usrs), mDependencies,
+                            [this](uint32_t fileId) { return unitFilePath(fileId); }, &err)
+            && !err.isEmpty()) {
+            error() << "Failed to load usr index for" << mPath << err;
         }
     }
 
@@ -465,7 +499,7 @@ bool Project::init()
             if (!sourceFile.isFile()) {
                 warning() << sourceFile << "seems to have disappeared";
                 removeDependencies(fileId);
-                dirty.get()->insertDirtyFile(fileId);
+                dirty.insert(fileId);
                 needsSave = true;
                 return Remove;
             }
@@ -477,16 +511,169 @@ bool Project::init()
 
     if (needsSave)
         save();
-    startDirtyJobs(dirty.get(), IndexerJob::Dirty|IndexerJob::NoAbort);
-    // don't want to abort the jobs we just started from reloadCompileCommands
-    if (!missingFileMaps.isEmpty()) {
-        SimpleDirty simple;
-        simple.init(shared_from_this(), missingFileMaps);
-        startDirtyJobs(&simple, IndexerJob::Dirty);
-    }
+    if (mActiveJobs.isEmpty())
+        updateProjectIndexes();
+
+    // The index we just loaded answers queries while other threads check
+    // that the files and their units are still there
+    checkDependencies(dirty);
     return true;
 }
 
+void Project::checkDependencies(const Set<uint32_t> &dirty)
+{
+    // Unit paths depend on state that belongs to the main thread
+    List<std::pair<uint32_t, Path> > units;
+    units.reserve(mDependencies.size());
+    for (const auto &dep : mDependencies)
+        units.append(std::make_pair(dep.first, unitFilePath(dep.first)));
+    const ValidateMode mode = Server::instance()->options().options & Server::ValidateFileMaps ? Validate : StatOnly;
+
+    // The checks are spread over a few jobs on the background pool, the last
+    // one to finish hands the results to the main thread
+    struct State {
+        StopWatch sw;
+        std::mutex mutex;
+        Set<uint32_t> missing;
+        Hash<uint32_t, String> invalid, filters;
+        std::atomic<size_t> next, running;
+    };
+    const size_t jobCount = std::min<size_t>(std::max(2, ThreadPool::idealThreadCount() / 2),
+                                             (units.size() / 256) + 1);
+    std::shared_ptr<State> state = std::make_shared<State>();
+    state->next = 0;
+    state->running = jobCount;
+
+    std::weak_ptr<Project> weak = shared_from_this();
+    auto check = [weak, dirty, units, mode, state, jobCount]() {
+        while (true) {
+            const size_t idx = state->next++;
+            if (idx >= units.size())
+                break;
+            const uint32_t fileId = units.at(idx).first;
+            String err;
+            if (!Location::path(fileId).isFile()) {
+                std::lock_guard<std::mutex> lock(state->mutex);
+                state->missing.insert(fileId);
+            } else if (!validate(fileId, units.at(idx).second, mode, &err)) {
+                std::lock_guard<std::mutex> lock(state->mutex);
+                state->invalid[fileId] = err;
+            } else {
+                UnitFile unit;
+                if (unit.load(units.at(idx).second) && unit.contains(UnitFile::UsrsFilter)) {
+                    const String filter = unit.section(UnitFile::UsrsFilter);
+                    std::lock_guard<std::mutex> lock(state->mutex);
+                    state->filters[fileId] = filter;
+                }
+            }
+        }
+        if (--state->running)
+            return;
+        const uint64_t elapsed = state->sw.elapsed();
+        EventLoop::mainEventLoop()->callLater([weak, dirty, state, elapsed, jobCount]() {
+                if (std::shared_ptr<Project> project = weak.lock()) {
+                    if (project->mDependencies.size() >= 100) {
+                        logDirect(LogLevel::Error, String::format<256>("Checked %zu files of %s in %llums using %zu jobs",
+                                                                       project->mDependencies.size(), project->mPath.constData(),
+                                                                       static_cast<unsigned long long>(elapsed), jobCount),
+                                  LogOutput::StdOut|LogOutput::TrailingNewLine);
+                    }
+                    project->finishRestore(dirty, state->missing, state->invalid, state->filters);
+                }
+            });
+    };
+    for (size_t i=0; i<jobCount; ++i)
+        Server::instance()->startBackgroundJob(check);
+}
+
+void Project::finishRestore(const Set<uint32_t> &dirtyFiles, const Set<uint32_t> &missing, const Hash<uint32_t, String> &invalid,
+                            const Hash<uint32_t, String> &filters)
+{
+    if (deferWhileQuerying(std::bind(&Project::finishRestore, this, dirtyFiles, missing, invalid, filters)))
+        return;
+
+    // Jobs that finished in the meantime loaded newer filters than these
+    for (const auto &filter : filters) {
+        if (mDependencies.contains(filter.first) && !mUsrFilters.contains(filter.first))
+            mUsrFilters.set(filter.first, filter.second);
+    }
+
+    // Jobs that finished in the meantime may have changed what we found
+    const std::shared_ptr<Project> project = shared_from_this();
+    std::shared_ptr<ComplexDirty> dirty;
+    if (Server::instance()->suspended()) {
+        dirty.reset(new SuspendedDirty);
+    } else {
+        dirty.reset(new IfModifiedDirty(project));
+    }
+    for (uint32_t fileId : dirtyFiles)
+        dirty->insertDirtyFile(fileId);
+    Set<uint32_t> removed, missingFileMaps;
+    for (uint32_t fileId : missing) {
+        const Path path = Location::path(fileId);
+        if (!mDependencies.contains(fileId) || path.isFile())
+            continue;
+        warning() << path << "seems to have disappeared";
+        dirty->insertDirtyFile(fileId);
+
+        const Set<uint32_t> dependents = dependencies(fileId, DependsOnArg);
+        for (auto dependent : dependents) {
+            dirty->insertDirtyFile(dependent);
+        }
+        removed.insert(fileId);
+    }
+    const ValidateMode mode = Server::instance()->options().options & Server::ValidateFileMaps ? Validate : StatOnly;
+    for (const auto &it : invalid) {
+        const DependencyNode *node = mDependencies.value(it.first);
+        if (!node || validate(it.first, mode))
+            continue;
+        if (!it.second.isEmpty())
+            error() << it.second;
+        if (hasSource(it.first) || hasSourceDependency(node, project)) {
+            missingFileMaps.insert(it.first);
+        } else {
+            removed.insert(it.first);
+        }
+    }
+    for (uint32_t r : removed) {
+        removeDependencies(r);
+        mSymbolNameIndex.dirty(r);
+        mUsrIndex.dirty(r);
+    }
+    if (!removed.isEmpty()) {
+        logFiles(removed);
+        if (mActiveJobs.isEmpty())
+            updateProjectIndexes();
+    }
+
+    Set<uint32_t> dependencies;
+    if (!Server::instance()->suspended()) {
+        for (const auto &dep : mDependencies)
+            dependencies.insert(dep.first);
+    }
+    findUnchangedFiles(dependencies, [this, dirty, missingFileMaps](Hash<uint32_t, uint64_t> &&unchanged) {
+            dirty->mUnchanged = std::move(unchanged);
+            // don't want to abort the jobs we just started from reloadCompileCommands
+            startDirtyJobs(dirty.get(), IndexerJob::Dirty|IndexerJob::NoAbort);
+            if (!missingFileMaps.isEmpty()) {
+                SimpleDirty simple;
+                simple.init(shared_from_this(), missingFileMaps);
+                startDirtyJobs(&simple, IndexerJob::Dirty);
+            }
+            // rdm went away between the two passes of these
+            Set<uint32_t> secondPass;
+            {
+                std::lock_guard<std::mutex> lock(mMutex);
+                for (const auto &file : mDeclarationsOnly)
+                    secondPass.insert(file.second);
+            }
+            for (uint32_t fileId : secondPass) {
+                if (hasSource(fileId) && !mActiveJobs.contains(fileId))
+                    reindex(fileId, IndexerJob::Compile);
+            }
+        });
+}
+
 bool Project::match(const Match &p, bool *indexed) const
 {
     Path paths[] = { p.pattern(), p.pattern() };
@@ -676,6 +863,9 @@ static String formatDiagnostics(const Diagnostics &diagnostics, Flags<QueryMessa
 
 void Project::onJobFinished(const std::shared_ptr<IndexerJob> &job, const std::shared_ptr<IndexDataMessage> &msg)
 {
+    if (deferWhileQuerying(std::bind(&Project::onJobFinished, this, job, msg)))
+        return;
+
     mBytesWritten += msg->bytesWritten();
     std::shared_ptr<IndexerJob> restart;
     const uint32_t fileId = msg->fileId();
@@ -687,6 +877,7 @@ void Project::onJobFinished(const std::shared_ptr<IndexerJob> &job, const std::s
         error() << "Wrong IndexerJob for" << Location::path(fileId) << msg->id() << job->id << job.get();
         return;
     }
+    fileMapsChanged(job->visited);
 
     const bool success = job->flags & IndexerJob::Complete;
     assert(!(job->flags & IndexerJob::Aborted));
@@ -745,6 +936,48 @@ void Project::onJobFinished(const std::shared_ptr<IndexerJob> &job, const std::s
     Set<uint32_t> visited = msg->visitedFiles();
     updateFixIts(visited, msg->fixIts());
     updateDependencies(msg);
+    // A declarations pass leaves out references and tokens, so neither its
+    // hashes nor its cost describe what the full pass will have to do
+    const bool declarationsOnly = msg->indexerJobFlags() & IndexerJob::Declarations;
+    for (uint32_t file : visited) {
+        mSymbolNameIndex.dirty(file);
+        mUsrIndex.dirty(file);
+        loadUsrFilter(file);
+        const auto hash = msg->contentHashes().find(file);
+        if (success && !declarationsOnly && hash != msg->contentHashes().end()) {
+            const ContentHash contentHash = { hash->second.first, hash->second.first, hash->second.second };
+            mContentHashes[file] = contentHash;
+        } else {
+            mContentHashes.remove(file);
+        }
+    }
+    if (std::shared_ptr<SystemUnitStore> store = Server::instance()->systemUnitStore()) {
+        Set<uint32_t> changed;
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            std::swap(changed, mSystemUnitsChanged);
+        }
+        for (uint32_t file : changed) {
+            mSymbolNameIndex.dirty(file);
+            mUsrIndex.dirty(file);
+            loadUsrFilter(file);
+        }
+        // Only share headers rp saw the same contents of from start to finish
+        if (success && !declarationsOnly && job->unsavedFiles.isEmpty()) {
+            for (uint32_t file : visited) {
+                if (mContentHashes.contains(file) && Location::path(file).isSystem())
+                    store->publish(file, job->systemUnitKey, sourceFilePath(file, "unit"));
+            }
+        }
+    }
+    if (success && !declarationsOnly && msg->cost().total()) {
+        IndexerCost &cost = mCosts[fileId];
+        mTotalCost -= cost.total();
+        mTotalPeakRss -= cost.peakRss;
+        cost = msg->cost();
+        mTotalCost += cost.total();
+        mTotalPeakRss += cost.peakRss;
+    }
     if (success) {
         forEachSources([&msg](Sources &sources) -> VisitResult {
                 // error() << "finished with" << Location::path(msg->fileId()) << sources.contains(msg->fileId()) << msg->parseTime();
@@ -753,14 +986,27 @@ void Project::onJobFinished(const std::shared_ptr<IndexerJob> &job, const std::s
                 }
                 return Continue;
             });
-        logDirect(LogLevel::Error, String::format("[%3d%%] %d/%d %s %s. (%s)",
+        String eta;
+        if (const uint64_t left = Server::instance()->jobScheduler()->estimatedTimeLeft())
+            eta = String::format<32>(" ~%llus left.", static_cast<unsigned long long>((left + 999) / 1000));
+        logDirect(LogLevel::Error, String::format("[%3d%%] %d/%d %s %s. (%s)%s",
                                                   static_cast<int>(round((double(idx) / double(mJobCounter)) * 100.0)), idx, mJobCounter,
                                                   String::formatTime(time(0), String::Time).constData(),
                                                   msg->message().constData(),
                                                   (job->priority == IndexerJob::HeaderError
                                                    ? "header-error"
-                                                   : String::format<16>("priority %d", job->priority).constData())),
+                                                   : String::format<16>("priority %d", job->priority).constData()),
+                                                  eta.constData()),
                   LogOutput::StdOut|LogOutput::TrailingNewLine);
+        if (declarationsOnly) {
+            // Queued behind the first passes that haven't run yet
+            reindex(fileId, IndexerJob::Compile);
+        } else if (job->flags & IndexerJob::Declarations) {
+            // Imported from the shared cache, nothing left to do
+            std::lock_guard<std::mutex> lock(mMutex);
+            for (uint32_t file : job->visited)
+                mDeclarationsOnly.remove(file);
+        }
     } else {
         assert(msg->indexerJobFlags() & IndexerJob::Crashed);
         logDirect(LogLevel::Error, String::format("[%3d%%] %d/%d %s %s indexing crashed.",
@@ -770,8 +1016,23 @@ void Project::onJobFinished(const std::shared_ptr<IndexerJob> &job, const std::s
                   LogOutput::StdOut|LogOutput::TrailingNewLine);
     }
 
+    Set<uint32_t> logged = visited;
+    logged.unite(job->visited);
+    logged.insert(fileId);
+    for (const auto &file : msg->files())
+        logged.insert(file.first);
+    for (const auto &include : msg->includes()) {
+        logged.insert(include.first);
+        logged.insert(include.second);
+    }
+    for (const auto &diagnostic : msg->diagnostics())
+        logged.insert(diagnostic.first.fileId());
+    logFiles(logged);
+
     if (mActiveJobs.isEmpty()) {
-        save();
+        updateProjectIndexes();
+        if (mSaveDirty || !mLog || mLogSize > std::max<size_t>(LogCompactionMinimum, mCheckpointSize / 2))
+            save(Background);
         double timerElapsed = (mTimer.elapsed() / 1000.0);
         const double averageJobTime = timerElapsed / mJobsStarted;
         const String m = String::format<1024>("Jobs took %.2fs%s. We're using %lldmb of memory. ",
@@ -782,10 +1043,106 @@ void Project::onJobFinished(const std::shared_ptr<IndexerJob> &job, const std::s
 
         // error() << "Finished this
     } else {
-        mSaveDirty = true;
+        if (declarationsOnly && std::none_of(mActiveJobs.begin(), mActiveJobs.end(),
+                                             [](const std::pair<const uint32_t, std::shared_ptr<IndexerJob> > &active) {
+                                                 return active.second->flags & IndexerJob::Declarations;
+                                             })) {
+            // Every first pass is done, make their symbols findable while
+            // the full passes run
+            updateProjectIndexes();
+        }
     }
 }
 
+void Project::updateProjectIndexes()
+{
+    if (deferWhileQuerying(std::bind(&Project::updateProjectIndexes, this)))
+        return;
+    startIndexUpdate<Location>(&Project::mSymbolNameIndex, SymbolNames,
+                               [](uint32_t, const Path &unit, Map<String, Set<Location> > &merged) {
+                                   FileMap<String, Set<Location> > symNames;
+                                   if (!UnitFile::load(unit, UnitFile::SymbolNames, symNames))
+                                       return;
+                                   const uint32_t count = symNames.count();
+                                   for (uint32_t i=0; i<count; ++i)
+                                       merged[symNames.keyAt(i)].unite(symNames.valueAt(i));
+                               });
+    startIndexUpdate<uint32_t>(&Project::mUsrIndex, Usrs,
+                               [](uint32_t fileId, const Path &path, Map<String, Set<uint32_t> > &merged) {
+                                   std::shared_ptr<UnitFile> unit = std::make_shared<UnitFile>();
+                                   if (!unit->load(path))
+                                       return;
+                                   for (UnitFile::Section section : { UnitFile::Usrs, UnitFile::Targets }) {
+                                       FileMap<String, Set<Location> > fileMap;
+                                       if (!unit->open(section, fileMap))
+                                           continue;
+                                       const uint32_t count = fileMap.count();
+                                       for (uint32_t i=0; i<count; ++i)
+                                           merged[fileMap.keyAt(i)].insert(fileId);
+                                   }
+                               });
+}
+
+template <typename T>
+void Project::startIndexUpdate(ProjectIndex<T> Project::*index, FileMapType type, typename ProjectIndex<T>::Collect &&collect)
+{
+    ProjectIndex<T> &projectIndex = this->*index;
+    const size_t dirty = projectIndex.isValid() ? projectIndex.dirtyFiles().size() : mDependencies.size();
+    const uint64_t started = Rct::monoMs();
+    std::weak_ptr<Project> weak = shared_from_this();
+    std::function<void()> work = projectIndex.update(mSourceFilePathBase + fileMapName(type), mDependencies,
+                                                     [this](uint32_t fileId) { return unitFilePath(fileId); },
+                                                     std::move(collect),
+                                                     [weak, index, type, dirty, started](const std::shared_ptr<typename ProjectIndex<T>::Build> &build) {
+                                                         EventLoop::mainEventLoop()->callLater([weak, index, type, build, dirty, started]() {
+                                                                 if (std::shared_ptr<Project> project = weak.lock())
+                                                                     project->installIndex(index, type, build, dirty, started);
+                                                             });
+                                                     });
+    if (work)
+        Server::instance()->startBackgroundJob(std::move(work));
+}
+
+template <typename T>
+void Project::installIndex(ProjectIndex<T> Project::*index, FileMapType type,
+                           const std::shared_ptr<typename ProjectIndex<T>::Build> &build, size_t dirty, uint64_t started)
+{
+    if (deferWhileQuerying(std::bind(&Project::installIndex<T>, this, index, type, build, dirty, started)))
+        return;
+    ProjectIndex<T> &projectIndex = this->*index;
+    const bool installed = projectIndex.install(build);
+    if (!build->error.isEmpty()) {
+        error() << "Failed to update" << fileMapName(type) << "index for" << mPath << build->error;
+    } else if (installed) {
+        warning() << "Updated" << fileMapName(type) << "index for" << mPath << "with" << dirty << "files in"
+                  << (Rct::monoMs() - started) << "ms";
+        // Files that were indexed while it was being written
+        if (mActiveJobs.isEmpty() && projectIndex.needsUpdate())
+            updateProjectIndexes();
+    }
+}
+
+bool Project::filesForUsr(const String &usr, Set<uint32_t> &files) const
+{
+    if (!mUsrIndex.isValid())
+        return false;
+    files.clear();
+    for (const auto &segment : mUsrIndex.segments()) {
+        for (uint32_t file : segment.fileMap->value(usr)) {
+            if (mUsrIndex.isLive(segment, file) && mDependencies.contains(file))
+                files.insert(file);
+        }
+    }
+    // Segments are written on a thread so files stay dirty for a while
+    // after they have been indexed, their filters can still rule them out
+    const uint64_t hash = UsrFilter::hash(usr);
+    for (uint32_t file : mUsrIndex.dirtyFiles()) {
+        if (mDependencies.contains(file) && mUsrFilters.mightContain(file, hash))
+            files.insert(file);
+    }
+    return true;
+}
+
 void Project::diagnose(uint32_t fileId)
 {
     log([&](const std::shared_ptr<LogOutput> &output) {
@@ -825,23 +1182,37 @@ String Project::diagnosticsToString(Flags<QueryMessage::Flag> flags, uint32_t fi
     return formatDiagnostics(mDiagnostics, flags, fileId);
 }
 
-bool Project::save()
+// The files are laid out like a DataFile, { int version, int size } followed
+// by the data. size is the size of the whole file.
+static void setDataFileSize(String &data)
 {
-    Path::mkdir(mSourcesFilePath.parentDir(), Path::Recursive);
+    const int size = data.size();
+    memcpy(data.data() + sizeof(int), &size, sizeof(size));
+}
+
+bool Project::save(SaveMode mode)
+{
+    if (mode == Background && mSaving) {
+        // another one follows once this is on disk
+        mSaveDirty = true;
+        return true;
+    }
+    // the project refers to file ids that might still be waiting to be journaled
+    Server::instance()->flushFileIds();
+    std::shared_ptr<String> sources = std::make_shared<String>(), project = std::make_shared<String>();
     {
-        DataFile file(mSourcesFilePath, RTags::SourcesFileVersion);
-        if (!file.open(DataFile::Write)) {
-            error("Save error %s: %s", mProjectFilePath.constData(), file.error().constData());
-            return false;
-        }
-        file << mIndexParseData;
+        Serializer file(*sources);
+        file << static_cast<int>(RTags::SourcesFileVersion) << static_cast<int>(0) << mIndexParseData;
     }
     {
-        DataFile file(mProjectFilePath, RTags::DatabaseVersion);
-        if (!file.open(DataFile::Write)) {
-            error("Save error %s: %s", mProjectFilePath.constData(), file.error().constData());
-            return false;
-        }
+        Serializer file(*project);
+        // A log that is left over from before this checkpoint won't match
+        // and is ignored by init(). Until the log has been restarted records
+        // still go to the current one, the ones after this offset are newer
+        // than this checkpoint.
+        const long offset = mLog ? ftell(mLog) : -1;
+        file << static_cast<int>(RTags::DatabaseVersion) << static_cast<int>(0) << ++mLogGeneration
+             << (offset >= 0 ? mLogHeaderGeneration : 0) << static_cast<uint64_t>(std::max<long>(offset, 0));
         {
             std::lock_guard<std::mutex> lock(mMutex);
             if (Sandbox::hasRoot()) {
@@ -849,18 +1220,318 @@ bool Project::save()
             } else {
                 file << mVisitedFiles;
             }
+            file << mDeclarationsOnly << mSystemUnits;
         }
-        file << mDiagnostics;
+        file << mDiagnostics << mContentHashes << mCosts;
         saveDependencies(file, mDependencies);
-        if (!file.flush()) {
-            error("Save error %s: %s", mProjectFilePath.constData(), file.error().constData());
+    }
+    setDataFileSize(*sources);
+    setDataFileSize(*project);
+    mSaveDirty = false;
+    const uint32_t generation = mLogGeneration;
+
+    if (mode == Synchronous) {
+        // one that is still being written is older than this
+        mSaving = false;
+        mPendingRecords.clear();
+        String err;
+        if (!writeCheckpoint(mCheckpoint, generation, mSourcesFilePath, *sources, mProjectFilePath, *project, &err)) {
+            error("Save error %s", err.constData());
+            mSaveDirty = true;
             return false;
         }
+        finishCheckpoint(generation, project->size());
+        return true;
     }
-    mSaveDirty = false;
+
+    // Until the new files are on disk the old ones and the log are what init()
+    // would restore, records logged in the meantime go to both
+    mSaving = true;
+    std::weak_ptr<Project> weak = shared_from_this();
+    const std::shared_ptr<Checkpoint> checkpoint = mCheckpoint;
+    const Path sourcesFilePath = mSourcesFilePath, projectFilePath = mProjectFilePath;
+    Server::instance()->startBackgroundJob([weak, checkpoint, generation, sourcesFilePath, sources, projectFilePath, project]() {
+            String err;
+            const bool ok = writeCheckpoint(checkpoint, generation, sourcesFilePath, *sources, projectFilePath, *project, &err);
+            const size_t size = project->size();
+            EventLoop::mainEventLoop()->callLater([weak, generation, ok, err, size]() {
+                    std::shared_ptr<Project> p = weak.lock();
+                    if (!p || generation != p->mLogGeneration)
+                        return; // a synchronous save came after it
+                    if (!ok) {
+                        error("Save error %s", err.constData());
+                        p->mSaving = false;
+                        p->mPendingRecords.clear();
+                        p->mSaveDirty = true;
+                        return;
+                    }
+                    p->finishCheckpoint(generation, size);
+                    if (p->mSaveDirty)
+                        p->save(Background);
+                });
+        });
+    return true;
+}
+
+bool Project::writeCheckpoint(const std::shared_ptr<Checkpoint> &checkpoint, uint32_t generation,
+                              const Path &sourcesFilePath, const String &sources,
+                              const Path &projectFilePath, const String &project, String *error)
+{
+    std::lock_guard<std::mutex> lock(checkpoint->mutex);
+    if (checkpoint->generation > generation)
+        return true; // a newer one made it first
+    Path::mkdir(sourcesFilePath.parentDir(), Path::Recursive);
+    if (!writeFileMapData(sourcesFilePath, sources, Sync)) {
+        *error = sourcesFilePath + ": " + Rct::strerror();
+        return false;
+    }
+    if (!writeFileMapData(projectFilePath, project, Sync)) {
+        *error = projectFilePath + ": " + Rct::strerror();
+        return false;
+    }
+    checkpoint->generation = generation;
     return true;
 }
 
+void Project::finishCheckpoint(uint32_t generation, size_t size)
+{
+    assert(generation == mLogGeneration);
+    (void)generation;
+    mCheckpointSize = size;
+    mSaving = false;
+    List<String> records;
+    std::swap(records, mPendingRecords);
+    restartLog(records);
+}
+
+/*
+ * The project log holds the changes made since save() wrote the project
+ * file so that finishing a job doesn't have to rewrite all of it. It starts
+ * with the database version and the generation of the project file it
+ * belongs to, followed by records of { uint32_t size, data }. Each record
+ * holds the complete state of a set of files, replaying a record replaces
+ * whatever the project file or earlier records had for them. A project file
+ * also remembers how far the log before it had got when it was serialized
+ * so a crash before the log is restarted doesn't lose what came after.
+ */
+void Project::logFiles(const Set<uint32_t> &files)
+{
+    if (!mLog && !mSaving) {
+        mSaveDirty = true;
+        return;
+    }
+    String record;
+    {
+        Serializer serializer(record);
+        serializer << static_cast<uint32_t>(files.size());
+        std::lock_guard<std::mutex> lock(mMutex);
+        for (uint32_t file : files) {
+            serializer << file;
+            const DependencyNode *node = mDependencies.value(file);
+            serializer << (node != 0);
+            if (node) {
+                serializer << node->flags << static_cast<uint32_t>(node->includes.size());
+                for (const auto &include : node->includes)
+                    serializer << include.first;
+            }
+            const auto visited = mVisitedFiles.find(file);
+            serializer << (visited != mVisitedFiles.end());
+            if (visited != mVisitedFiles.end())
+                serializer << Sandbox::encoded(visited->second);
+            logValue(serializer, mDeclarationsOnly, file);
+            logValue(serializer, mSystemUnits, file);
+            logValue(serializer, mContentHashes, file);
+            logValue(serializer, mCosts, file);
+            Diagnostics diagnostics;
+            for (auto it = mDiagnostics.lower_bound(Location(file, 0, 0)); it != mDiagnostics.end() && it->first.fileId() == file; ++it)
+                diagnostics.insert(*it);
+            serializer << diagnostics;
+            uint64_t parsed = 0;
+            forEachSources([file, &parsed](const Sources &sources) -> VisitResult {
+                    const auto it = sources.find(file);
+                    if (it == sources.end())
+                        return Continue;
+                    parsed = it->second.parsed;
+                    return Stop;
+                });
+            serializer << parsed;
+        }
+    }
+    if (mSaving)
+        mPendingRecords.append(record);
+    appendLog(record);
+}
+
+void Project::appendLog(const String &record)
+{
+    if (!mLog) {
+        mSaveDirty = true;
+        return;
+    }
+    const uint32_t size = record.size();
+    if (fwrite(&size, sizeof(size), 1, mLog) != 1
+        || fwrite(record.constData(), record.size(), 1, mLog) != 1
+        || fflush(mLog)) {
+        error("Can't append to %s: %s", mLogFilePath.constData(), Rct::strerror().constData());
+        fclose(mLog);
+        mLog = 0;
+        mSaveDirty = true;
+        return;
+    }
+    mLogSize += sizeof(size) + record.size();
+}
+
+size_t Project::replayLog(uint32_t previousGeneration, uint64_t previousOffset, bool *torn)
+{
+    *torn = false;
+    FILE *f = fopen(mLogFilePath.constData(), "r");
+    if (!f) {
+        restartLog();
+        return 0;
+    }
+    uint32_t header[2];
+    if (fread(header, sizeof(header), 1, f) != 1 || header[0] != static_cast<uint32_t>(RTags::DatabaseVersion)) {
+        fclose(f);
+        restartLog();
+        return 0;
+    }
+    // We may have crashed after writing a checkpoint in the background and
+    // before restarting the log, the records logged while it was written are
+    // at the end of the log of the checkpoint before it
+    const bool previous = header[1] != mLogGeneration;
+    if (previous && (!previousGeneration || header[1] != previousGeneration
+                     || fseek(f, static_cast<long>(previousOffset), SEEK_SET))) {
+        fclose(f);
+        restartLog();
+        return 0;
+    }
+    size_t records = 0;
+    while (true) {
+        uint32_t size;
+        const size_t read = fread(&size, 1, sizeof(size), f);
+        if (read != sizeof(size)) {
+            // part of a record means we crashed while appending
+            *torn = read || ferror(f);
+            break;
+        }
+        String record(size, '\0');
+        if (fread(record.data(), size, 1, f) != 1) {
+            *torn = true;
+            break;
+        }
+        Deserializer deserializer(record);
+        uint32_t count;
+        deserializer >> count;
+        std::lock_guard<std::mutex> lock(mMutex);
+        while (count--) {
+            uint32_t file;
+            bool hasNode;
+            deserializer >> file >> hasNode;
+            DependencyNode *&node = mDependencies[file];
+            if (node) {
+                for (auto it : node->includes)
+                    it.second->dependents.remove(file);
+                node->includes.clear();
+            }
+            if (hasNode) {
+                if (!node)
+                    node = new DependencyNode(file);
+                uint32_t includes;
+                deserializer >> node->flags >> includes;
+                while (includes--) {
+                    uint32_t include;
+                    deserializer >> include;
+                    DependencyNode *&dependee = mDependencies[include];
+                    if (!dependee)
+                        dependee = new DependencyNode(include);
+                    node->include(dependee);
+                }
+            } else {
+                if (node) {
+                    for (auto it : node->dependents)
+                        it.second->includes.remove(file);
+                    delete node;
+                }
+                mDependencies.remove(file);
+            }
+            bool visited;
+            deserializer >> visited;
+            if (visited) {
+                Path path;
+                deserializer >> path;
+                Sandbox::decode(path);
+                mVisitedFiles[file] = path;
+            } else {
+                mVisitedFiles.remove(file);
+            }
+            replayValue(deserializer, mDeclarationsOnly, file);
+            replayValue(deserializer, mSystemUnits, file);
+            replayValue(deserializer, mContentHashes, file);
+            replayValue(deserializer, mCosts, file);
+            Diagnostics diagnostics;
+            deserializer >> diagnostics;
+            for (auto it = mDiagnostics.lower_bound(Location(file, 0, 0)); it != mDiagnostics.end() && it->first.fileId() == file; )
+                mDiagnostics.erase(it++);
+            mDiagnostics.insert(diagnostics.begin(), diagnostics.end());
+            uint64_t parsed;
+            deserializer >> parsed;
+            if (parsed) {
+                forEachSources([file, parsed](Sources &sources) -> VisitResult {
+                        const auto it = sources.find(file);
+                        if (it != sources.end())
+                            it->second.parsed = parsed;
+                        return Continue;
+                    });
+            }
+        }
+        ++records;
+    }
+    fclose(f);
+    if (records)
+        mDependencyIndex.clear();
+    if (*torn || records) {
+        // init() writes a new project file which restarts the log
+        return records;
+    }
+    if (previous) {
+        restartLog();
+        return 0;
+    }
+    mLog = fopen(mLogFilePath.constData(), "a");
+    mLogHeaderGeneration = mLogGeneration;
+    mLogSize = 0;
+    mCheckpointSize = mProjectFilePath.fileSize();
+    return 0;
+}
+
+void Project::restartLog(const List<String> &records)
+{
+    // The new log replaces the old one in one go so the records in it are
+    // never lost to a crash in between
+    if (mLog)
+        fclose(mLog);
+    mLogSize = 0;
+    const Path tmp = mLogFilePath + ".tmp";
+    mLog = fopen(tmp.constData(), "w");
+    const uint32_t header[] = { static_cast<uint32_t>(RTags::DatabaseVersion), mLogGeneration };
+    bool ok = mLog && fwrite(header, sizeof(header), 1, mLog) == 1;
+    for (size_t i=0; ok && i<records.size(); ++i) {
+        const uint32_t size = records.at(i).size();
+        ok = fwrite(&size, sizeof(size), 1, mLog) == 1 && fwrite(records.at(i).constData(), size, 1, mLog) == 1;
+        mLogSize += sizeof(size) + size;
+    }
+    if (!ok || fflush(mLog) || rename(tmp.constData(), mLogFilePath.constData())) {
+        error("Can't create %s: %s", mLogFilePath.constData(), Rct::strerror().constData());
+        if (mLog) {
+            fclose(mLog);
+            mLog = 0;
+        }
+        Path::rm(tmp);
+        return;
+    }
+    mLogHeaderGeneration = mLogGeneration;
+}
+
 void Project::index(const std::shared_ptr<IndexerJob> &job)
 {
     const Path sourceFile = job->sourceFile;
@@ -952,10 +1623,74 @@ void Project::onFileRemoved(const Path &file)
 
 void Project::onDirtyTimeout(Timer *)
 {
-    Set<uint32_t> dirtyFiles = std::move(mPendingDirtyFiles);
-    WatcherDirty dirty(shared_from_this(), dirtyFiles);
-    const int dirtied = startDirtyJobs(&dirty, IndexerJob::Dirty);
-    debug() << "onDirtyTimeout" << dirtyFiles << dirtied;
+    const Set<uint32_t> dirtyFiles = std::move(mPendingDirtyFiles);
+    findUnchangedFiles(dirtyFiles, [this, dirtyFiles](Hash<uint32_t, uint64_t> &&unchanged) {
+            WatcherDirty dirty(shared_from_this(), dirtyFiles);
+            dirty.mUnchanged = std::move(unchanged);
+            const int dirtied = startDirtyJobs(&dirty, IndexerJob::Dirty);
+            debug() << "onDirtyTimeout" << dirtyFiles << dirtied;
+        });
+}
+
+void Project::findUnchangedFiles(const Set<uint32_t> &fileIds,
+                                 std::function<void(Hash<uint32_t, uint64_t> &&unchanged)> &&callback)
+{
+    // Files with the modification time we hashed are left to the
+    // lastModified check, only the touched ones need to be read. The time is
+    // taken before hashing so a write while we read makes it look touched.
+    Hash<uint32_t, uint64_t> unchanged;
+    Hash<uint32_t, std::pair<Path, uint64_t> > touched;
+    for (uint32_t fileId : fileIds) {
+        const auto it = mContentHashes.find(fileId);
+        if (it != mContentHashes.end()) {
+            const Path path = Location::path(fileId);
+            const uint64_t modified = path.lastModifiedMs();
+            if (!modified || modified == it->second.modified)
+                continue;
+            if (modified == it->second.verified) {
+                unchanged[fileId] = it->second.modified;
+            } else {
+                touched[fileId] = std::make_pair(path, modified);
+            }
+        }
+    }
+    if (touched.isEmpty()) {
+        callback(std::move(unchanged));
+        return;
+    }
+
+    auto hashAll = [](const Hash<uint32_t, std::pair<Path, uint64_t> > &files) -> Hash<uint32_t, uint64_t> {
+        Hash<uint32_t, uint64_t> hashes;
+        for (const auto &file : files)
+            hashes[file.first] = RTags::contentHash(file.second.first);
+        return hashes;
+    };
+    auto compare = [](Project *project, const Hash<uint32_t, std::pair<Path, uint64_t> > &touched,
+                      const Hash<uint32_t, uint64_t> &hashes, Hash<uint32_t, uint64_t> &unchanged) {
+        Set<uint32_t> verified;
+        for (const auto &hash : hashes) {
+            const auto it = project->mContentHashes.find(hash.first);
+            if (it != project->mContentHashes.end() && hash.second && it->second.hash == hash.second) {
+                unchanged[hash.first] = it->second.modified;
+                it->second.verified = touched.value(hash.first).second;
+                verified.insert(hash.first);
+            }
+        }
+        if (!verified.isEmpty())
+            project->logFiles(verified);
+    };
+
+    std::weak_ptr<Project> weak = shared_from_this();
+    Server::instance()->startBackgroundJob([weak, touched, unchanged, callback, hashAll, compare]() {
+            const Hash<uint32_t, uint64_t> hashes = hashAll(touched);
+            EventLoop::mainEventLoop()->callLater([weak, touched, hashes, unchanged, callback, compare]() {
+                    if (std::shared_ptr<Project> project = weak.lock()) {
+                        Hash<uint32_t, uint64_t> ret = unchanged;
+                        compare(project.get(), touched, hashes, ret);
+                        callback(std::move(ret));
+                    }
+                });
+        });
 }
 
 SourceList Project::sources(uint32_t fileId) const
@@ -992,42 +1727,53 @@ Set<uint32_t> Project::dependencies(uint32_t fileId, DependencyMode mode) const
         }
         return ret;
     }
+    ret = mDependencyIndex.closure(mDependencies, fileId,
+                                   mode == ArgDependsOn ? DependencyIndex::Includes : DependencyIndex::Dependents);
     ret.insert(fileId);
-    std::function<void(uint32_t)> fill = [&](uint32_t file) {
-        if (DependencyNode *node = mDependencies.value(file)) {
-            const auto &nodes = (mode == ArgDependsOn ? node->includes : node->dependents);
-            for (const auto &it : nodes) {
-                if (ret.insert(it.first))
-                    fill(it.first);
-            }
-        }
-    };
-    fill(fileId);
     return ret;
 }
 
 bool Project::dependsOn(uint32_t source, uint32_t header) const
 {
-    Set<uint32_t> seen;
-    std::function<bool(DependencyNode *node)> dep = [&](DependencyNode *node) {
-        assert(node);
-        if (!seen.insert(node->fileId))
-            return false;
-        if (node->dependents.contains(source))
-            return true;
-        for (const std::pair<uint32_t, DependencyNode*> &n : node->dependents) {
-            if (dep(n.second))
-                return true;
-        }
-        return false;
-    };
-    DependencyNode *node = mDependencies.value(header);
-    return node && dep(node);
+    return mDependencyIndex.contains(mDependencies, source, DependencyIndex::Includes, header);
+}
+
+uint64_t Project::estimatedCost(uint32_t fileId) const
+{
+    const auto it = mCosts.find(fileId);
+    if (it != mCosts.end())
+        return it->second.total();
+    return mCosts.isEmpty() ? 0 : mTotalCost / mCosts.size();
+}
+
+uint64_t Project::estimatedPeakRss(uint32_t fileId) const
+{
+    const auto it = mCosts.find(fileId);
+    if (it != mCosts.end())
+        return it->second.peakRss;
+    return mCosts.isEmpty() ? 0 : mTotalPeakRss / mCosts.size();
+}
+
+void Project::loadUsrFilter(uint32_t fileId)
+{
+    UnitFile unit;
+    if (!unit.load(unitFilePath(fileId)) || !mUsrFilters.set(fileId, unit.section(UnitFile::UsrsFilter)))
+        mUsrFilters.remove(fileId);
 }
 
 void Project::removeDependencies(uint32_t fileId)
 {
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mSystemUnits.remove(fileId);
+    }
+    mContentHashes.remove(fileId);
+    const IndexerCost cost = mCosts.take(fileId);
+    mTotalCost -= cost.total();
+    mTotalPeakRss -= cost.peakRss;
+    mUsrFilters.remove(fileId);
     if (DependencyNode *node = mDependencies.take(fileId)) {
+        mDependencyIndex.fileRemoved(fileId);
         for (auto it : node->includes)
             it.second->dependents.remove(fileId);
         for (auto it : node->dependents)
@@ -1041,6 +1787,8 @@ void Project::updateDependencies(const std::shared_ptr<IndexDataMessage> &msg)
     // error() << "updateDependencies" << Location::path(msg->fileId());
     const bool prune = !(msg->flags() & (IndexDataMessage::InclusionError|IndexDataMessage::ParseFailure));
     Set<uint32_t> includeErrors, dirty;
+    // includer -> what it included before the prune, see below
+    Hash<uint32_t, Set<uint32_t> > pruned;
     for (auto pair : msg->files()) {
         assert(pair.first);
         DependencyNode *&node = mDependencies[pair.first];
@@ -1050,8 +1798,11 @@ void Project::updateDependencies(const std::shared_ptr<IndexDataMessage> &msg)
 
         if (pair.second & IndexDataMessage::Visited) {
             if (prune) {
-                for (auto it : node->includes)
+                Set<uint32_t> &old = pruned[pair.first];
+                for (auto it : node->includes) {
                     it.second->dependents.remove(pair.first);
+                    old.insert(it.first);
+                }
                 node->includes.clear();
             }
             if (pair.second & IndexDataMessage::IncludeError) {
@@ -1081,8 +1832,21 @@ void Project::updateDependencies(const std::shared_ptr<IndexDataMessage> &msg)
             includer = new DependencyNode(it.first);
         if (!inclusiary)
             inclusiary = new DependencyNode(it.second);
+        if (!includer->includes.contains(it.second)) {
+            const auto old = pruned.find(it.first);
+            if (old != pruned.end() && old->second.contains(it.second)) {
+                old->second.remove(it.second);
+            } else {
+                mDependencyIndex.edgeChanged(it.first, it.second);
+            }
+        }
         includer->include(inclusiary);
     }
+    // Only the includes that didn't come back change any closures
+    for (const auto &old : pruned) {
+        for (uint32_t includee : old.second)
+            mDependencyIndex.edgeChanged(old.first, includee);
+    }
 
     if (!includeErrors.isEmpty()) {
         // error() << "releasing files";
@@ -1106,25 +1870,37 @@ int Project::reindex(const Match &match,
                      const std::shared_ptr<QueryMessage> &query,
                      const std::shared_ptr<Connection> &wait)
 {
-    if (query->type() == QueryMessage::Reindex) {
-        Set<uint32_t> dirtyFiles;
+    assert(query->type() == QueryMessage::Reindex);
+    Set<uint32_t> dirtyFiles;
 
-        const auto end = mDependencies.constEnd();
-        for (auto it = mDependencies.constBegin(); it != end; ++it) {
-            if (!dirtyFiles.contains(it->first) && (match.isEmpty() || match.match(Location::path(it->first)))) {
-                dirtyFiles.insert(it->first);
-            }
+    const auto end = mDependencies.constEnd();
+    for (auto it = mDependencies.constBegin(); it != end; ++it) {
+        if (!dirtyFiles.contains(it->first) && (match.isEmpty() || match.match(Location::path(it->first)))) {
+            dirtyFiles.insert(it->first);
         }
-        if (dirtyFiles.isEmpty())
-            return 0;
-        SimpleDirty dirty;
-        dirty.init(shared_from_this(), dirtyFiles);
-        return startDirtyJobs(&dirty, IndexerJob::Reindex, query->unsavedFiles(), wait);
-    } else {
-        assert(query->type() == QueryMessage::CheckReindex);
-        IfModifiedDirty dirty(shared_from_this(), match);
-        return startDirtyJobs(&dirty, IndexerJob::Dirty, query->unsavedFiles(), wait);
     }
+    if (dirtyFiles.isEmpty())
+        return 0;
+    SimpleDirty dirty;
+    dirty.init(shared_from_this(), dirtyFiles);
+    return startDirtyJobs(&dirty, IndexerJob::Reindex, query->unsavedFiles(), wait);
+}
+
+void Project::checkReindex(const Match &match,
+                           const std::shared_ptr<QueryMessage> &query,
+                           const std::shared_ptr<Connection> &wait,
+                           std::function<void(int)> &&callback)
+{
+    assert(query->type() == QueryMessage::CheckReindex);
+    Set<uint32_t> dependencies;
+    for (const auto &dep : mDependencies)
+        dependencies.insert(dep.first);
+    std::function<void(int)> done = std::move(callback);
+    findUnchangedFiles(dependencies, [this, match, query, wait, done](Hash<uint32_t, uint64_t> &&unchanged) {
+            IfModifiedDirty dirty(shared_from_this(), match);
+            dirty.mUnchanged = std::move(unchanged);
+            done(startDirtyJobs(&dirty, IndexerJob::Dirty, query->unsavedFiles(), wait));
+        });
 }
 
 int Project::remove(const Match &match)
@@ -1144,15 +1920,29 @@ int Project::startDirtyJobs(Dirty *dirty, Flags<IndexerJob::Flag> flags,
                             const UnsavedFiles &unsavedFiles,
                             const std::shared_ptr<Connection> &wait)
 {
-    const JobScheduler::JobScope scope(Server::instance()->jobScheduler());
     Set<uint32_t> toIndex;
     forEachSourceList([dirty, &toIndex](const SourceList &sourceList) -> VisitResult {
             if (dirty->isDirty(sourceList))
                 toIndex.insert(sourceList.fileId());
             return Continue;
         });
-    const Set<uint32_t> dirtyFiles = dirty->dirtied();
+    // The caller gets the count right away even if the jobs have to wait for
+    // queries to finish
+    startDirtyJobs(toIndex, dirty->dirtied(), flags, unsavedFiles, wait);
+    return toIndex.size();
+}
 
+void Project::startDirtyJobs(const Set<uint32_t> &toIndex, const Set<uint32_t> &dirtyFiles,
+                             Flags<IndexerJob::Flag> flags, const UnsavedFiles &unsavedFiles,
+                             const std::shared_ptr<Connection> &wait)
+{
+    if (mActiveQueries) {
+        deferWhileQuerying([this, toIndex, dirtyFiles, flags, unsavedFiles, wait]() {
+                startDirtyJobs(toIndex, dirtyFiles, flags, unsavedFiles, wait);
+            });
+        return;
+    }
+    const JobScheduler::JobScope scope(Server::instance()->jobScheduler());
     {
         std::lock_guard<std::mutex> lock(mMutex);
         for (const auto &fileId : dirtyFiles) {
@@ -1183,8 +1973,6 @@ int Project::startDirtyJobs(Dirty *dirty, Flags<IndexerJob::Flag> flags,
         }
         index(job);
     }
-
-    return toIndex.size();
 }
 
 bool Project::isIndexed(uint32_t fileId) const
@@ -1307,48 +2095,90 @@ void Project::findSymbols(const String &unencoded,
         lowerBound = string;
     }
 
-    auto processFile = [this, &lowerBound, &string, wildcard, cs, &inserter](uint32_t file) {
-        auto symNames = openSymbolNames(file);
-        if (!symNames)
-            return;
-        const int count = symNames->count();
-        // error() << "Looking at" << count << Location::path(dep.first)
+    // segment is set for the FileMaps of mSymbolNameIndex
+    auto process = [this, &lowerBound, &string, wildcard, cs, &inserter](const std::shared_ptr<FileMap<String, Set<Location> > > &symNames,
+                                                                         const ProjectIndex<Location>::Segment *segment,
+                                                                         const List<uint32_t> *candidates) {
+        // error() << "Looking at" << symNames->count() << Location::path(dep.first)
         //         << lowerBound << string;
-        uint32_t idx = 0;
-        if (!lowerBound.isEmpty()) {
-            idx = symNames->lowerBound(lowerBound);
-            if (idx == std::numeric_limits<uint32_t>::max()) {
-                return;
-            }
-        }
-
-        for (int i=idx; i<count; ++i) {
-            const String entry = symNames->keyAt(i);
-            // error() << i << count << entry;
+        String buffer;
+        // returns false if no later key can match
+        auto visit = [&](const StringView &entry, uint32_t index) -> bool {
             SymbolMatchType type = Exact;
             if (!string.isEmpty()) {
                 if (wildcard) {
-                    if (!Rct::wildCmp(string.constData(), entry.constData(), cs)) {
-                        continue;
+                    buffer.assign(entry.data(), entry.size());
+                    if (!Rct::wildCmp(string.constData(), buffer.constData(), cs)) {
+                        return true;
                     }
                     type = Wildcard;
                 } else if (!entry.startsWith(string, cs)) {
-                    if (cs == String::CaseInsensitive) {
-                        continue;
-                    } else {
-                        break;
-                    }
-                    type = StartsWith;
+                    return cs == String::CaseInsensitive;
                 } else if (entry.size() != string.size()) {
                     type = StartsWith;
                 }
             }
-            inserter(type, entry, symNames->valueAt(i));
+            if (segment) {
+                Set<Location> locations = symNames->valueAt(index);
+                auto it = locations.begin();
+                while (it != locations.end()) {
+                    if (!mSymbolNameIndex.isLive(*segment, it->fileId()) || !mDependencies.contains(it->fileId())) {
+                        locations.erase(it++);
+                    } else {
+                        ++it;
+                    }
+                }
+                if (!locations.isEmpty())
+                    inserter(type, entry.toString(), locations);
+            } else {
+                inserter(type, entry.toString(), symNames->valueAt(index));
+            }
+            return true;
+        };
+
+        if (candidates) {
+            for (uint32_t index : *candidates) {
+                if (!visit(symNames->keyViewAt(index), index))
+                    break;
+            }
+            return;
+        }
+
+        uint32_t idx = 0;
+        if (!lowerBound.isEmpty()) {
+            idx = symNames->lowerBound(lowerBound);
+            if (idx == std::numeric_limits<uint32_t>::max()) {
+                return;
+            }
+        }
+
+        const auto keys = symNames->keyViews(idx);
+        for (auto key = keys.begin(); key != keys.end(); ++key) {
+            if (!visit(*key, key.index()))
+                break;
         }
     };
 
+    auto processFile = [this, &process](uint32_t file) {
+        if (auto symNames = openSymbolNames(file))
+            process(symNames, 0, 0);
+    };
+
     if (fileFilter) {
         processFile(fileFilter);
+    } else if (mSymbolNameIndex.isValid()) {
+        // Searches that can't use lowerBound only look at names that contain
+        // all trigrams of the pattern
+        for (const auto &segment : mSymbolNameIndex.segments()) {
+            List<uint32_t> candidates;
+            const bool useTrigrams = (lowerBound.isEmpty() && !string.isEmpty() && segment.trigrams
+                                      && segment.trigrams->candidates(string, wildcard, candidates));
+            process(segment.fileMap, &segment, useTrigrams ? &candidates : 0);
+        }
+        for (uint32_t file : mSymbolNameIndex.dirtyFiles()) {
+            if (mDependencies.contains(file))
+                processFile(file);
+        }
     } else {
         for (const auto &dep : mDependencies) {
             processFile(dep.first);
@@ -1356,33 +2186,142 @@ void Project::findSymbols(const String &unencoded,
     }
 }
 
-List<RTags::SortedSymbol> Project::sort(const Set<Symbol> &symbols, Flags<QueryMessage::Flag> flags)
+bool Project::findSymbolNames(const String &pattern, bool wildcard, String::CaseSensitivity cs,
+                              const Set<uint32_t> &files, size_t maxCandidates,
+                              const std::function<void(const StringView &, const Set<Location> &)> &func,
+                              Set<uint32_t> &dirty)
 {
-    List<RTags::SortedSymbol> sorted;
-    sorted.reserve(symbols.size());
-    for (const Symbol &symbol : symbols) {
-        RTags::SortedSymbol node(symbol.location);
-        if (!symbol.isNull()) {
-            node.isDefinition = symbol.isDefinition();
-            if (flags & QueryMessage::DeclarationOnly && node.isDefinition) {
-                const Symbol decl = findTarget(symbol);
-                if (!decl.isNull() && !decl.isDefinition()) {
-                    assert(decl.usr == symbol.usr);
+    if (!mSymbolNameIndex.isValid())
+        return false;
+    List<std::pair<const ProjectIndex<Location>::Segment *, List<uint32_t> > > found;
+    size_t count = 0;
+    for (const auto &segment : mSymbolNameIndex.segments()) {
+        List<uint32_t> candidates;
+        if (!segment.trigrams || !segment.trigrams->candidates(pattern, wildcard, candidates))
+            return false;
+        count += candidates.size();
+        if (count > maxCandidates)
+            return false;
+        found.append(std::make_pair(&segment, std::move(candidates)));
+    }
+
+    String buffer;
+    for (const auto &segment : found) {
+        const FileMap<String, Set<Location> > &symNames = *segment.first->fileMap;
+        for (uint32_t index : segment.second) {
+            const StringView name = symNames.keyViewAt(index);
+            if (wildcard) {
+                buffer.assign(name.data(), name.size());
+                if (!Rct::wildCmp(pattern.constData(), buffer.constData(), cs))
                     continue;
+            } else if (!name.contains(pattern, cs)) {
+                continue;
+            }
+            Set<Location> locations = symNames.valueAt(index);
+            auto it = locations.begin();
+            while (it != locations.end()) {
+                if (!files.contains(it->fileId()) || !mSymbolNameIndex.isLive(*segment.first, it->fileId())) {
+                    locations.erase(it++);
+                } else {
+                    ++it;
+                }
+            }
+            if (!locations.isEmpty())
+                func(name, locations);
+        }
+    }
+    for (uint32_t file : files) {
+        if (mSymbolNameIndex.isDirty(file))
+            dirty.insert(file);
+    }
+    return true;
+}
+
+void Project::visitSymbolNames(uint32_t fileFilter,
+                               const std::function<bool(const StringView &, const std::function<Set<Location>()> &)> &visitor)
+{
+    // segment is set for the FileMaps of mSymbolNameIndex
+    auto process = [this, &visitor](const FileMap<String, Set<Location> > &symNames,
+                                    const ProjectIndex<Location>::Segment *segment) -> bool {
+        uint32_t index = 0;
+        const std::function<Set<Location>()> locations = [this, &symNames, segment, &index]() {
+            Set<Location> ret = symNames.valueAt(index);
+            if (segment) {
+                auto it = ret.begin();
+                while (it != ret.end()) {
+                    if (!mSymbolNameIndex.isLive(*segment, it->fileId()) || !mDependencies.contains(it->fileId())) {
+                        ret.erase(it++);
+                    } else {
+                        ++it;
+                    }
                 }
-            } else if (flags & QueryMessage::DefinitionOnly && !node.isDefinition) {
+            }
+            return ret;
+        };
+        const auto keys = symNames.keyViews();
+        for (auto key = keys.begin(); key != keys.end(); ++key) {
+            index = key.index();
+            if (!visitor(*key, locations))
+                return false;
+        }
+        return true;
+    };
+
+    auto processFile = [this, &process](uint32_t file) -> bool {
+        auto symNames = openSymbolNames(file);
+        return !symNames || process(*symNames, 0);
+    };
+
+    if (fileFilter) {
+        processFile(fileFilter);
+    } else if (mSymbolNameIndex.isValid()) {
+        for (const auto &segment : mSymbolNameIndex.segments()) {
+            if (!process(*segment.fileMap, &segment))
+                return;
+        }
+        for (uint32_t file : mSymbolNameIndex.dirtyFiles()) {
+            if (mDependencies.contains(file) && !processFile(file))
+                return;
+        }
+    } else {
+        for (const auto &dep : mDependencies) {
+            if (!processFile(dep.first))
+                return;
+        }
+    }
+}
+
+List<RTags::SortedSymbol> Project::sort(const Set<Location> &locations, Flags<QueryMessage::Flag> flags, int max)
+{
+    List<RTags::SortedSymbol> sorted;
+    sorted.reserve(locations.size());
+    Set<Location> seen;
+    for (Location location : locations) {
+        const SymbolCore core = findSymbolCore(location);
+        if (core.isNull() || seen.contains(core.location))
+            continue;
+        seen.insert(core.location);
+        RTags::SortedSymbol node(core.location, core.isDefinition(), core.kind);
+        if (flags & QueryMessage::DeclarationOnly && node.isDefinition) {
+            const Symbol symbol = findSymbol(core.location);
+            const Symbol decl = findTarget(symbol);
+            if (!decl.isNull() && !decl.isDefinition()) {
+                assert(decl.usr == symbol.usr);
                 continue;
             }
-            node.kind = symbol.kind;
+        } else if (flags & QueryMessage::DefinitionOnly && !node.isDefinition) {
+            continue;
         }
         sorted.push_back(node);
     }
 
+    const size_t count = max >= 0 ? std::min<size_t>(max, sorted.size()) : sorted.size();
     if (flags & QueryMessage::ReverseSort) {
-        std::sort(sorted.begin(), sorted.end(), std::greater<RTags::SortedSymbol>());
+        std::partial_sort(sorted.begin(), sorted.begin() + count, sorted.end(), std::greater<RTags::SortedSymbol>());
     } else {
-        std::sort(sorted.begin(), sorted.end());
+        std::partial_sort(sorted.begin(), sorted.begin() + count, sorted.end());
     }
+    sorted.resize(count);
     return sorted;
 }
 
@@ -1467,37 +2406,52 @@ String Project::toCompileCommands() const
 
 Symbol Project::findSymbol(Location location, int *index)
 {
+    int idx;
     if (index)
         *index = -1;
-    if (location.isNull())
+    if (findSymbolCore(location, &idx).isNull())
         return Symbol();
     auto symbols = openSymbols(location.fileId());
-    if (!symbols || !symbols->count())
+    if (!symbols || static_cast<uint32_t>(idx) >= symbols->count())
         return Symbol();
+    if (index)
+        *index = idx;
+    return symbols->valueAt(idx);
+}
+
+SymbolCore Project::findSymbolCore(Location location, int *index)
+{
+    if (index)
+        *index = -1;
+    if (location.isNull())
+        return SymbolCore();
+    auto cores = openSymbolCores(location.fileId());
+    if (!cores || !cores->count())
+        return SymbolCore();
 
     bool exact = false;
-    uint32_t idx = symbols->lowerBound(location, &exact);
+    uint32_t idx = cores->lowerBound(location, &exact);
     if (exact) {
         if (index)
             *index = idx;
-        return symbols->valueAt(idx);
+        return cores->valueAt(idx);
     }
     switch (idx) {
     case 0:
-        return Symbol();
+        return SymbolCore();
     case std::numeric_limits<uint32_t>::max():
-        idx = symbols->count() - 1;
+        idx = cores->count() - 1;
         break;
     default:
         --idx;
         break;
     }
 
-    const Symbol &ret = symbols->valueAt(idx);
+    const SymbolCore ret = cores->valueAt(idx);
     if (ret.location.fileId() != location.fileId()
         || ret.location.line() != location.line()
         || (location.column() - ret.location.column() >= ret.symbolLength)) {
-        return Symbol();
+        return SymbolCore();
     }
     if (index)
         *index = idx;
@@ -1562,7 +2516,24 @@ Set<Symbol> Project::findByUsr(const String &usr, uint32_t fileId, DependencyMod
     assert(fileId);
     Set<Symbol> ret;
     String tusr = Sandbox::encoded(usr);
-    for (uint32_t file : dependencies(fileId, mode)) {
+    Set<uint32_t> files;
+    if (filesForUsr(tusr, files)) {
+        if (mode != All) {
+            const Set<uint32_t> deps = dependencies(fileId, mode);
+            auto it = files.begin();
+            while (it != files.end()) {
+                if (!deps.contains(*it)) {
+                    files.erase(it++);
+                } else {
+                    ++it;
+                }
+            }
+        }
+    } else {
+        files = dependencies(fileId, mode);
+    }
+    mUsrFilters.filter(files, tusr);
+    for (uint32_t file : files) {
         auto usrs = openUsrs(file);
         // error() << usrs << Location::path(file) << usr;
         if (usrs) {
@@ -1589,47 +2560,72 @@ Set<Symbol> Project::findByUsr(const String &usr, uint32_t fileId, DependencyMod
     return ret;
 }
 
-static Set<Symbol> findReferences(const Set<Symbol> &inputs,
-                                  const std::shared_ptr<Project> &project,
-                                  std::function<bool(const Symbol &, const Symbol &)> filter)
+// Returns false if visitor stopped it
+static bool findReferences(const Set<Symbol> &inputs,
+                           const std::shared_ptr<Project> &project,
+                           std::function<bool(const Symbol &, const Symbol &)> filter,
+                           const Project::SymbolVisitor &visitor)
 {
     Set<Symbol> ret;
     // const bool isClazz = s.isClass();
     for (const Symbol &input : inputs) {
         //warning() << "Calling findReferences" << input.location;
+        // SBROOT
+        const String tusr = Sandbox::encoded(input.usr);
+        const uint64_t hash = UsrFilter::hash(tusr);
         auto process = [&](uint32_t dep) {
             // error() << "Looking at file" << Location::path(dep) << "for input" << input.location;
+            if (!project->mightHaveUsr(dep, hash))
+                return true;
             auto targets = project->openTargets(dep);
             if (targets) {
-                // SBROOT
-                const String tusr = Sandbox::encoded(input.usr);
                 const Set<Location> locations = targets->value(tusr);
                 // error() << "Got locations for usr" << input.usr << locations;
                 for (const auto &loc : locations) {
                     auto sym = project->findSymbol(loc);
-                    if (filter(input, sym))
-                        ret.insert(sym);
+                    if (filter(input, sym) && ret.insert(sym) && !visitor(sym))
+                        return false;
                 }
             }
+            return true;
         };
         const Set<uint32_t> deps = project->dependencies(input.location.fileId(), Project::DependsOnArg);
-        for (auto dep : deps)
-            process(dep);
+        Set<uint32_t> files;
+        if (project->filesForUsr(tusr, files)) {
+            for (auto file : files) {
+                if (deps.contains(file) && !process(file))
+                    return false;
+            }
+
+            if (ret.isEmpty()) {
+                for (auto file : files) {
+                    if (!deps.contains(file) && !process(file))
+                        return false;
+                }
+            }
+            continue;
+        }
+
+        for (auto dep : deps) {
+            if (!process(dep))
+                return false;
+        }
 
         if (ret.isEmpty()) {
             for (auto dep : project->dependencies()) {
-                if (!deps.contains(dep.first))
-                    process(dep.first);
+                if (!deps.contains(dep.first) && !process(dep.first))
+                    return false;
             }
         }
     }
-    return ret;
+    return true;
 }
 
-static Set<Symbol> findReferences(const Symbol &in,
-                                  const std::shared_ptr<Project> &project,
-                                  std::function<bool(const Symbol &, const Symbol &)> filter,
-                                  Set<Symbol> *inputsPtr = 0)
+static bool findReferences(const Symbol &in,
+                           const std::shared_ptr<Project> &project,
+                           std::function<bool(const Symbol &, const Symbol &)> filter,
+                           const Project::SymbolVisitor &visitor,
+                           Set<Symbol> *inputsPtr = 0)
 {
     Set<Symbol> inputs;
     Symbol s;
@@ -1681,17 +2677,32 @@ static Set<Symbol> findReferences(const Symbol &in,
         inputs.insert(s);
         break;
     case CXCursor_FirstInvalid:
-        return Set<Symbol>();
+        return true;
     }
     if (inputsPtr)
         *inputsPtr = inputs;
-    return findReferences(inputs, project, filter);
+    return findReferences(inputs, project, filter, visitor);
+}
+
+static Project::SymbolVisitor inserter(Set<Symbol> &symbols)
+{
+    return [&symbols](const Symbol &symbol) {
+        symbols.insert(symbol);
+        return true;
+    };
 }
 
 Set<Symbol> Project::findCallers(const Symbol &symbol)
+{
+    Set<Symbol> ret;
+    findCallers(symbol, inserter(ret));
+    return ret;
+}
+
+void Project::findCallers(const Symbol &symbol, const SymbolVisitor &visitor)
 {
     const bool isClazz = symbol.isClass();
-    return ::findReferences(symbol, shared_from_this(), [isClazz](const Symbol &input, const Symbol &ref) {
+    ::findReferences(symbol, shared_from_this(), [isClazz](const Symbol &input, const Symbol &ref) {
             if (isClazz && (ref.isConstructorOrDestructor() || ref.kind == CXCursor_CallExpr))
                 return false;
             if (ref.isReference()
@@ -1702,32 +2713,57 @@ Set<Symbol> Project::findCallers(const Symbol &symbol)
                 return true;
             }
             return false;
-        });
+        }, visitor);
 }
 
 Set<Symbol> Project::findAllReferences(const Symbol &symbol)
+{
+    Set<Symbol> ret;
+    findAllReferences(symbol, inserter(ret));
+    return ret;
+}
+
+void Project::findAllReferences(const Symbol &symbol, const SymbolVisitor &visitor)
 {
     if (symbol.isNull())
-        return Set<Symbol>();
+        return;
 
     Set<Symbol> inputs;
     inputs.insert(symbol);
     inputs.unite(findByUsr(symbol.usr, symbol.location.fileId(), modeForSymbol(symbol)));
-    Set<Symbol> ret = inputs;
+    Set<Symbol> seen;
+    auto visit = [&seen, &visitor](const Symbol &s) {
+        return !seen.insert(s) || visitor(s);
+    };
+    for (const auto &input : inputs) {
+        if (!visit(input))
+            return;
+    }
     for (const auto &input : inputs) {
         Set<Symbol> inputLocations;
-        ret.unite(::findReferences(input, shared_from_this(), [](const Symbol &, const Symbol &) {
+        if (!::findReferences(input, shared_from_this(), [](const Symbol &, const Symbol &) {
                     return true;
-                }, &inputLocations));
-        ret.unite(inputLocations);
+                }, visit, &inputLocations)) {
+            return;
+        }
+        for (const auto &inputLocation : inputLocations) {
+            if (!visit(inputLocation))
+                return;
+        }
     }
-    return ret;
 }
 
 Set<Symbol> Project::findVirtuals(const Symbol &symbol)
+{
+    Set<Symbol> ret;
+    findVirtuals(symbol, inserter(ret));
+    return ret;
+}
+
+void Project::findVirtuals(const Symbol &symbol, const SymbolVisitor &visitor)
 {
     if (symbol.kind != CXCursor_CXXMethod || !(symbol.flags & Symbol::VirtualMethod))
-        return Set<Symbol>();
+        return;
 
     Symbol parent = [this](const Symbol &sym) {
         for (const String &usr : findTargetUsrs(sym.location)) {
@@ -1749,20 +2785,25 @@ Set<Symbol> Project::findVirtuals(const Symbol &symbol)
         }
     }
 
+    Set<Symbol> seen;
+    auto visit = [&seen, &visitor](const Symbol &s) {
+        return !seen.insert(s) || visitor(s);
+    };
     Set<Symbol> symSet;
     symSet.insert(parent);
-    Set<Symbol> ret = ::findReferences(symSet, shared_from_this(), [](const Symbol &, const Symbol &ref) {
-            // error() << "considering" << ref.location << ref.kindSpelling();
-            if (ref.kind == CXCursor_CXXMethod) {
-                return true;
-            }
-            return false;
-        });
-    ret.insert(parent);
+    if (!::findReferences(symSet, shared_from_this(), [](const Symbol &, const Symbol &ref) {
+                // error() << "considering" << ref.location << ref.kindSpelling();
+                if (ref.kind == CXCursor_CXXMethod) {
+                    return true;
+                }
+                return false;
+            }, visit)
+        || !visit(parent)) {
+        return;
+    }
     const Symbol target = findTarget(parent);
     if (!target.isNull())
-        ret.insert(target);
-    return ret;
+        visit(target);
 }
 
 Set<String> Project::findTargetUsrs(Location loc)
@@ -1807,7 +2848,11 @@ Set<Symbol> Project::findSubclasses(const Symbol &symbol)
 {
     assert(symbol.isClass() && symbol.isDefinition());
     Set<Symbol> ret;
+    Set<uint32_t> files;
+    const bool indexed = filesForUsr(Sandbox::encoded(symbol.usr), files);
     for (uint32_t dep : dependencies(symbol.location.fileId(), DependsOnArg)) {
+        if (indexed && !files.contains(dep))
+            continue;
         auto symbols = openSymbols(dep);
         if (symbols) {
             const int count = symbols->count();
@@ -1823,14 +2868,160 @@ Set<Symbol> Project::findSubclasses(const Symbol &symbol)
 
 void Project::beginScope()
 {
-    assert(!mFileMapScope);
-    mFileMapScope.reset(new FileMapScope(shared_from_this(), Server::instance()->options().maxFileMapScopeCacheSize));
+    std::shared_ptr<FileMapScope> scope(new FileMapScope(shared_from_this(), Server::instance()->options().maxFileMapScopeCacheSize));
+    if (EventLoop::isMainThread()) {
+        assert(!mFileMapScope);
+        mFileMapScope = scope;
+    } else {
+        std::lock_guard<std::mutex> lock(mMutex);
+        std::shared_ptr<FileMapScope> &threadScope = mThreadFileMapScopes[std::this_thread::get_id()];
+        assert(!threadScope);
+        threadScope = scope;
+    }
 }
 
 void Project::endScope()
 {
-    assert(mFileMapScope);
-    mFileMapScope.reset();
+    std::shared_ptr<FileMapScope> scope;
+    if (EventLoop::isMainThread()) {
+        assert(mFileMapScope);
+        std::swap(scope, mFileMapScope);
+    } else {
+        std::lock_guard<std::mutex> lock(mMutex);
+        scope = mThreadFileMapScopes.take(std::this_thread::get_id());
+        assert(scope);
+    }
+    // destroyed outside of the lock since it might call validateAll()
+}
+
+std::shared_ptr<Project::FileMapScope> Project::fileMapScope() const
+{
+    if (EventLoop::isMainThread())
+        return mFileMapScope;
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mThreadFileMapScopes.value(std::this_thread::get_id());
+}
+
+bool Project::fileMapGeneration(uint32_t fileId, uint32_t *generation) const
+{
+    if (!Server::instance()->fileMapCache())
+        return false;
+    uint64_t changes;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        const auto it = mFileMapGenerations.find(fileId);
+        if (it != mFileMapGenerations.end()) {
+            *generation = it->second;
+            return true;
+        }
+        changes = mFileMapChanges;
+    }
+    *generation = UnitFile::readGeneration(unitFilePath(fileId));
+    std::lock_guard<std::mutex> lock(mMutex);
+    // a unit file published while we were reading the header might be newer
+    if (changes == mFileMapChanges)
+        mFileMapGenerations[fileId] = *generation;
+    return true;
+}
+
+std::shared_ptr<void> Project::findCachedFileMap(FileMapType type, uint32_t fileId, uint32_t generation) const
+{
+    if (std::shared_ptr<FileMapCache> cache = Server::instance()->fileMapCache())
+        return cache->find(this, type, fileId, generation);
+    return std::shared_ptr<void>();
+}
+
+void Project::insertCachedFileMap(FileMapType type, uint32_t fileId, const UnitFile &unit, const Path &path,
+                                  const std::shared_ptr<void> &fileMap) const
+{
+    std::shared_ptr<FileMapCache> cache = Server::instance()->fileMapCache();
+    if (!cache)
+        return;
+    // the file might have moved to or from a system unit since
+    if (unitFilePath(fileId) != path)
+        return;
+    // rp might have published a new version while we were loading it
+    std::lock_guard<std::mutex> lock(mMutex);
+    const auto it = mFileMapGenerations.find(fileId);
+    if (it != mFileMapGenerations.end() && it->second == unit.generation())
+        cache->insert(this, type, fileId, unit.generation(), fileMap, unit.size());
+}
+
+void Project::fileMapsChanged(const Set<uint32_t> &fileIds)
+{
+    std::shared_ptr<FileMapCache> cache = Server::instance()->fileMapCache();
+    std::lock_guard<std::mutex> lock(mMutex);
+    ++mFileMapChanges;
+    for (uint32_t fileId : fileIds) {
+        mFileMapGenerations.remove(fileId);
+        if (cache)
+            cache->remove(this, fileId);
+    }
+}
+
+bool Project::useSystemUnit(uint32_t fileId, uint64_t key)
+{
+    std::shared_ptr<SystemUnitStore> store = Server::instance()->systemUnitStore();
+    if (!store || !store->isCurrent(fileId, key))
+        return false;
+    if (mSystemUnits.value(fileId) != key) {
+        mSystemUnits[fileId] = key;
+        mSystemUnitsChanged.insert(fileId);
+        ++mFileMapChanges;
+        mFileMapGenerations.remove(fileId);
+        if (std::shared_ptr<FileMapCache> cache = Server::instance()->fileMapCache())
+            cache->remove(this, fileId);
+    }
+    return true;
+}
+
+Path Project::unitFilePath(uint32_t fileId) const
+{
+    if (std::shared_ptr<SystemUnitStore> store = Server::instance()->systemUnitStore()) {
+        std::lock_guard<std::mutex> lock(mMutex);
+        const auto it = mSystemUnits.find(fileId);
+        if (it != mSystemUnits.end())
+            return store->unitFilePath(fileId, it->second);
+    }
+    return sourceFilePath(fileId, "unit");
+}
+
+void Project::startQuery(std::function<void()> &&start)
+{
+    assert(EventLoop::isMainThread());
+    // Letting queries in while a change is waiting would let a steady stream
+    // of them hold it back forever
+    if (!mDeferredUntilIdle.isEmpty()) {
+        mQueuedQueries.append(std::move(start));
+        return;
+    }
+    ++mActiveQueries;
+    start();
+}
+
+void Project::endQuery()
+{
+    assert(EventLoop::isMainThread());
+    assert(mActiveQueries > 0);
+    if (--mActiveQueries)
+        return;
+    List<std::function<void()> > deferred = std::move(mDeferredUntilIdle);
+    for (const auto &func : deferred)
+        func();
+    List<std::function<void()> > queued = std::move(mQueuedQueries);
+    for (const auto &start : queued) {
+        ++mActiveQueries;
+        start();
+    }
+}
+
+bool Project::deferWhileQuerying(std::function<void()> &&func)
+{
+    assert(EventLoop::isMainThread());
+    if (!mActiveQueries)
+        return false;
+    mDeferredUntilIdle.append(std::move(func));
+    return true;
 }
 
 static String addDeps(const Dependencies &deps)
@@ -1969,6 +3160,8 @@ String Project::dumpDependencies(uint32_t fileId, const List<String> &args, Flag
 
 void Project::dirty(uint32_t fileId)
 {
+    if (deferWhileQuerying(std::bind(&Project::dirty, this, fileId)))
+        return;
     SimpleDirty dirty;
     Set<uint32_t> dirtyFiles;
     dirtyFiles.insert(fileId);
@@ -1977,48 +3170,33 @@ void Project::dirty(uint32_t fileId)
 }
 
 bool Project::validate(uint32_t fileId, ValidateMode mode, String *err) const
+{
+    return validate(fileId, unitFilePath(fileId), mode, err);
+}
+
+bool Project::validate(uint32_t fileId, const Path &path, ValidateMode mode, String *err)
 {
     if (mode == Validate) {
-        Path path;
         String error;
-        const uint32_t opts = fileMapOptions();
-        {
-            path = sourceFilePath(fileId, fileMapName(SymbolNames));
-            FileMap<String, Set<Location> > fileMap;
-            if (!fileMap.load(path, opts, &error))
-                goto error;
-        }
-        {
-            path = sourceFilePath(fileId, fileMapName(Symbols));
-            FileMap<Location, Symbol> fileMap;
-            if (!fileMap.load(path, opts, &error))
-                goto error;
-        }
-        {
-            path = sourceFilePath(fileId, fileMapName(Targets));
-            FileMap<String, Set<Location> > fileMap;
-            if (!fileMap.load(path, opts, &error))
-                goto error;
-        }
-        {
-            path = sourceFilePath(fileId, fileMapName(Usrs));
-            FileMap<String, Set<Location> > fileMap;
-            if (!fileMap.load(path, opts, &error))
-                goto error;
+        std::shared_ptr<UnitFile> unit = std::make_shared<UnitFile>();
+        if (unit->load(path, &error)) {
+            for (auto type : { Symbols, SymbolCores, SymbolNames, Targets, Usrs }) {
+                if (!unit->contains(static_cast<UnitFile::Section>(type))) {
+                    error = String::format<64>("%s missing", fileMapName(type));
+                    break;
+                }
+            }
+            if (error.isEmpty())
+                return true;
         }
-        return true;
-  error:
         if (err)
             Log(err) << "Error during validation:" << Location::path(fileId) << error << path;
         return false;
     } else {
         assert(mode == StatOnly);
-        for (auto type : { Symbols, SymbolNames, Targets, Usrs }) {
-            const Path p = sourceFilePath(fileId, fileMapName(type));
-            if (!p.isFile()) {
-                Log(err) << "Error during validation:" << Location::path(fileId) << p << "doesn't exist";
-                return false;
-            }
+        if (!path.isFile()) {
+            Log(err) << "Error during validation:" << Location::path(fileId) << path << "doesn't exist";
+            return false;
         }
     }
     return true;
@@ -2356,6 +3534,7 @@ String Project::estimateMemory() const
         deps += ::estimateMemory(*dep.second);
     }
     add("Dependencies", deps);
+    add("Usr filters", mUsrFilters.memoryUsage());
     add("Total", total);
     return String::join(ret, "\n");
 }
@@ -2394,14 +3573,6 @@ void Project::reloadCompileCommands()
     }
 }
 
-uint32_t Project::fileMapOptions() const
-{
-    uint32_t options = FileMap<int, int>::None;
-    if (Server::instance()->options().options & Server::NoFileLock)
-        options |= FileMap<int, int>::NoLock;
-    return options;
-}
-
 void Project::fixPCH(Source &source)
 {
     for (Source::Include &inc : source.includePaths) {
@@ -2486,6 +3657,13 @@ void Project::reindex(uint32_t fileId, Flags<IndexerJob::Flag> flags)
 
 void Project::processParseData(IndexParseData &&data)
 {
+    if (mActiveQueries) {
+        auto shared = std::make_shared<IndexParseData>(std::move(data));
+        deferWhileQuerying([this, shared]() { processParseData(std::move(*shared)); });
+        return;
+    }
+    // the sources aren't part of the project log
+    mSaveDirty = true;
     Set<uint32_t> index;
     Hash<uint32_t, uint32_t> removed;
     if (mIndexParseData.isEmpty()) {
@@ -2567,8 +3745,13 @@ void Project::processParseData(IndexParseData &&data)
     }
     removeSources(removed);
 
+    const bool twoPhase = Server::instance()->options().options & Server::TwoPhaseIndexing;
     for (uint32_t fileId : index) {
-        reindex(fileId, IndexerJob::Compile);
+        // Sources we have never indexed get a quick declarations only pass first
+        Flags<IndexerJob::Flag> flags = IndexerJob::Compile;
+        if (twoPhase && !mDependencies.contains(fileId))
+            flags |= IndexerJob::Declarations;
+        reindex(fileId, flags);
     }
 }
 
@@ -2742,12 +3925,19 @@ void Project::removeSources(const Hash<uint32_t, uint32_t> &removed)
 
 void Project::removeSource(uint32_t fileId)
 {
+    if (deferWhileQuerying(std::bind(&Project::removeSource, this, fileId)))
+        return;
+
     std::shared_ptr<IndexerJob> job = mActiveJobs.take(fileId);
     if (job) {
         releaseFileIds(job->visited);
         Server::instance()->jobScheduler()->abort(job);
     }
     removeDependencies(fileId);
+    logFiles(Set<uint32_t>() << fileId);
+    // the sources changed, they only make it to disk with save()
+    mSaveDirty = true;
+    fileMapsChanged(Set<uint32_t>() << fileId);
     Path::rmdir(sourceFilePath(fileId));
 }
 
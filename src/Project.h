@@ -16,16 +16,21 @@
 #ifndef Project_h
 #define Project_h
 
+#include <stdio.h>
 #include <cstdint>
 #include <mutex>
+#include <thread>
 
+#include "DependencyIndex.h"
 #include "Diagnostic.h"
 #include "FileMap.h"
 #include "IndexerJob.h"
 #include "IndexMessage.h"
 #include "QueryMessage.h"
 #include "IndexParseData.h"
+#include "ProjectIndex.h"
 #include "rct/EmbeddedLinkedList.h"
+#include "rct/EventLoop.h"
 #include "rct/FileSystemWatcher.h"
 #include "rct/Flags.h"
 #include "rct/Path.h"
@@ -34,6 +39,8 @@
 #include "rct/Serializer.h"
 #include "RTags.h"
 #include "Token.h"
+#include "UnitFile.h"
+#include "UsrFilter.h"
 
 class Connection;
 class Dirty;
@@ -71,24 +78,30 @@ class Project : public std::enable_shared_from_this<Project>
 public:
     Project(const Path &path);
     ~Project();
+    // Does nothing after the first call. Server only initializes the
+    // current project at startup, the others on first use.
     bool init();
+    bool isLoaded() const { return mLoaded; }
 
     std::shared_ptr<FileManager> fileManager() const { return mFileManager; }
 
     Path path() const { return mPath; }
     bool match(const Match &match, bool *indexed = 0) const;
 
+    // each type is stored as the section with the same value in the unit file
     enum FileMapType {
-        Symbols,
-        SymbolNames,
-        Targets,
-        Usrs,
-        Tokens
+        Symbols = UnitFile::Symbols,
+        SymbolCores = UnitFile::SymbolCores,
+        SymbolNames = UnitFile::SymbolNames,
+        Targets = UnitFile::Targets,
+        Usrs = UnitFile::Usrs,
+        Tokens = UnitFile::Tokens
     };
     static const char *fileMapName(FileMapType type)
     {
         switch (type) {
         case Symbols: return "symbols";
+        case SymbolCores: return "symcores";
         case SymbolNames: return "symnames";
         case Targets: return "targets";
         case Usrs: return "usrs";
@@ -98,29 +111,43 @@ public:
     }
     std::shared_ptr<FileMap<String, Set<Location> > > openSymbolNames(uint32_t fileId, String *err = 0)
     {
-        assert(mFileMapScope);
-        return mFileMapScope->openFileMap<String, Set<Location> >(SymbolNames, fileId, mFileMapScope->symbolNames, err);
+        const std::shared_ptr<FileMapScope> scope = fileMapScope();
+        assert(scope);
+        return scope->openFileMap<String, Set<Location> >(SymbolNames, fileId, scope->symbolNames, err);
     }
     std::shared_ptr<FileMap<Location, Symbol> > openSymbols(uint32_t fileId, String *err = 0)
     {
-        assert(mFileMapScope);
-        return mFileMapScope->openFileMap<Location, Symbol>(Symbols, fileId, mFileMapScope->symbols, err);
+        const std::shared_ptr<FileMapScope> scope = fileMapScope();
+        assert(scope);
+        return scope->openFileMap<Location, Symbol>(Symbols, fileId, scope->symbols, err);
+    }
+    std::shared_ptr<FileMap<Location, SymbolCore> > openSymbolCores(uint32_t fileId, String *err = 0)
+    {
+        const std::shared_ptr<FileMapScope> scope = fileMapScope();
+        assert(scope);
+        return scope->openFileMap<Location, SymbolCore>(SymbolCores, fileId, scope->symbolCores, err);
     }
     std::shared_ptr<FileMap<String, Set<Location> > > openTargets(uint32_t fileId, String *err = 0)
     {
-        assert(mFileMapScope);
-        return mFileMapScope->openFileMap<String, Set<Location> >(Targets, fileId, mFileMapScope->targets, err);
+        const std::shared_ptr<FileMapScope> scope = fileMapScope();
+        assert(scope);
+        return scope->openFileMap<String, Set<Location> >(Targets, fileId, scope->targets, err);
     }
+    // False if the unit of fileId can't have usr (UsrFilter::hash) in its
+    // targets or usrs
+    bool mightHaveUsr(uint32_t fileId, uint64_t hash) const { return mUsrFilters.mightContain(fileId, hash); }
     std::shared_ptr<FileMap<String, Set<Location> > > openUsrs(uint32_t fileId, String *err = 0)
     {
-        assert(mFileMapScope);
-        return mFileMapScope->openFileMap<String, Set<Location> >(Usrs, fileId, mFileMapScope->usrs, err);
+        const std::shared_ptr<FileMapScope> scope = fileMapScope();
+        assert(scope);
+        return scope->openFileMap<String, Set<Location> >(Usrs, fileId, scope->usrs, err);
     }
 
     std::shared_ptr<FileMap<uint32_t, Token> > openTokens(uint32_t fileId, String *err = 0)
     {
-        assert(mFileMapScope);
-        return mFileMapScope->openFileMap<uint32_t, Token>(Tokens, fileId, mFileMapScope->tokens, err);
+        const std::shared_ptr<FileMapScope> scope = fileMapScope();
+        assert(scope);
+        return scope->openFileMap<uint32_t, Token>(Tokens, fileId, scope->tokens, err);
     }
 
 
@@ -136,9 +163,17 @@ public:
                             const List<String> &args = List<String>(),
                             Flags<QueryMessage::Flag> flags = Flags<QueryMessage::Flag>()) const;
     const Hash<uint32_t, DependencyNode*> &dependencies() const { return mDependencies; }
+    const DependencyIndex &dependencyIndex() const { return mDependencyIndex; }
     DependencyNode *dependencyNode(uint32_t fileId) const { return mDependencies.value(fileId); }
 
     static bool readSources(const Path &path, IndexParseData &data, String *error);
+
+    // The content of an indexed file, see IndexDataMessage::ContentHashes.
+    // verified is the last modification time the file was found to still
+    // have that content at.
+    struct ContentHash {
+        uint64_t modified, verified, hash;
+    };
     enum SymbolMatchType {
         Exact,
         Wildcard,
@@ -149,12 +184,37 @@ public:
                      Flags<QueryMessage::Flag> queryFlags,
                      uint32_t fileFilter = 0);
 
+    /*
+     * Calls func for the names in the symbol name index that contain pattern
+     * (sandbox encoded), or match it if wildcard is set, with their locations
+     * in files. Only names that have every trigram of pattern are looked at.
+     * Returns false without calling func if there are more of those than
+     * maxCandidates or pattern has no trigrams. Files whose names aren't
+     * current in the index are added to dirty and have to be searched
+     * separately.
+     */
+    bool findSymbolNames(const String &pattern, bool wildcard, String::CaseSensitivity cs,
+                         const Set<uint32_t> &files, size_t maxCandidates,
+                         const std::function<void(const StringView &, const Set<Location> &)> &func,
+                         Set<uint32_t> &dirty);
+
+    /*
+     * Calls visitor for every symbol name in the project, or in fileFilter,
+     * without decoding anything but the name. locations() decodes the
+     * locations of the current name, with the ones from stale index entries
+     * removed. The name and locations() are only valid during the call.
+     * Stops when visitor returns false.
+     */
+    void visitSymbolNames(uint32_t fileFilter,
+                          const std::function<bool(const StringView &, const std::function<Set<Location>()> &)> &visitor);
+
     static bool matchSymbolName(const String &pattern, const String &symbolName, String::CaseSensitivity cs)
     {
         return Rct::wildCmp(pattern.constData(), symbolName.constData(), cs);
     }
 
     Symbol findSymbol(Location location, int *index = 0);
+    SymbolCore findSymbolCore(Location location, int *index = 0);
     Set<Symbol> findTargets(Location location) { return findTargets(findSymbol(location)); }
     Set<Symbol> findTargets(const Symbol &symbol);
     Symbol findTarget(Location location) { return RTags::bestTarget(findTargets(location)); }
@@ -165,16 +225,37 @@ public:
     Set<Symbol> findCallers(const Symbol &symbol);
     Set<Symbol> findVirtuals(Location location) { return findVirtuals(findSymbol(location)); }
     Set<Symbol> findVirtuals(const Symbol &symbol);
+    /*
+     * Visits each symbol the above would return once, as it's found. The
+     * lookup stops when visitor returns false, e.g. once --max is reached.
+     */
+    typedef std::function<bool(const Symbol &)> SymbolVisitor;
+    void findAllReferences(const Symbol &symbol, const SymbolVisitor &visitor);
+    void findCallers(const Symbol &symbol, const SymbolVisitor &visitor);
+    void findVirtuals(const Symbol &symbol, const SymbolVisitor &visitor);
     Set<String> findTargetUsrs(const Symbol &symbol);
     Set<String> findTargetUsrs(Location loc);
     Set<Symbol> findSubclasses(const Symbol &symbol);
 
     Set<Symbol> findByUsr(const String &usr, uint32_t fileId, DependencyMode mode);
+    // Files that may have usr (sandbox encoded) in their usrs or targets
+    // maps. Returns false if the usr index isn't available.
+    bool filesForUsr(const String &usr, Set<uint32_t> &files) const;
 
     Path sourceFilePath(uint32_t fileId, const char *path = "") const;
+    // Our own unit file or the one in the SystemUnitStore we use for fileId
+    Path unitFilePath(uint32_t fileId) const;
+    template <typename Key, typename Value>
+    bool loadFileMap(FileMapType type, uint32_t fileId, FileMap<Key, Value> &fileMap, String *error = 0) const
+    {
+        return UnitFile::load(unitFilePath(fileId), static_cast<UnitFile::Section>(type), fileMap, error);
+    }
 
-    List<RTags::SortedSymbol> sort(const Set<Symbol> &symbols,
-                                   Flags<QueryMessage::Flag> flags = Flags<QueryMessage::Flag>());
+    // Returns the first max, or all if max is -1, of the symbols at locations
+    // in sorted order. Only their SymbolCores are loaded.
+    List<RTags::SortedSymbol> sort(const Set<Location> &locations,
+                                   Flags<QueryMessage::Flag> flags = Flags<QueryMessage::Flag>(),
+                                   int max = -1);
 
     const Files &files() const { return mFiles; }
     Files &files() { return mFiles; }
@@ -194,15 +275,33 @@ public:
     SourceList sources(uint32_t fileId) const;
     Source source(uint32_t fileId, int buildIndex) const;
     bool hasSource(uint32_t fileId) const;
-    bool isActiveJob(uint32_t sourceFileId) { return !sourceFileId || mActiveJobs.contains(sourceFileId); }
+    // jobId 0 matches whichever job is indexing sourceFileId
+    bool isActiveJob(uint32_t sourceFileId, uint64_t jobId = 0)
+    {
+        if (!sourceFileId)
+            return true;
+        const std::shared_ptr<IndexerJob> job = mActiveJobs.value(sourceFileId);
+        return job && (!jobId || job->id == jobId);
+    }
     inline bool visitFile(uint32_t fileId, const Path &path, uint32_t sourceFileId);
     inline void releaseFileIds(const Set<uint32_t> &fileIds);
     String fixIts(uint32_t fileId) const;
     int reindex(const Match &match,
                 const std::shared_ptr<QueryMessage> &query,
                 const std::shared_ptr<Connection> &wait);
+    // --check-reindex, calls callback with the number of files dirtied once
+    // the touched ones have been hashed
+    void checkReindex(const Match &match,
+                      const std::shared_ptr<QueryMessage> &query,
+                      const std::shared_ptr<Connection> &wait,
+                      std::function<void(int)> &&callback);
     int remove(const Match &match);
     void onJobFinished(const std::shared_ptr<IndexerJob> &job, const std::shared_ptr<IndexDataMessage> &msg);
+    // What rp spent on this source last time, or the average over the
+    // project if it hasn't been indexed yet. 0 if nothing has been indexed.
+    uint64_t estimatedCost(uint32_t fileId) const;
+    // Peak RSS of rp in kilobytes, estimated the same way
+    uint64_t estimatedPeakRss(uint32_t fileId) const;
     String toCompileCommands() const;
     enum WatchMode {
         Watch_FileManager = 0x1,
@@ -236,14 +335,26 @@ public:
 
     void beginScope();
     void endScope();
+    // Queries running on the query thread pool read mDependencies and the file
+    // maps off the main thread. startQuery()/endQuery() are called on the main
+    // thread around them and changes to that state are deferred until the last
+    // one has finished. Queries that come in while a change is waiting are
+    // started after it has been applied.
+    void startQuery(std::function<void()> &&start);
+    void endQuery();
     void dirty(uint32_t fileId);
-    bool save();
+    // Background serializes on the calling thread and leaves writing the files
+    // to the background pool, the log stays in use until they're on disk
+    enum SaveMode {
+        Synchronous,
+        Background
+    };
+    bool save(SaveMode mode = Synchronous);
     void prepare(uint32_t fileId);
     String estimateMemory() const;
     String diagnosticsToString(Flags<QueryMessage::Flag> flags, uint32_t fileId);
     void diagnose(uint32_t fileId);
     void diagnoseAll();
-    uint32_t fileMapOptions() const;
     void fixPCH(Source &source);
     void includeCompletions(Flags<QueryMessage::Flag> flags, const std::shared_ptr<Connection> &conn, Source &&source) const;
     size_t bytesWritten() const { return mBytesWritten; }
@@ -281,8 +392,31 @@ private:
         Validate
     };
     bool validate(uint32_t fileId, ValidateMode mode, String *error = 0) const;
+    static bool validate(uint32_t fileId, const Path &unit, ValidateMode mode, String *error = 0);
+    // Checks the dependencies restored by init() on other threads
+    void checkDependencies(const Set<uint32_t> &dirty);
+    void finishRestore(const Set<uint32_t> &dirty, const Set<uint32_t> &missing, const Hash<uint32_t, String> &invalid,
+                       const Hash<uint32_t, String> &filters);
+    void loadUsrFilter(uint32_t fileId);
     void removeDependencies(uint32_t fileId);
     void updateDependencies(const std::shared_ptr<IndexDataMessage> &msg);
+    // Appends the current state of files to the project log, see save()
+    void logFiles(const Set<uint32_t> &files);
+    size_t replayLog(uint32_t previousGeneration, uint64_t previousOffset, bool *torn);
+    void restartLog(const List<String> &records = List<String>());
+    void appendLog(const String &record);
+    struct Checkpoint;
+    static bool writeCheckpoint(const std::shared_ptr<Checkpoint> &checkpoint, uint32_t generation,
+                                const Path &sourcesFilePath, const String &sources,
+                                const Path &projectFilePath, const String &project, String *error);
+    void finishCheckpoint(uint32_t generation, size_t size);
+    void updateProjectIndexes();
+    // Writes a segment of one of the project indexes on a thread
+    template <typename T>
+    void startIndexUpdate(ProjectIndex<T> Project::*index, FileMapType type, typename ProjectIndex<T>::Collect &&collect);
+    template <typename T>
+    void installIndex(ProjectIndex<T> Project::*index, FileMapType type,
+                      const std::shared_ptr<typename ProjectIndex<T>::Build> &build, size_t dirty, uint64_t started);
     void loadFailed(uint32_t fileId);
     void updateFixIts(const Set<uint32_t> &visited, FixIts &fixIts);
     Diagnostics updateDiagnostics(const Diagnostics &diagnostics);
@@ -290,7 +424,28 @@ private:
                        Flags<IndexerJob::Flag> type,
                        const UnsavedFiles &unsavedFiles = UnsavedFiles(),
                        const std::shared_ptr<Connection> &wait = std::shared_ptr<Connection>());
+    void startDirtyJobs(const Set<uint32_t> &toIndex, const Set<uint32_t> &dirtyFiles,
+                        Flags<IndexerJob::Flag> flags, const UnsavedFiles &unsavedFiles,
+                        const std::shared_ptr<Connection> &wait);
     void onDirtyTimeout(Timer *);
+    // Hashes the files that were modified since they were indexed on a
+    // thread and calls callback on the main thread with the ones whose
+    // content is unchanged, mapped to when the indexed content was written.
+    // Files found unchanged are remembered so they're only hashed again
+    // once they're touched again.
+    void findUnchangedFiles(const Set<uint32_t> &fileIds,
+                            std::function<void(Hash<uint32_t, uint64_t> &&unchanged)> &&callback);
+    bool deferWhileQuerying(std::function<void()> &&func);
+
+    // Server wide FileMapCache. A file's generation is the one in the header
+    // of its unit file, rp bumps it whenever it publishes new file maps.
+    bool fileMapGeneration(uint32_t fileId, uint32_t *generation) const;
+    std::shared_ptr<void> findCachedFileMap(FileMapType type, uint32_t fileId, uint32_t generation) const;
+    void insertCachedFileMap(FileMapType type, uint32_t fileId, const UnitFile &unit, const Path &path,
+                             const std::shared_ptr<void> &fileMap) const;
+    void fileMapsChanged(const Set<uint32_t> &fileIds);
+    // Called from visitFile() with mMutex held
+    bool useSystemUnit(uint32_t fileId, uint64_t key);
 
     struct FileMapScope {
         FileMapScope(const std::shared_ptr<Project> &proj, int m)
@@ -299,8 +454,17 @@ private:
         ~FileMapScope()
         {
             warning() << "Query opened" << totalOpened << "files for project" << project->path();
-            if (loadFailed)
-                project->validateAll();
+            if (loadFailed) {
+                if (EventLoop::isMainThread()) {
+                    project->validateAll();
+                } else {
+                    std::weak_ptr<Project> weak = project;
+                    EventLoop::mainEventLoop()->callLater([weak]() {
+                            if (std::shared_ptr<Project> proj = weak.lock())
+                                proj->validateAll();
+                        });
+                }
+            }
         }
 
         struct LRUKey {
@@ -339,10 +503,31 @@ private:
                 poke(type, fileId);
                 return it->second;
             }
-            const Path path = project->sourceFilePath(fileId, Project::fileMapName(type));
-            auto fileMap = std::make_shared<FileMap<Key, Value>>();
+            const Path path = project->unitFilePath(fileId);
+            uint32_t generation;
+            const bool cacheable = project->fileMapGeneration(fileId, &generation);
+            std::shared_ptr<FileMap<Key, Value> > fileMap;
+            if (cacheable)
+                fileMap = std::static_pointer_cast<FileMap<Key, Value> >(project->findCachedFileMap(type, fileId, generation));
+            bool loaded = fileMap.get();
             String err;
-            if (fileMap->load(path, project->fileMapOptions(), &err)) {
+            if (!loaded) {
+                // all types of a file share one mapping of its unit file
+                std::shared_ptr<UnitFile> unit = units.value(fileId).lock();
+                if (!unit) {
+                    unit = std::make_shared<UnitFile>();
+                    if (unit->load(path, &err)) {
+                        units[fileId] = unit;
+                    } else {
+                        unit.reset();
+                    }
+                }
+                fileMap = std::make_shared<FileMap<Key, Value>>();
+                loaded = unit && unit->open(static_cast<UnitFile::Section>(type), *fileMap, &err);
+                if (loaded && cacheable)
+                    project->insertCachedFileMap(type, fileId, *unit, path, fileMap);
+            }
+            if (loaded) {
                 ++totalOpened;
                 cache[fileId] = fileMap;
                 auto entry = std::make_shared<LRUEntry>(type, fileId);
@@ -361,6 +546,10 @@ private:
                         assert(symbols.contains(e->key.fileId));
                         symbols.remove(e->key.fileId);
                         break;
+                    case SymbolCores:
+                        assert(symbolCores.contains(e->key.fileId));
+                        symbolCores.remove(e->key.fileId);
+                        break;
                     case Targets:
                         assert(targets.contains(e->key.fileId));
                         targets.remove(e->key.fileId);
@@ -391,8 +580,10 @@ private:
 
         Hash<uint32_t, std::shared_ptr<FileMap<String, Set<Location> > > > symbolNames;
         Hash<uint32_t, std::shared_ptr<FileMap<Location, Symbol> > > symbols;
+        Hash<uint32_t, std::shared_ptr<FileMap<Location, SymbolCore> > > symbolCores;
         Hash<uint32_t, std::shared_ptr<FileMap<String, Set<Location> > > > targets, usrs;
         Hash<uint32_t, std::shared_ptr<FileMap<uint32_t, Token> > > tokens;
+        Hash<uint32_t, std::weak_ptr<UnitFile> > units;
         std::shared_ptr<Project> project;
         int openedFiles, totalOpened;
         const int max;
@@ -402,17 +593,27 @@ private:
         Map<LRUKey, std::shared_ptr<LRUEntry> > entryMap;
     };
 
+    std::shared_ptr<FileMapScope> fileMapScope() const;
+
     std::shared_ptr<FileMapScope> mFileMapScope;
+    Hash<std::thread::id, std::shared_ptr<FileMapScope> > mThreadFileMapScopes;
 
     const Path mPath, mSourceFilePathBase;
-    Path mProjectFilePath, mSourcesFilePath;
+    Path mProjectFilePath, mSourcesFilePath, mLogFilePath;
 
     Files mFiles;
 
     Hash<uint32_t, Path> mVisitedFiles;
+    // Files whose last indexing was a declarations only pass -> the source that did it
+    Hash<uint32_t, uint32_t> mDeclarationsOnly;
+    // System headers we read from the SystemUnitStore -> key, see useSystemUnit()
+    Hash<uint32_t, uint64_t> mSystemUnits;
+    Set<uint32_t> mSystemUnitsChanged;
     int mJobCounter, mJobsStarted;
 
     Diagnostics mDiagnostics;
+    Hash<uint32_t, ContentHash> mContentHashes;
+    Hash<uint32_t, IndexerCost> mCosts;
 
     Hash<uint32_t, std::shared_ptr<IndexerJob> > mActiveJobs;
 
@@ -427,16 +628,57 @@ private:
     FixIts mFixIts;
 
     Hash<uint32_t, DependencyNode*> mDependencies;
+    mutable DependencyIndex mDependencyIndex; // closures over mDependencies
+    ProjectIndex<Location> mSymbolNameIndex; // with trigrams over its keys
+    ProjectIndex<uint32_t> mUsrIndex; // usr -> files that have it in their usrs or targets
+    UsrFilters mUsrFilters;
     Set<uint32_t> mSuspendedFiles;
 
     size_t mBytesWritten;
-    bool mSaveDirty;
+    uint64_t mTotalCost, mTotalPeakRss; // sums over mCosts
+    bool mSaveDirty, mLoaded;
+
+    // Changes since the project file was written, see logFiles()
+    FILE *mLog;
+    uint32_t mLogGeneration;
+    uint32_t mLogHeaderGeneration; // older than mLogGeneration while a checkpoint is written
+    size_t mLogSize, mCheckpointSize;
+
+    // Orders the writes of the project and sources files, generation is the
+    // one that's on disk
+    struct Checkpoint {
+        Checkpoint() : generation(0) {}
+        std::mutex mutex;
+        uint32_t generation;
+    };
+    bool mSaving; // a checkpoint is being written in the background
+    std::shared_ptr<Checkpoint> mCheckpoint;
+    List<String> mPendingRecords; // logged since the one being written
+
+    int mActiveQueries;
+    List<std::function<void()> > mDeferredUntilIdle, mQueuedQueries;
+
+    // read from the unit files on demand, dropped when they change
+    mutable Hash<uint32_t, uint32_t> mFileMapGenerations;
+    uint64_t mFileMapChanges;
 
     mutable std::mutex mMutex;
 };
 
 RCT_FLAGS(Project::WatchMode);
 
+inline Serializer &operator<<(Serializer &s, const Project::ContentHash &hash)
+{
+    s << hash.modified << hash.verified << hash.hash;
+    return s;
+}
+
+inline Deserializer &operator>>(Deserializer &s, Project::ContentHash &hash)
+{
+    s >> hash.modified >> hash.verified >> hash.hash;
+    return s;
+}
+
 inline bool Project::visitFile(uint32_t visitFileId, const Path &path, uint32_t id)
 {
     assert(id);
@@ -447,9 +689,27 @@ inline bool Project::visitFile(uint32_t visitFileId, const Path &path, uint32_t
     assert(mActiveJobs.contains(id));
     std::shared_ptr<IndexerJob> &job = mActiveJobs[id];
     assert(job);
+    const bool declarations = job->flags & IndexerJob::Declarations;
+    if (!p.isEmpty() && !declarations && !job->visited.contains(visitFileId)) {
+        // A full pass takes over files that only got a declarations pass,
+        // unless that pass is still running
+        const auto it = mDeclarationsOnly.find(visitFileId);
+        if (it != mDeclarationsOnly.end()) {
+            const std::shared_ptr<IndexerJob> owner = mActiveJobs.value(it->second);
+            if (!owner || !(owner->flags & IndexerJob::Declarations)) {
+                mDeclarationsOnly.erase(it);
+                p.clear();
+            }
+        }
+    }
     if (p.isEmpty()) {
         p = path;
+        if (job->systemUnitKey && path.isSystem() && useSystemUnit(visitFileId, job->systemUnitKey))
+            return false; // another project indexed it with the same flags
+        mSystemUnits.remove(visitFileId);
         job->visited.insert(visitFileId);
+        if (declarations)
+            mDeclarationsOnly[visitFileId] = id;
         return true;
     }
     return job->visited.contains(visitFileId);
@@ -462,6 +722,7 @@ inline void Project::releaseFileIds(const Set<uint32_t> &fileIds)
         for (const auto &f : fileIds) {
             // error() << "Returning files" << Location::path(f);
             mVisitedFiles.remove(f);
+            mDeclarationsOnly.remove(f);
         }
     }
 }
@@ -0,0 +1,392 @@
+/* This file is part of RTags (http://rtags.net).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef ProjectIndex_h
+#define ProjectIndex_h
+
+#include <stdio.h>
+#include <unistd.h>
+#include <algorithm>
+#include <functional>
+#include <memory>
+
+#include "FileMap.h"
+#include "Location.h"
+#include "rct/Hash.h"
+#include "rct/List.h"
+#include "rct/Map.h"
+#include "rct/Path.h"
+#include "rct/Rct.h"
+#include "rct/Serializer.h"
+#include "rct/Set.h"
+#include "rct/String.h"
+#include "RTags.h"
+#include "TrigramIndex.h"
+
+inline uint32_t projectIndexFileId(Location location) { return location.fileId(); }
+inline uint32_t projectIndexFileId(uint32_t fileId) { return fileId; }
+
+/*
+ * A project wide String -> Set<T> index merged from the per-file FileMaps of
+ * every file in the project. T is either a Location or a fileId.
+ *
+ * The index is a list of segments, each a FileMap written from the per-file
+ * maps of the files that were dirty at the time and the live entries of the
+ * segments it replaces. A file's entries are live in the newest segment that
+ * has it, use isLive(). Small segments are merged into the one before them
+ * so an update costs about the size of what changed, and segments are written
+ * on a thread.
+ *
+ * Files whose per-file maps have changed since they were last written to a
+ * segment are reported by dirtyFiles() and have to be looked at separately.
+ * When the index isn't valid every file is dirty.
+ *
+ * <path>.segments lists the segments, <path>.<id> holds one,
+ * <path>.<id>.files the files it was written with and <path>.<id>.trigrams
+ * its TrigramIndex if the index was created with Trigrams.
+ */
+template <typename T>
+class ProjectIndex
+{
+public:
+    typedef FileMap<String, Set<T> > IndexMap;
+    typedef std::function<void(uint32_t, const Path &, Map<String, Set<T> > &)> Collect;
+    enum Flag {
+        None = 0x0,
+        Trigrams = 0x1
+    };
+    enum {
+        MaxSegments = 8
+    };
+
+    struct Segment
+    {
+        Segment()
+            : id(0), time(0)
+        {}
+
+        uint32_t id;
+        uint64_t time; // when the oldest of the per-file maps in it was read
+        Set<uint32_t> files;
+        std::shared_ptr<IndexMap> fileMap;
+        std::shared_ptr<TrigramIndex> trigrams;
+    };
+
+    // What update() built on a thread, see install()
+    struct Build
+    {
+        uint32_t generation;
+        Segment segment;
+        Set<uint32_t> folded; // the ids of the segments segment replaces
+        Set<uint32_t> dirty; // the dirty files at the time
+        String error;
+    };
+
+    ProjectIndex(unsigned int flags = None)
+        : mFlags(flags), mNextId(1), mValid(false), mBuilding(false), mGeneration(0)
+    {}
+
+    /*
+     * Loads the segments listed in <path>.segments. A file whose per-file map
+     * (as returned by perFilePath) is newer than the segment it is in is
+     * considered dirty.
+     */
+    template <typename Files>
+    bool load(const Path &path, const Files &files,
+              const std::function<Path(uint32_t)> &perFilePath, String *error = 0)
+    {
+        clear();
+        const String data = segmentsPath(path).readAll();
+        if (data.isEmpty())
+            return false;
+        Deserializer deserializer(data);
+        int32_t version;
+        List<uint32_t> ids;
+        deserializer >> version >> mNextId >> ids;
+        if (version != RTags::DatabaseVersion) {
+            if (error)
+                *error = "Wrong database version";
+            return false;
+        }
+        for (uint32_t id : ids) {
+            Segment segment;
+            segment.id = id;
+            if (!loadSegment(path, segment, error)) {
+                clear();
+                return false;
+            }
+            for (uint32_t fileId : segment.files)
+                mOwners[fileId] = std::make_pair(segment.id, segment.time);
+            mSegments.append(std::move(segment));
+        }
+        for (const auto &file : files) {
+            const auto owner = mOwners.find(file.first);
+            if (owner == mOwners.end() || perFilePath(file.first).lastModifiedMs() >= owner->second.second)
+                mDirty.insert(file.first);
+        }
+        mValid = true;
+        return true;
+    }
+
+    void clear()
+    {
+        mSegments.clear();
+        mOwners.clear();
+        mDirty.clear();
+        mRedirtied.clear();
+        mValid = false;
+        mBuilding = false;
+        ++mGeneration;
+    }
+
+    bool isValid() const { return mValid; }
+    const List<Segment> &segments() const { return mSegments; }
+    const Set<uint32_t> &dirtyFiles() const { return mDirty; }
+    bool isDirty(uint32_t fileId) const { return !mValid || mDirty.contains(fileId); }
+    // Whether the entries of fileId in segment are current
+    bool isLive(const Segment &segment, uint32_t fileId) const
+    {
+        if (mDirty.contains(fileId))
+            return false;
+        const auto owner = mOwners.find(fileId);
+        return owner != mOwners.end() && owner->second.first == segment.id;
+    }
+    void dirty(uint32_t fileId)
+    {
+        if (mValid)
+            mDirty.insert(fileId);
+        if (mBuilding)
+            mRedirtied.insert(fileId);
+    }
+    bool needsUpdate() const { return !mValid || !mDirty.isEmpty(); }
+    /*
+     * Returns a function that writes a segment made up of the per-file maps
+     * of all dirty files that are still in files and the live entries of the
+     * segments it replaces. The function is meant to run on another thread,
+     * collect adds the entries of one file and finished is called with the
+     * result which must be passed to install() on this thread. Returns
+     * nothing if there's nothing to do or a segment is being written.
+     */
+    template <typename Files>
+    std::function<void()> update(const Path &path, const Files &files,
+                                 const std::function<Path(uint32_t)> &perFilePath, Collect &&collect,
+                                 std::function<void(const std::shared_ptr<Build> &)> &&finished)
+    {
+        if (mBuilding || !needsUpdate())
+            return std::function<void()>();
+
+        auto build = std::make_shared<Build>();
+        build->generation = mGeneration;
+        build->segment.id = mNextId++;
+        build->segment.time = Rct::currentTimeMs();
+        List<std::pair<uint32_t, Path> > collected;
+        if (mValid) {
+            build->dirty = mDirty;
+            for (uint32_t fileId : mDirty) {
+                if (files.contains(fileId))
+                    collected.append(std::make_pair(fileId, perFilePath(fileId)));
+            }
+        } else {
+            for (const auto &file : files)
+                collected.append(std::make_pair(file.first, perFilePath(file.first)));
+        }
+
+        // Fold the segments that are small compared to what comes after them,
+        // or all of them when most of what they hold is stale
+        size_t stale = 0;
+        for (const Segment &segment : mSegments)
+            stale += segment.files.size();
+        stale -= std::min(stale, mOwners.size());
+        size_t first = mSegments.size();
+        size_t size = collected.size();
+        if (stale > mOwners.size()) {
+            first = 0;
+        } else {
+            while (first > 0 && (first >= MaxSegments || mSegments.at(first - 1).files.size() <= size * 2)) {
+                --first;
+                size += mSegments.at(first).files.size();
+            }
+        }
+        // segment and what to keep from it
+        List<std::pair<std::shared_ptr<IndexMap>, Set<uint32_t> > > folded;
+        for (size_t i=first; i<mSegments.size(); ++i) {
+            const Segment &segment = mSegments.at(i);
+            Set<uint32_t> keep;
+            for (uint32_t fileId : segment.files) {
+                if (isLive(segment, fileId) && files.contains(fileId))
+                    keep.insert(fileId);
+            }
+            build->folded.insert(segment.id);
+            build->segment.time = std::min(build->segment.time, segment.time);
+            build->segment.files.unite(keep);
+            folded.append(std::make_pair(segment.fileMap, std::move(keep)));
+        }
+        for (const auto &file : collected)
+            build->segment.files.insert(file.first);
+        List<uint32_t> ids;
+        for (size_t i=0; i<first; ++i)
+            ids.append(mSegments.at(i).id);
+        ids.append(build->segment.id);
+
+        mBuilding = true;
+        mRedirtied.clear();
+        const unsigned int flags = mFlags;
+        const uint32_t nextId = mNextId;
+        return [path, flags, nextId, build, collected, folded, ids, collect, finished]() {
+            Map<String, Set<T> > merged;
+            for (const auto &fold : folded) {
+                const IndexMap &fileMap = *fold.first;
+                const uint32_t count = fileMap.count();
+                for (uint32_t i=0; i<count; ++i) {
+                    Set<T> values = fileMap.valueAt(i);
+                    auto it = values.begin();
+                    while (it != values.end()) {
+                        if (!fold.second.contains(projectIndexFileId(*it))) {
+                            values.erase(it++);
+                        } else {
+                            ++it;
+                        }
+                    }
+                    if (!values.isEmpty())
+                        merged[fileMap.keyAt(i)].unite(values);
+                }
+            }
+            for (const auto &file : collected)
+                collect(file.first, file.second, merged);
+
+            Segment &segment = build->segment;
+            String data;
+            {
+                Serializer serializer(data);
+                serializer << segment.time << segment.files;
+            }
+            if (!IndexMap::write(segmentPath(path, segment.id), merged)
+                || !writeFileMapData(filesPath(path, segment.id), data)) {
+                build->error = "Failed to write " + segmentPath(path, segment.id) + ": " + Rct::strerror();
+            } else if (flags & Trigrams) {
+                std::shared_ptr<IndexMap> fileMap = std::make_shared<IndexMap>();
+                if (fileMap->load(segmentPath(path, segment.id), &build->error)
+                    && !TrigramIndex::write(trigramsPath(path, segment.id), *fileMap)) {
+                    build->error = "Failed to write " + trigramsPath(path, segment.id) + ": " + Rct::strerror();
+                }
+            }
+            if (build->error.isEmpty() && openSegment(path, flags, segment, &build->error)) {
+                data.clear();
+                {
+                    Serializer serializer(data);
+                    serializer << static_cast<int32_t>(RTags::DatabaseVersion) << nextId << ids;
+                }
+                if (!writeFileMapData(segmentsPath(path), data)) {
+                    build->error = "Failed to write " + segmentsPath(path) + ": " + Rct::strerror();
+                } else {
+                    // Queries keep the mappings of the old segments
+                    for (uint32_t id : build->folded) {
+                        unlink(segmentPath(path, id).constData());
+                        unlink(filesPath(path, id).constData());
+                        unlink(trigramsPath(path, id).constData());
+                    }
+                }
+            }
+            finished(build);
+        };
+    }
+
+    /*
+     * Puts the segment update() wrote in place. Files that were dirtied while
+     * it was being written stay dirty.
+     */
+    bool install(const std::shared_ptr<Build> &build)
+    {
+        if (build->generation != mGeneration)
+            return false;
+        mBuilding = false;
+        if (!build->error.isEmpty()) {
+            mRedirtied.clear();
+            return false;
+        }
+        auto it = mSegments.begin();
+        while (it != mSegments.end()) {
+            if (build->folded.contains(it->id)) {
+                for (uint32_t fileId : it->files) {
+                    const auto owner = mOwners.find(fileId);
+                    if (owner != mOwners.end() && owner->second.first == it->id)
+                        mOwners.erase(owner);
+                }
+                it = mSegments.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        for (uint32_t fileId : build->dirty) {
+            if (!mRedirtied.contains(fileId)) {
+                mDirty.remove(fileId);
+                mOwners.remove(fileId);
+            }
+        }
+        for (uint32_t fileId : build->segment.files)
+            mOwners[fileId] = std::make_pair(build->segment.id, build->segment.time);
+        if (!mValid) {
+            // everything was dirty while the first segment was written
+            mDirty = std::move(mRedirtied);
+            mValid = true;
+        }
+        mRedirtied.clear();
+        mSegments.append(std::move(build->segment));
+        return true;
+    }
+private:
+    static Path segmentsPath(const Path &path) { return path + ".segments"; }
+    static Path segmentPath(const Path &path, uint32_t id) { return String::format<1024>("%s.%u", path.constData(), id); }
+    static Path filesPath(const Path &path, uint32_t id) { return segmentPath(path, id) + ".files"; }
+    static Path trigramsPath(const Path &path, uint32_t id) { return segmentPath(path, id) + ".trigrams"; }
+
+    bool loadSegment(const Path &path, Segment &segment, String *error) const
+    {
+        const String data = filesPath(path, segment.id).readAll();
+        if (data.isEmpty()) {
+            if (error)
+                *error = "Failed to read " + filesPath(path, segment.id);
+            return false;
+        }
+        Deserializer deserializer(data);
+        deserializer >> segment.time >> segment.files;
+        return openSegment(path, mFlags, segment, error);
+    }
+
+    static bool openSegment(const Path &path, unsigned int flags, Segment &segment, String *error)
+    {
+        std::shared_ptr<IndexMap> fileMap = std::make_shared<IndexMap>();
+        if (!fileMap->load(segmentPath(path, segment.id), error))
+            return false;
+        segment.fileMap = fileMap;
+        if (flags & Trigrams) {
+            // searches look at every key of a segment without trigrams
+            std::shared_ptr<TrigramIndex> trigrams = std::make_shared<TrigramIndex>();
+            if (trigrams->load(trigramsPath(path, segment.id)))
+                segment.trigrams = trigrams;
+        }
+        return true;
+    }
+
+    const unsigned int mFlags;
+    uint32_t mNextId;
+    bool mValid, mBuilding;
+    uint32_t mGeneration;
+    List<Segment> mSegments;
+    Hash<uint32_t, std::pair<uint32_t, uint64_t> > mOwners; // fileId -> segment id and time
+    Set<uint32_t> mDirty, mRedirtied;
+};
+
+#endif
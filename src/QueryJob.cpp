@@ -97,12 +97,9 @@ bool QueryJob::write(const String &out, Flags<WriteFlag> flags)
 bool QueryJob::writeRaw(const String &out, Flags<WriteFlag> flags)
 {
     assert(mConnection);
-    if (!(flags & IgnoreMax) && mQueryMessage) {
-        const int max = mQueryMessage->max();
-        if (max != -1 && mLinesWritten == max) {
+    if (!(flags & IgnoreMax)) {
+        if (isFull())
             return false;
-        }
-        assert(mLinesWritten < max || max == -1);
         ++mLinesWritten;
     }
 
@@ -110,9 +107,16 @@ bool QueryJob::writeRaw(const String &out, Flags<WriteFlag> flags)
         warning("=> %s", out.constData());
 
     if (mConnection) {
-        if (!mConnection->write(out)) {
-            abort();
+        // rc doesn't print empty responses and prints a newline after each
+        // one so lines can be joined.
+        if (isAborted())
             return false;
+        if (!out.isEmpty()) {
+            if (!mBuffer.isEmpty())
+                mBuffer += '\n';
+            mBuffer += out;
+            if (mBuffer.size() >= ChunkSize)
+                return flush();
         }
         return true;
     }
@@ -138,34 +142,40 @@ bool QueryJob::locationToString(Location location,
     const bool displayName = queryFlags() & QueryMessage::DisplayName;
     if (containingFunction || containingFunctionLocation || cursorKind || displayName || !mKindFilters.isEmpty()) {
         int idx;
-        Symbol symbol = project()->findSymbol(location, &idx);
-        if (symbol.isNull()) {
+        SymbolCore core = project()->findSymbolCore(location, &idx);
+        if (core.isNull()) {
             error() << "Somehow can't find" << location << "in symbols";
         } else {
-            if (!mKindFilters.filter(symbol))
+            if (!mKindFilters.filter(core))
                 return false;
-            if (displayName)
-                cb(Piece_SymbolName, symbol.displayName());
+            if (displayName) {
+                auto symbols = project()->openSymbols(location.fileId());
+                if (symbols)
+                    cb(Piece_SymbolName, symbols->valueAt(idx).displayName());
+            }
             if (cursorKind)
-                cb(Piece_Kind, symbol.kindSpelling());
+                cb(Piece_Kind, core.kindSpelling());
             if (containingFunction || containingFunctionLocation) {
                 const uint32_t fileId = location.fileId();
                 const unsigned int line = location.line();
                 const unsigned int column = location.column();
-                auto fileMap = project()->openSymbols(location.fileId());
+                auto fileMap = project()->openSymbolCores(location.fileId());
                 if (fileMap) {
                     while (idx > 0) {
-                        symbol = fileMap->valueAt(--idx);
-                        if (symbol.location.fileId() != fileId)
+                        core = fileMap->valueAt(--idx);
+                        if (core.location.fileId() != fileId)
                             break;
-                        if (symbol.isDefinition()
-                            && RTags::isContainer(symbol.kind)
-                            && comparePosition(line, column, symbol.startLine, symbol.startColumn) >= 0
-                            && comparePosition(line, column, symbol.endLine, symbol.endColumn) <= 0) {
-                            if (containingFunction)
-                                cb(Piece_ContainingFunctionName, symbol.symbolName);
+                        if (core.isDefinition()
+                            && RTags::isContainer(core.kind)
+                            && comparePosition(line, column, core.startLine, core.startColumn) >= 0
+                            && comparePosition(line, column, core.endLine, core.endColumn) <= 0) {
+                            if (containingFunction) {
+                                auto symbols = project()->openSymbols(fileId);
+                                if (symbols)
+                                    cb(Piece_ContainingFunctionName, symbols->valueAt(idx).symbolName);
+                            }
                             if (containingFunctionLocation)
-                                cb(Piece_ContainingFunctionLocation, symbol.location.toString(locationToStringFlags() & ~Location::ShowContext));
+                                cb(Piece_ContainingFunctionLocation, core.location.toString(locationToStringFlags() & ~Location::ShowContext));
                             break;
                         }
                     }
@@ -280,11 +290,72 @@ bool QueryJob::filter(const String &value) const
     return false;
 }
 
+bool QueryJob::flush()
+{
+    if (mBuffer.isEmpty() || !mConnection)
+        return true;
+    if (EventLoop::isMainThread()) {
+        const bool ok = mConnection->write(mBuffer);
+        mBuffer.clear();
+        if (!ok)
+            abort();
+        return ok;
+    }
+    // Connection is only safe to touch from the main thread
+    if (!mPendingOutput)
+        mPendingOutput = std::make_shared<PendingOutput>();
+    const std::shared_ptr<PendingOutput> pending = mPendingOutput;
+    String chunk = std::move(mBuffer);
+    mBuffer.clear();
+    {
+        std::unique_lock<std::mutex> lock(pending->mutex);
+        while (!pending->closed && pending->queued + pending->unsent >= MaxPendingOutput) {
+            pending->condition.wait_for(lock, std::chrono::milliseconds(100));
+            if (isAborted())
+                return false;
+        }
+        if (pending->closed)
+            return false;
+        pending->queued += chunk.size();
+    }
+
+    std::weak_ptr<Connection> conn = mConnection;
+    const size_t size = chunk.size();
+    EventLoop::mainEventLoop()->callLater(std::bind([conn, pending, size](const String &data) {
+                std::shared_ptr<Connection> c = conn.lock();
+                const bool ok = c && c->write(data);
+                if (ok && !pending->connected) {
+                    pending->connected = true;
+                    c->sendComplete().connect([pending](const std::shared_ptr<Connection> &) {
+                            std::lock_guard<std::mutex> lock(pending->mutex);
+                            pending->unsent = 0;
+                            pending->condition.notify_all();
+                        });
+                }
+                std::lock_guard<std::mutex> lock(pending->mutex);
+                pending->queued -= size;
+                if (ok) {
+                    pending->unsent = c->pendingWrite();
+                } else {
+                    pending->closed = true;
+                }
+                pending->condition.notify_all();
+            }, std::move(chunk)));
+    return true;
+}
+
+bool QueryJob::isFull() const
+{
+    const int max = mQueryMessage ? mQueryMessage->max() : -1;
+    return max != -1 && mLinesWritten >= max;
+}
+
 int QueryJob::run(const std::shared_ptr<Connection> &connection)
 {
     assert(connection);
     mConnection = connection;
     const int ret = execute();
+    flush();
     mConnection = 0;
     return ret;
 }
@@ -16,6 +16,8 @@
 #ifndef QueryJob_h
 #define QueryJob_h
 
+#include <condition_variable>
+#include <functional>
 #include <regex>
 #include <mutex>
 
@@ -30,6 +32,7 @@ class Location;
 class QueryMessage;
 class Connection;
 struct Symbol;
+struct SymbolCore;
 class QueryJob
 {
 public:
@@ -100,6 +103,11 @@ public:
     const std::shared_ptr<Connection> &connection() const { return mConnection; }
     bool filterLocation(Location loc) const;
     bool filterKind(const Symbol &symbol) const { return mKindFilters.filter(symbol); }
+    // true once --max lines have been written, jobs can stop producing output
+    bool isFull() const;
+    // Writes the buffered output, needed before writing to connection() directly
+    bool flush();
+    bool filterKind(const SymbolCore &core) const { return mKindFilters.filter(core); }
 private:
     class Filter
     {
@@ -138,6 +146,29 @@ private:
     bool mAborted;
     int mLinesWritten;
     bool writeRaw(const String &out, Flags<WriteFlag> flags);
+
+    /*
+     * Output is collected in chunks of ChunkSize bytes. On the main thread
+     * they're written to the Connection right away, jobs running on the
+     * query thread pool hand them to the main thread and block while more
+     * than MaxPendingOutput bytes are waiting for the client to read them.
+     */
+    enum {
+        ChunkSize = 32 * 1024,
+        MaxPendingOutput = 1024 * 1024
+    };
+    struct PendingOutput {
+        PendingOutput()
+            : queued(0), unsent(0), closed(false), connected(false)
+        {}
+        std::mutex mutex;
+        std::condition_variable condition;
+        size_t queued; // posted to the main thread
+        size_t unsent; // written to the Connection, not to the socket yet
+        bool closed;
+        bool connected; // main thread only
+    };
+    std::shared_ptr<PendingOutput> mPendingOutput;
     std::shared_ptr<QueryMessage> mQueryMessage;
     Flags<JobFlag> mJobFlags;
     Signal<std::function<void(const String &)> > mOutput;
@@ -134,7 +134,7 @@ QueryMessage::Flag QueryMessage::flagFromString(const String &string)
     return NoFlag;
 }
 
-bool QueryMessage::KindFilters::filter(const Symbol &symbol) const
+bool QueryMessage::KindFilters::filter(const SymbolCore &symbol) const
 {
     if (isEmpty())
         return true;
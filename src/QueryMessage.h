@@ -49,6 +49,7 @@ public:
         FindSymbols,
         FixIts,
         FollowLocation,
+        FuzzySymbols,
         HasFileManager,
         IncludeFile,
         IsIndexed,
@@ -147,7 +148,8 @@ public:
         };
         Flags<Flag> flags;
         Map<String, Flags<DefinitionType> > in, out;
-        bool filter(const Symbol &symbol) const;
+        bool filter(const Symbol &symbol) const { return filter(SymbolCore(symbol)); }
+        bool filter(const SymbolCore &symbol) const;
         void insert(const String &arg);
         bool isEmpty() const { return in.isEmpty() && out.isEmpty(); }
     };
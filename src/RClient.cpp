@@ -71,6 +71,7 @@ std::initializer_list<CommandLineParser::Option<RClient::OptionType> > opts = {
     { RClient::ReferenceLocation, "references", 'r', CommandLineParser::Required, "Find references matching this location." },
     { RClient::ListSymbols, "list-symbols", 'S', CommandLineParser::Optional, "List symbol names matching arg." },
     { RClient::FindSymbols, "find-symbols", 'F', CommandLineParser::Optional, "Find symbols matching arg." },
+    { RClient::FuzzySymbols, "fuzzy-symbols", 0, CommandLineParser::Required, "List the symbol names that best fuzzy match arg, best first (at most --max, default 100)." },
     { RClient::SymbolInfo, "symbol-info", 'U', CommandLineParser::Required, "Get cursor info for this location." },
     { RClient::Status, "status", 's', CommandLineParser::Optional, "Dump status of rdm. Arg can be symbols or symbolNames." },
     { RClient::Diagnose, "diagnose", 0, CommandLineParser::Required, "Resend diagnostics for file." },
@@ -868,6 +869,7 @@ CommandLineParser::ParseStatus RClient::parse(size_t argc, char **argv)
         case FindFile:
         case ListSymbols:
         case FindSymbols:
+        case FuzzySymbols:
         case Sources:
         case IncludeFile:
         case JobCount:
@@ -905,6 +907,10 @@ CommandLineParser::ParseStatus RClient::parse(size_t argc, char **argv)
             case FindSymbols:
                 queryType = QueryMessage::FindSymbols;
                 break;
+            case FuzzySymbols:
+                queryType = QueryMessage::FuzzySymbols;
+                resolve = false;
+                break;
             case JobCount:
                 queryType = QueryMessage::JobCount;
                 break;
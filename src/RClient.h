@@ -83,6 +83,7 @@ public:
         FindVirtuals,
         FixIts,
         FollowLocation,
+        FuzzySymbols,
         GenerateTest,
         GuessFlags,
         HasFileManager,
@@ -18,6 +18,8 @@
 #include <dirent.h>
 #include <fcntl.h>
 #include <fnmatch.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #ifdef OS_FreeBSD
 #include <sys/sysctl.h>
@@ -27,6 +29,8 @@
 #endif
 
 #include "IndexDataMessage.h"
+#include "JobRequestMessage.h"
+#include "JobResponseMessage.h"
 #include "LogOutputMessage.h"
 #include "QueryMessage.h"
 #include "rct/Rct.h"
@@ -95,6 +99,83 @@ Path encodeSourceFilePath(const Path &dataDir, const Path &project, uint32_t fil
     return str;
 }
 
+static inline uint64_t rotl(uint64_t value, int bits)
+{
+    return (value << bits) | (value >> (64 - bits));
+}
+
+uint64_t contentHash(const char *data, size_t size)
+{
+    // xxhash64 style. The four lanes are independent so the main loop
+    // keeps several multiplies in flight and vectorizes where the target
+    // has 64 bit vector multiplies.
+    static const uint64_t Prime1 = 0x9E3779B185EBCA87ULL;
+    static const uint64_t Prime2 = 0xC2B2AE3D27D4EB4FULL;
+    static const uint64_t Prime3 = 0x165667B19E3779F9ULL;
+    static const uint64_t Prime4 = 0x85EBCA77C2B2AE63ULL;
+    static const uint64_t Prime5 = 0x27D4EB2F165667C5ULL;
+    auto round = [](uint64_t acc, uint64_t input) { return rotl(acc + (input * Prime2), 31) * Prime1; };
+
+    const char *end = data + size;
+    uint64_t hash;
+    if (size >= 32) {
+        uint64_t lanes[4] = { Prime1 + Prime2, Prime2, 0, 0 - Prime1 };
+        for (const char *limit = end - 32; data <= limit; data += 32) {
+            uint64_t input[4];
+            memcpy(input, data, sizeof(input));
+            for (int i=0; i<4; ++i)
+                lanes[i] = round(lanes[i], input[i]);
+        }
+        hash = rotl(lanes[0], 1) + rotl(lanes[1], 7) + rotl(lanes[2], 12) + rotl(lanes[3], 18);
+        for (int i=0; i<4; ++i)
+            hash = ((hash ^ round(0, lanes[i])) * Prime1) + Prime4;
+    } else {
+        hash = Prime5;
+    }
+    hash += size;
+    while (data + 8 <= end) {
+        uint64_t input;
+        memcpy(&input, data, sizeof(input));
+        hash = (rotl(hash ^ round(0, input), 27) * Prime1) + Prime4;
+        data += 8;
+    }
+    while (data < end) {
+        hash = rotl(hash ^ (static_cast<unsigned char>(*data) * Prime5), 11) * Prime1;
+        ++data;
+    }
+    hash ^= hash >> 33;
+    hash *= Prime2;
+    hash ^= hash >> 29;
+    hash *= Prime3;
+    hash ^= hash >> 32;
+    return hash ? hash : 1;
+}
+
+uint64_t contentHash(const Path &path)
+{
+    int fd;
+    eintrwrap(fd, open(path.constData(), O_RDONLY));
+    if (fd == -1)
+        return 0;
+    uint64_t hash = 0;
+    struct stat st;
+    if (!fstat(fd, &st)) {
+        if (!st.st_size) {
+            hash = contentHash("", 0);
+        } else {
+            void *pointer = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (pointer != MAP_FAILED) {
+                madvise(pointer, st.st_size, MADV_SEQUENTIAL);
+                hash = contentHash(static_cast<const char*>(pointer), st.st_size);
+                munmap(pointer, st.st_size);
+            }
+        }
+    }
+    int ret;
+    eintrwrap(ret, close(fd));
+    return hash;
+}
+
 Path findAncestor(Path path, const String &fn, Flags<FindAncestorFlag> flags, SourceCache *cache)
 {
     Path *cacheResult = 0;
@@ -405,6 +486,8 @@ void initMessages()
 {
     Message::registerMessage<IndexMessage>();
     Message::registerMessage<IndexDataMessage>();
+    Message::registerMessage<JobRequestMessage>();
+    Message::registerMessage<JobResponseMessage>();
     Message::registerMessage<LogOutputMessage>();
     Message::registerMessage<QueryMessage>();
     Message::registerMessage<VisitFileMessage>();
@@ -542,6 +542,9 @@ struct SortedSymbol
 };
 
 Path encodeSourceFilePath(const Path &dataDir, const Path &project, uint32_t fileId = 0);
+// Fast non-cryptographic hash of a file's contents, 0 if it can't be read
+uint64_t contentHash(const char *data, size_t size);
+uint64_t contentHash(const Path &path);
 
 template <typename Container, typename Value>
 inline bool addTo(Container &container, const Value &value)
@@ -59,12 +59,28 @@ int ReferencesJob::execute()
             }
         };
         proj->findSymbols(symbolName, inserter, queryFlags());
+        if (isAborted())
+            return 1;
     }
     const bool declarationOnly = queryFlags() & QueryMessage::DeclarationOnly;
     const bool definitionOnly = queryFlags() & QueryMessage::DefinitionOnly;
+    // With --max the lookups stop once there are that many locations that
+    // will be written, json is written in one go
+    const int max = queryFlags() & QueryMessage::JSON ? -1 : queryMessage()->max();
+    auto enough = [&references, max]() {
+        return max >= 0 && references.size() >= static_cast<size_t>(max);
+    };
+    // Returns false once the lookup can stop
+    auto add = [&](const Symbol &symbol, bool def, CXCursorKind kind) {
+        if (symbol.isDefinition() ? !declarationOnly : !definitionOnly) {
+            if (references.contains(symbol.location) || filterLocation(symbol.location))
+                references[symbol.location] = std::make_pair(def, kind);
+        }
+        return !enough() && !isFull() && !isAborted();
+    };
     Location startLocation;
     bool first = true;
-    for (auto it = locations.begin(); it != locations.end(); ++it) {
+    for (auto it = locations.begin(); it != locations.end() && !enough() && !isAborted(); ++it) {
         const Location pos = *it;
         Symbol sym = proj->findSymbol(pos);
         if (sym.isNull())
@@ -100,49 +116,25 @@ int ReferencesJob::execute()
                 continue;
         }
         if (queryFlags() & QueryMessage::AllReferences) {
-            const Set<Symbol> all = proj->findAllReferences(sym);
-            for (const auto &symbol : all) {
-                if (rename) {
-                    if (symbol.kind == CXCursor_MacroExpansion && sym.kind != CXCursor_MacroDefinition)
-                        continue;
-                    if (symbol.flags & Symbol::AutoRef)
-                        continue;
-                } else if (sym.isClass() && symbol.isConstructorOrDestructor()) {
-                    continue;
-                }
-                const bool def = symbol.isDefinition();
-                if (def) {
-                    if (declarationOnly)
-                        continue;
-                } else if (definitionOnly) {
-                    continue;
-                }
-                references[symbol.location] = std::make_pair(def, symbol.kind);
-            }
+            proj->findAllReferences(sym, [&](const Symbol &symbol) {
+                    if (rename) {
+                        if (symbol.kind == CXCursor_MacroExpansion && sym.kind != CXCursor_MacroDefinition)
+                            return true;
+                        if (symbol.flags & Symbol::AutoRef)
+                            return true;
+                    } else if (sym.isClass() && symbol.isConstructorOrDestructor()) {
+                        return true;
+                    }
+                    return add(symbol, symbol.isDefinition(), symbol.kind);
+                });
         } else if (queryFlags() & QueryMessage::FindVirtuals) {
-            const Set<Symbol> virtuals = proj->findVirtuals(sym);
-            for (const auto &symbol : virtuals) {
-                const bool def = symbol.isDefinition();
-                if (def) {
-                    if (declarationOnly)
-                        continue;
-                } else if (definitionOnly) {
-                    continue;
-                }
-                references[symbol.location] = std::make_pair(def, symbol.kind);
-            }
+            proj->findVirtuals(sym, [&](const Symbol &symbol) {
+                    return add(symbol, symbol.isDefinition(), symbol.kind);
+                });
         } else {
-            const Set<Symbol> symbols = proj->findCallers(sym);
-            for (const auto &symbol : symbols) {
-                const bool def = symbol.isDefinition();
-                if (def) {
-                    if (declarationOnly)
-                        continue;
-                } else if (definitionOnly) {
-                    continue;
-                }
-                references[symbol.location] = std::make_pair(false, CXCursor_FirstInvalid);
-            }
+            proj->findCallers(sym, [&](const Symbol &symbol) {
+                    return add(symbol, false, CXCursor_FirstInvalid);
+                });
         }
     }
     Flags<QueryJob::WriteFlag> writeFlags;
@@ -229,39 +221,47 @@ int ReferencesJob::execute()
                 do {
                     --it;
                     writeLoc(it->first);
-                } while (it != references.begin());
+                } while (it != references.begin() && !isFull() && !isAborted());
             } else {
-                for (const auto &it : references) {
-                    writeLoc(it.first);
+                for (auto it = references.begin(); it != references.end() && !isFull() && !isAborted(); ++it) {
+                    writeLoc(it->first);
                 }
             }
         }
     } else {
         List<RTags::SortedSymbol> sorted;
         sorted.reserve(references.size());
+        RTags::SortedSymbol start;
         for (Map<Location, std::pair<bool, CXCursorKind> >::const_iterator it = references.begin();
              it != references.end(); ++it) {
+            if (!filterLocation(it->first))
+                continue;
             sorted.append(RTags::SortedSymbol(it->first, it->second.first, it->second.second));
+            if (it->first == startLocation)
+                start = sorted.last();
         }
-        if (queryFlags() & QueryMessage::ReverseSort) {
-            std::sort(sorted.begin(), sorted.end(), std::greater<RTags::SortedSymbol>());
-        } else {
-            std::sort(sorted.begin(), sorted.end());
-        }
-        int startIndex = 0;
-        const int count = sorted.size();
-        if (!startLocation.isNull()) {
-            for (int i=0; i<count; ++i) {
-                if (sorted.at(i).location == startLocation) {
-                    startIndex = i + 1;
-                    break;
-                }
+
+        // The output starts after startLocation and wraps around. Each
+        // location is at least one line so with --max only that many of them
+        // have to be put in order, json is written in one go.
+        const bool reverse = queryFlags() & QueryMessage::ReverseSort;
+        auto before = [reverse](const RTags::SortedSymbol &l, const RTags::SortedSymbol &r) {
+            return reverse ? l > r : l < r;
+        };
+        auto compare = [&start, &before](const RTags::SortedSymbol &l, const RTags::SortedSymbol &r) {
+            if (!start.location.isNull()) {
+                const bool lwrapped = !before(start, l);
+                const bool rwrapped = !before(start, r);
+                if (lwrapped != rwrapped)
+                    return rwrapped;
             }
-        }
+            return before(l, r);
+        };
+        const size_t count = max >= 0 ? std::min<size_t>(max, sorted.size()) : sorted.size();
+        std::partial_sort(sorted.begin(), sorted.begin() + count, sorted.end(), compare);
 
-        for (int i=0; i<count; ++i) {
-            Location loc = sorted.at((startIndex + i) % count).location;
-            writeLoc(loc);
+        for (size_t i=0; i<count && !isFull() && !isAborted(); ++i) {
+            writeLoc(sorted.at(i).location);
         }
     }
     if (queryFlags() & QueryMessage::Elisp) {
@@ -18,9 +18,11 @@
 #include "TokensJob.h"
 
 #include <arpa/inet.h>
+#include <fcntl.h>
 #include <clang-c/Index.h>
 #include <clang-c/CXCompilationDatabase.h>
 #include <stdio.h>
+#include <unistd.h>
 #include <limits>
 #include <regex>
 
@@ -29,14 +31,17 @@
 #include "DependenciesJob.h"
 #include "ClangThread.h"
 #include "FileManager.h"
+#include "FileMapCache.h"
 #include "Filter.h"
 #include "FindFileJob.h"
 #include "FindSymbolsJob.h"
 #include "FollowLocationJob.h"
+#include "FuzzySymbolsJob.h"
 #include "IncludeFileJob.h"
 #include "IndexDataMessage.h"
 #include "IndexerJob.h"
 #include "IndexMessage.h"
+#include "JobRequestMessage.h"
 #include "JobScheduler.h"
 #include "ListSymbolsJob.h"
 #include "LogOutputMessage.h"
@@ -60,6 +65,8 @@
 #include "ReferencesJob.h"
 #include "RTags.h"
 #include "RTagsLogOutput.h"
+#include "SharedCache.h"
+#include "SystemUnitStore.h"
 #include "Source.h"
 #include "StatusJob.h"
 #include "SymbolInfoJob.h"
@@ -77,6 +84,7 @@
 #define CLANG_VERSION_STRING TO_STR(CLANG_VERSION)
 #endif
 
+enum { FileIdsFlushDelay = 1000, FileIdsCompactionThreshold = 4096 };
 
 // Absolute paths to search (under) for (clang) system include files
 // Iterate until we find a dir at <abspath>/clang/<version>/include.
@@ -90,12 +98,89 @@ static const List<Path> sSystemIncludePaths = {
 };
 #endif
 
+class QueryThreadPoolJob : public ThreadPool::Job
+{
+public:
+    QueryThreadPoolJob(std::function<std::shared_ptr<QueryJob>()> &&create,
+                       const std::shared_ptr<Project> &project,
+                       const std::shared_ptr<Connection> &conn)
+        : mCreate(std::move(create)), mProject(project), mConnection(conn), mAborted(false)
+    {
+    }
+
+    void abort()
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mAborted = true;
+        if (mJob)
+            mJob->abort();
+    }
+protected:
+    virtual void run() override
+    {
+        int ret = 1;
+        {
+            std::shared_ptr<QueryJob> job = mCreate();
+            mCreate = nullptr;
+            {
+                std::lock_guard<std::mutex> lock(mMutex);
+                if (mAborted)
+                    job->abort();
+                mJob = job;
+            }
+            if (!job->isAborted())
+                ret = job->run(mConnection);
+            std::lock_guard<std::mutex> lock(mMutex);
+            mJob.reset();
+        }
+
+        // The project and the connection must be released on the main thread
+        std::shared_ptr<Project> project;
+        std::shared_ptr<Connection> conn;
+        std::swap(project, mProject);
+        std::swap(conn, mConnection);
+        std::function<void()> finish = [project, conn, ret]() {
+            project->endQuery();
+            conn->finish(ret);
+        };
+        project.reset();
+        conn.reset();
+        EventLoop::mainEventLoop()->callLater(std::move(finish));
+    }
+private:
+    std::function<std::shared_ptr<QueryJob>()> mCreate;
+    std::shared_ptr<Project> mProject;
+    std::shared_ptr<Connection> mConnection;
+    std::mutex mMutex;
+    std::shared_ptr<QueryJob> mJob;
+    bool mAborted;
+};
+
+class BackgroundThreadPoolJob : public ThreadPool::Job
+{
+public:
+    BackgroundThreadPoolJob(std::function<void()> &&func)
+        : mFunc(std::move(func))
+    {
+    }
+protected:
+    virtual void run() override
+    {
+        mFunc();
+        mFunc = nullptr;
+    }
+private:
+    std::function<void()> mFunc;
+};
+
 Server *Server::sInstance = 0;
 Server::Server()
-    : mSuspended(false), mEnvironment(Rct::environment()), mPollTimer(-1), mExitCode(0), mLastFileId(0), mCompletionThread(0)
+    : mSuspended(false), mEnvironment(Rct::environment()), mPollTimer(-1), mExitCode(0), mLastFileId(0),
+      mFileIdsJournal(0), mFileIdsJournalRecords(0), mFileIdsFlushPending(false), mCompletionThread(0)
 {
     assert(!sInstance);
     sInstance = this;
+    mFileIdsTimer.timeout().connect([this](Timer *) { flushFileIds(); });
 }
 
 Server::~Server()
@@ -110,8 +195,19 @@ Server::~Server()
         mCompletionThread = 0;
     }
 
+    mQueryThreadPool.reset();
+    mBackgroundThreadPool.reset();
     stopServers();
+    mFileIdsTimer.stop();
+    flushFileIds();
+    if (mFileIdsJournal) {
+        fclose(mFileIdsJournal);
+        mFileIdsJournal = 0;
+    }
     mProjects.clear(); // need to be destroyed before sInstance is set to 0
+    mFileMapCache.reset();
+    mSharedCache.reset();
+    mSystemUnitStore.reset();
     assert(sInstance == this);
     sInstance = 0;
     Message::cleanup();
@@ -195,6 +291,15 @@ bool Server::init(const Options &options)
     }
 
     mJobScheduler.reset(new JobScheduler);
+    if (mOptions.queryThreadCount > 0)
+        mQueryThreadPool.reset(new ThreadPool(mOptions.queryThreadCount, Thread::Normal, 8 * 1024 * 1024)); // 8MiB stack size
+    mBackgroundThreadPool.reset(new ThreadPool(std::max(2, ThreadPool::idealThreadCount() / 2)));
+    if (mOptions.persistentFileMapCacheSize > 0)
+        mFileMapCache = std::make_shared<FileMapCache>(static_cast<size_t>(mOptions.persistentFileMapCacheSize) * 1024 * 1024);
+    if (!mOptions.sharedCacheDir.isEmpty())
+        mSharedCache = std::make_shared<SharedCache>(mOptions.sharedCacheDir, static_cast<size_t>(mOptions.sharedCacheSize) * 1024 * 1024);
+    if (mOptions.options & SharedSystemHeaders)
+        mSystemUnitStore = std::make_shared<SystemUnitStore>(mOptions.dataDir + "system/");
 
     if (!load())
         return false;
@@ -217,7 +322,8 @@ bool Server::init(const Options &options)
     if (mOptions.pollTimer) {
         mPollTimer = EventLoop::eventLoop()->registerTimer([this](int) {
                 for (auto proj : mProjects) {
-                    proj.second->validateAll();
+                    if (proj.second->isLoaded())
+                        proj.second->validateAll();
                 }
             }, mOptions.pollTimer * 1000);
     }
@@ -329,10 +435,9 @@ bool Server::initServers()
 std::shared_ptr<Project> Server::addProject(const Path &path)
 {
     std::shared_ptr<Project> &project = mProjects[path];
-    if (!project) {
+    if (!project)
         project.reset(new Project(path));
-        project->init();
-    }
+    project->init();
     return project;
 }
 
@@ -358,6 +463,8 @@ void Server::onNewConnection(SocketServer *server)
                     if (std::shared_ptr<Connection> c = weak.lock()) {
                         c->disconnected().disconnect();
                         mConnections.remove(c);
+                        if (mJobScheduler)
+                            mJobScheduler->removeRemoteWorker(c);
                     }
                 }));
     }
@@ -388,6 +495,9 @@ void Server::onNewMessage(const std::shared_ptr<Message> &message, const std::sh
     case VisitFileMessage::MessageId:
         handleVisitFileMessage(std::static_pointer_cast<VisitFileMessage>(message), connection);
         break;
+    case JobRequestMessage::MessageId:
+        handleJobRequestMessage(std::static_pointer_cast<JobRequestMessage>(message), connection);
+        break;
     case ResponseMessage::MessageId:
     case FinishMessage::MessageId:
     case VisitFileResponseMessage::MessageId:
@@ -643,8 +753,15 @@ void Server::handleLogOutputMessage(const std::shared_ptr<LogOutputMessage> &mes
 
 void Server::handleIndexDataMessage(const std::shared_ptr<IndexDataMessage> &message, const std::shared_ptr<Connection> &conn)
 {
+    const bool remote = mJobScheduler->isRemoteWorker(conn);
     mJobScheduler->handleIndexDataMessage(message);
-    conn->finish();
+    if ((remote || mOptions.rpWorkerJobs > 0) && !(message->flags() & IndexDataMessage::WorkerExit)) {
+        // rp workers keep their connection for the next job, acknowledge
+        // without closing it
+        conn->send(FinishMessage(RTags::Success));
+    } else {
+        conn->finish();
+    }
     mIndexDataMessageReceived();
 }
 
@@ -746,6 +863,9 @@ void Server::handleQueryMessage(const std::shared_ptr<QueryMessage> &message, co
     case QueryMessage::FindSymbols:
         findSymbols(message, conn);
         break;
+    case QueryMessage::FuzzySymbols:
+        fuzzySymbols(message, conn);
+        break;
     case QueryMessage::Status:
         status(message, conn);
         break;
@@ -818,6 +938,7 @@ void Server::followLocation(const std::shared_ptr<QueryMessage> &query, const st
                 paths[1].resolve();
                 for (const Path &projectPath : paths) {
                     if (path.startsWith(projectPath)) {
+                        proj.second->init();
                         FollowLocationJob job(loc, query, proj.second);
                         if (job.run(conn)) {
                             conn->finish();
@@ -1097,9 +1218,10 @@ void Server::symbolInfo(const std::shared_ptr<QueryMessage> &query, const std::s
     const Location start(fileId, line, column);
     const Location end = line2 ? Location(fileId, line2, column2) : Location();
 
-    SymbolInfoJob job(start, end, std::move(kinds), query, project);
-    const int ret = job.run(conn);
-    conn->finish(ret);
+    runQueryJob(project, conn, [start, end, kinds, query, project]() {
+            Set<String> k = kinds;
+            return std::make_shared<SymbolInfoJob>(start, end, std::move(k), query, project);
+        });
 }
 
 void Server::dependencies(const std::shared_ptr<QueryMessage> &query, const std::shared_ptr<Connection> &conn)
@@ -1182,9 +1304,9 @@ void Server::referencesForLocation(const std::shared_ptr<QueryMessage> &query, c
         return;
     }
 
-    ReferencesJob job(loc, query, project);
-    const int ret = job.run(conn);
-    conn->finish(ret);
+    runQueryJob(project, conn, [loc, query, project]() {
+            return std::make_shared<ReferencesJob>(loc, query, project);
+        });
 }
 
 void Server::referencesForName(const std::shared_ptr<QueryMessage> &query, const std::shared_ptr<Connection> &conn)
@@ -1201,9 +1323,9 @@ void Server::referencesForName(const std::shared_ptr<QueryMessage> &query, const
         return;
     }
 
-    ReferencesJob job(name, query, project);
-    const int ret = job.run(conn);
-    conn->finish(ret);
+    runQueryJob(project, conn, [name, query, project]() {
+            return std::make_shared<ReferencesJob>(name, query, project);
+        });
 }
 
 void Server::findSymbols(const std::shared_ptr<QueryMessage> &query, const std::shared_ptr<Connection> &conn)
@@ -1214,15 +1336,32 @@ void Server::findSymbols(const std::shared_ptr<QueryMessage> &query, const std::
     if (!project)
         project = currentProject();
 
-    int ret = 0;
     if (!project) {
-        ret = 1;
         error("No project");
-    } else {
-        FindSymbolsJob job(query, project);
-        ret = job.run(conn);
+        conn->finish(1);
+        return;
     }
-    conn->finish(ret);
+
+    runQueryJob(project, conn, [query, project]() {
+            return std::make_shared<FindSymbolsJob>(query, project);
+        });
+}
+
+void Server::fuzzySymbols(const std::shared_ptr<QueryMessage> &query, const std::shared_ptr<Connection> &conn)
+{
+    std::shared_ptr<Project> project = projectForQuery(query);
+    if (!project)
+        project = currentProject();
+
+    if (!project) {
+        error("No project");
+        conn->finish(1);
+        return;
+    }
+
+    runQueryJob(project, conn, [query, project]() {
+            return std::make_shared<FuzzySymbolsJob>(query, project);
+        });
 }
 
 void Server::listSymbols(const std::shared_ptr<QueryMessage> &query, const std::shared_ptr<Connection> &conn)
@@ -1239,9 +1378,9 @@ void Server::listSymbols(const std::shared_ptr<QueryMessage> &query, const std::
         return;
     }
 
-    ListSymbolsJob job(query, project);
-    const int ret = job.run(conn);
-    conn->finish(ret);
+    runQueryJob(project, conn, [query, project]() {
+            return std::make_shared<ListSymbolsJob>(query, project);
+        });
 }
 
 void Server::status(const std::shared_ptr<QueryMessage> &query, const std::shared_ptr<Connection> &conn)
@@ -1253,6 +1392,30 @@ void Server::status(const std::shared_ptr<QueryMessage> &query, const std::share
     conn->finish(ret);
 }
 
+void Server::runQueryJob(const std::shared_ptr<Project> &project,
+                         const std::shared_ptr<Connection> &conn,
+                         std::function<std::shared_ptr<QueryJob>()> &&create)
+{
+    if (!mQueryThreadPool) {
+        const int ret = create()->run(conn);
+        conn->finish(ret);
+        return;
+    }
+
+    auto job = std::make_shared<QueryThreadPoolJob>(std::move(create), project, conn);
+    std::weak_ptr<QueryThreadPoolJob> weak = job;
+    conn->disconnected().connect([weak](const std::shared_ptr<Connection> &) {
+            if (std::shared_ptr<QueryThreadPoolJob> j = weak.lock())
+                j->abort();
+        });
+    project->startQuery([this, job]() { mQueryThreadPool->start(job); });
+}
+
+void Server::startBackgroundJob(std::function<void()> &&func)
+{
+    mBackgroundThreadPool->start(std::make_shared<BackgroundThreadPoolJob>(std::move(func)));
+}
+
 void Server::isIndexed(const std::shared_ptr<QueryMessage> &query, const std::shared_ptr<Connection> &conn)
 {
     String ret = "unknown";
@@ -1355,6 +1518,13 @@ void Server::preprocessFile(const std::shared_ptr<QueryMessage> &query, const st
 void Server::clearProjects(ClearMode mode)
 {
     Path::rmdir(mOptions.dataDir);
+    if (mFileIdsJournal) {
+        fclose(mFileIdsJournal);
+        mFileIdsJournal = 0;
+    }
+    mFileIdsJournalRecords = 0;
+    // Clear_KeepFileIds gets a new snapshot on the next flush
+    mLastFileId = 0;
     setCurrentProject(std::shared_ptr<Project>());
     for (auto p : mProjects) {
         p.second->destroy();
@@ -1381,15 +1551,22 @@ void Server::reindex(const std::shared_ptr<QueryMessage> &query, const std::shar
     if (query->flags() & QueryMessage::Wait)
         wait = conn;
 
-    const int count = project->reindex(match, query, wait);
-    // error() << count << query->query();
-    if (count) {
-        conn->write<128>("Dirtied %d files", count);
+    auto reply = [conn, wait](int count) {
+        // error() << count << query->query();
+        if (count) {
+            conn->write<128>("Dirtied %d files", count);
+        } else {
+            conn->write("No matches");
+        }
+        if (!wait)
+            conn->finish();
+    };
+    if (query->type() == QueryMessage::CheckReindex) {
+        // the touched files are hashed on the background pool first
+        project->checkReindex(match, query, wait, reply);
     } else {
-        conn->write("No matches");
+        reply(project->reindex(match, query, wait));
     }
-    if (!wait)
-        conn->finish();
 }
 
 bool Server::shouldIndex(const Source &source, const Path &srcRoot) const
@@ -1428,6 +1605,7 @@ void Server::setCurrentProject(const std::shared_ptr<Project> &project)
             old->fileManager()->clearFileSystemWatcher();
         mCurrentProject = project;
         if (project) {
+            project->init();
             Path::mkdir(mOptions.dataDir);
             FILE *f = fopen((mOptions.dataDir + ".currentProject").constData(), "w");
             if (f) {
@@ -1468,13 +1646,25 @@ std::shared_ptr<Project> Server::projectForQuery(const std::shared_ptr<QueryMess
 std::shared_ptr<Project> Server::projectForMatches(const List<Match> &matches)
 {
     std::shared_ptr<Project> cur = currentProject();
+    // Projects other than the current one are restored on first use, until
+    // then there's nothing but their root to match against
+    auto load = [](const Match &match, const ProjectsMap::value_type &project) {
+        if (project.second->isLoaded())
+            return true;
+        const Path pattern = match.pattern();
+        if (!match.match(project.first) && !pattern.startsWith(project.first)
+            && !pattern.startsWith(project.first.resolved())) {
+            return false;
+        }
+        return project.second->init();
+    };
     // give current a chance first to avoid switching project when using system headers etc
     for (const Match &match : matches) {
         if (cur && cur->match(match))
             return cur;
 
         for (const auto &it : mProjects) {
-            if (it.second != cur && it.second->match(match)) {
+            if (it.second != cur && load(match, it) && it.second->match(match)) {
                 setCurrentProject(it.second);
                 return it.second;
             }
@@ -1952,20 +2142,38 @@ void Server::validate(const std::shared_ptr<QueryMessage> &query, const std::sha
 
 void Server::handleVisitFileMessage(const std::shared_ptr<VisitFileMessage> &message, const std::shared_ptr<Connection> &conn)
 {
-    uint32_t fileId = 0;
-    bool visit = false;
+    const List<Path> &files = message->files();
+    VisitFileResponseMessage::Files response;
+    response.reserve(files.size());
 
     std::shared_ptr<Project> project = mProjects.value(message->project());
     const uint32_t id = message->sourceFileId();
-    if (project && project->isActiveJob(id)) {
-        assert(message->file() == message->file().resolved());
-        fileId = Location::insertFile(message->file());
-        visit = project->visitFile(fileId, message->file(), id);
-    }
-    VisitFileResponseMessage msg(fileId, visit);
+    // A remote worker may still be running a job that has been restarted
+    // since, it mustn't claim files for the new one
+    const bool active = project && project->isActiveJob(id, message->jobId());
+    for (const Path &file : files) {
+        uint32_t fileId = 0;
+        bool visit = false;
+        if (active) {
+            assert(file == file.resolved());
+            fileId = Location::insertFile(file);
+            visit = project->visitFile(fileId, file, id);
+        }
+        response.append(std::make_pair(fileId, visit));
+    }
+    // rp writes the ids into its unit files, they have to survive a crash
+    flushFileIds();
+    VisitFileResponseMessage msg(response);
     conn->send(msg);
 }
 
+void Server::handleJobRequestMessage(const std::shared_ptr<JobRequestMessage> &message, const std::shared_ptr<Connection> &conn)
+{
+    // rp --remote is ready for a job, the connection stays open for as long
+    // as it keeps running them
+    mJobScheduler->addRemoteWorker(conn, message->name());
+}
+
 bool Server::load()
 {
     DataFile fileIdsFile(mOptions.dataDir + "fileids", RTags::DatabaseVersion);
@@ -1989,6 +2197,7 @@ bool Server::load()
         Sandbox::decode(pathsToIds);
 
         Location::init(pathsToIds);
+        replayFileIdsJournal();
         List<Path> projects = mOptions.dataDir.files(Path::Directory);
         for (size_t i=0; i<projects.size(); ++i) {
             const Path &file = projects.at(i);
@@ -2012,7 +2221,10 @@ bool Server::load()
                                   file.constData());
                             remove = true;
                         } else {
-                            addProject(filePath.ensureTrailingSlash());
+                            // Restored by setCurrentProject() or addProject()
+                            // when it's first needed
+                            const Path path = filePath.ensureTrailingSlash();
+                            mProjects[path].reset(new Project(path));
                         }
                     } else {
                         remove = true;
@@ -2066,12 +2278,75 @@ bool Server::load()
     return true;
 }
 
-bool Server::saveFileIds()
+void Server::saveFileIds()
+{
+    // Called for every new file id, possibly from other threads. New ids are
+    // appended to the journal in batches, at the latest right before rp is
+    // told about them in handleVisitFileMessage.
+    if (mFileIdsFlushPending.exchange(true))
+        return;
+    EventLoop::mainEventLoop()->callLater([this]() {
+            mFileIdsTimer.restart(FileIdsFlushDelay, Timer::SingleShot);
+        });
+}
+
+static bool syncFile(const Path &path)
+{
+    int fd;
+    eintrwrap(fd, open(path.constData(), O_RDONLY));
+    if (fd == -1)
+        return false;
+    const bool ok = !fsync(fd);
+    int ret;
+    eintrwrap(ret, close(fd));
+    return ok;
+}
+
+bool Server::flushFileIds()
 {
+    mFileIdsFlushPending = false;
     const uint32_t lastId = Location::lastId();
     if (mLastFileId == lastId)
         return true;
-    DataFile fileIdsFile(mOptions.dataDir + "fileids", RTags::DatabaseVersion);
+    if (!mFileIdsJournal || mFileIdsJournalRecords >= std::max<uint32_t>(FileIdsCompactionThreshold, Location::count() / 2))
+        return compactFileIds();
+
+    // id, size, path
+    String records;
+    for (uint32_t id = mLastFileId + 1; id <= lastId; ++id) {
+        const Path path = Location::path(id);
+        if (path.isEmpty())
+            continue;
+        const String encoded = Sandbox::encoded(path);
+        const uint32_t size = encoded.size();
+        records.append(reinterpret_cast<const char*>(&id), sizeof(id));
+        records.append(reinterpret_cast<const char*>(&size), sizeof(size));
+        records.append(encoded);
+        ++mFileIdsJournalRecords;
+    }
+    if (fwrite(records.constData(), records.size(), 1, mFileIdsJournal) != 1
+        || fflush(mFileIdsJournal)
+        || (mOptions.fileIdsFsync == Fsync_Always && fsync(fileno(mFileIdsJournal)))) {
+        error("Can't append to file ids journal: %s", Rct::strerror().constData());
+        // whatever made it to the journal is also in the snapshot we're about to write
+        fclose(mFileIdsJournal);
+        mFileIdsJournal = 0;
+        return compactFileIds();
+    }
+
+    mLastFileId = lastId;
+    return true;
+}
+
+bool Server::compactFileIds()
+{
+    if (mFileIdsJournal) {
+        fclose(mFileIdsJournal);
+        mFileIdsJournal = 0;
+    }
+    const uint32_t lastId = Location::lastId();
+    const Path path = mOptions.dataDir + "fileids";
+    DataFile fileIdsFile(path, RTags::DatabaseVersion);
     if (!fileIdsFile.open(DataFile::Write)) {
         error("Can't save file ids: %s", fileIdsFile.error().constData());
         return false;
@@ -2086,11 +2361,70 @@ bool Server::saveFileIds()
         error("Can't save file ids: %s", fileIdsFile.error().constData());
         return false;
     }
-
+    if (mOptions.fileIdsFsync != Fsync_Never && !syncFile(path))
+        error("Can't sync file ids: %s", Rct::strerror().constData());
+
+    // The snapshot has everything so if we crash before the journal is
+    // truncated replaying it again is harmless.
+    const Path journal = mOptions.dataDir + "fileids.journal";
+    mFileIdsJournal = fopen(journal.constData(), "w");
+    const int32_t version = RTags::DatabaseVersion;
+    if (!mFileIdsJournal
+        || fwrite(&version, sizeof(version), 1, mFileIdsJournal) != 1
+        || fflush(mFileIdsJournal)
+        || (mOptions.fileIdsFsync != Fsync_Never && fsync(fileno(mFileIdsJournal)))) {
+        error("Can't create file ids journal %s: %s", journal.constData(), Rct::strerror().constData());
+        if (mFileIdsJournal) {
+            fclose(mFileIdsJournal);
+            mFileIdsJournal = 0;
+        }
+    }
+    mFileIdsJournalRecords = 0;
     mLastFileId = lastId;
     return true;
 }
 
+void Server::replayFileIdsJournal()
+{
+    const Path journal = mOptions.dataDir + "fileids.journal";
+    FILE *f = fopen(journal.constData(), "r");
+    if (!f)
+        return;
+    int32_t version;
+    bool ok = fread(&version, sizeof(version), 1, f) == 1 && version == RTags::DatabaseVersion;
+    uint32_t records = 0;
+    while (ok) {
+        uint32_t header[2];
+        const size_t read = fread(header, 1, sizeof(header), f);
+        if (read != sizeof(header)) {
+            // part of a record means we crashed while appending
+            ok = !read && !ferror(f);
+            break;
+        }
+        Path path;
+        path.resize(header[1]);
+        if (!header[0] || !header[1] || fread(path.data(), header[1], 1, f) != 1) {
+            ok = false;
+            break;
+        }
+        Sandbox::decode(path);
+        Location::set(path, header[0]);
+        ++records;
+    }
+    fclose(f);
+    mLastFileId = Location::lastId();
+    if (ok) {
+        // new ids go at the end of the journal we just read
+        mFileIdsJournal = fopen(journal.constData(), "a");
+        mFileIdsJournalRecords = records;
+    } else {
+        // left from another version or cut short by a crash, start over
+        // with a snapshot that has everything we could read
+        warning() << "Rewriting" << journal << "after replaying" << records << "records";
+        compactFileIds();
+    }
+}
+
 void Server::removeSocketFile()
 {
 #ifdef RTAGS_HAS_LAUNCHD
@@ -2190,11 +2524,14 @@ public:
                 if (message->messageId() == Message::FinishMessageId) {
                     mIsFinished = true;
                 } else if (message->messageId() == Message::ResponseId) {
-                    String response = reinterpret_cast<const ResponseMessage *>(message)->data();
-                    if (response.startsWith(mWorkingDirectory)) {
-                        response.remove(0, mWorkingDirectory.size());
+                    // query jobs send their output in chunks of lines
+                    const String data = reinterpret_cast<const ResponseMessage *>(message)->data();
+                    for (String response : data.split('\n')) {
+                        if (response.startsWith(mWorkingDirectory)) {
+                            response.remove(0, mWorkingDirectory.size());
+                        }
+                        mOutput.append(response);
                     }
-                    mOutput.append(response);
                 }
             });
     }
@@ -16,6 +16,9 @@
 #ifndef Server_h
 #define Server_h
 
+#include <stdio.h>
+#include <atomic>
+
 #include "IndexMessage.h"
 #include "rct/Flags.h"
 #include "rct/Hash.h"
@@ -23,6 +26,7 @@
 #include "rct/SocketServer.h"
 #include "rct/String.h"
 #include "rct/Thread.h"
+#include "rct/Timer.h"
 #include "Source.h"
 #include "RTags.h"
 #ifdef OS_Darwin
@@ -38,6 +42,7 @@ class CompletionThread;
 class Connection;
 class ErrorMessage;
 class IndexDataMessage;
+class JobRequestMessage;
 class QueryJob;
 class LogOutputMessage;
 class Message;
@@ -47,6 +52,10 @@ class QueryMessage;
 class VisitFileMessage;
 class JobScheduler;
 class IndexParseData;
+class ThreadPool;
+class FileMapCache;
+class SharedCache;
+class SystemUnitStore;
 class Server
 {
 public:
@@ -78,7 +87,7 @@ public:
         RPLogToSyslog = (1ull << 21),
         CompletionsNoFilter = (1ull << 22),
         WatchSourcesOnly = (1ull << 23),
-        NoFileLock = (1ull << 24),
+        NoFileLock = (1ull << 24), // unused, file maps are never locked
         PCHEnabled = (1ull << 25),
         NoFileManager = (1ull << 26),
         ValidateFileMaps = (1ull << 27),
@@ -86,7 +95,14 @@ public:
         AllowWErrorAndWFatalErrors = (1ull << 29),
         NoRealPath = (1ull << 30),
         Separate32BitAnd64Bit = (1ull << 31),
-        SourceIgnoreIncludePathDifferencesInUsr = (1ull << 32)
+        SourceIgnoreIncludePathDifferencesInUsr = (1ull << 32),
+        TwoPhaseIndexing = (1ull << 33),
+        SharedSystemHeaders = (1ull << 34)
+    };
+    enum FsyncPolicy {
+        Fsync_Never,
+        Fsync_Compaction,
+        Fsync_Always
     };
     struct Options {
         Options()
@@ -94,18 +110,22 @@ public:
               rpVisitFileTimeout(0), rpIndexDataMessageTimeout(0), rpConnectTimeout(0),
               rpConnectAttempts(0), rpNiceValue(0), maxCrashCount(0),
               completionCacheSize(0), testTimeout(60 * 1000 * 5),
-              maxFileMapScopeCacheSize(512), pollTimer(0), tcpPort(0)
+              maxFileMapScopeCacheSize(512), pollTimer(0), queryThreadCount(0),
+              persistentFileMapCacheSize(0), rpWorkerJobs(0), rpWorkerMaxRss(0), sharedCacheSize(0), jobMemoryBudget(0), tcpPort(0),
+              fileIdsFsync(Fsync_Compaction)
         {
         }
 
-        Path socketFile, dataDir, argTransform, rp, sandboxRoot;
+        Path socketFile, dataDir, argTransform, rp, sandboxRoot, sharedCacheDir;
         Flags<Option> options;
         size_t jobCount, headerErrorJobCount, maxIncludeCompletionDepth;
         int rpVisitFileTimeout, rpIndexDataMessageTimeout,
             rpConnectTimeout, rpConnectAttempts, rpNiceValue, maxCrashCount,
             completionCacheSize, testTimeout, maxFileMapScopeCacheSize, errorLimit,
-            pollTimer;
+            pollTimer, queryThreadCount, persistentFileMapCacheSize,
+            rpWorkerJobs, rpWorkerMaxRss, sharedCacheSize, jobMemoryBudget;
         uint16_t tcpPort;
+        FsyncPolicy fileIdsFsync;
         List<String> defaultArguments, excludeFilters;
         Set<String> blockedArguments;
         List<Source::Include> includePaths;
@@ -124,12 +144,19 @@ public:
     void stopServers();
     void dumpJobs(const std::shared_ptr<Connection> &conn);
     std::shared_ptr<JobScheduler> jobScheduler() const { return mJobScheduler; }
+    std::shared_ptr<FileMapCache> fileMapCache() const { return mFileMapCache; }
+    std::shared_ptr<SharedCache> sharedCache() const { return mSharedCache; }
+    std::shared_ptr<SystemUnitStore> systemUnitStore() const { return mSystemUnitStore; }
+    // Runs func on a pool of threads shared by the housekeeping of all
+    // projects, e.g. writing their indexes
+    void startBackgroundJob(std::function<void()> &&func);
     const Set<uint32_t> &activeBuffers() const { return mActiveBuffers; }
     bool isActiveBuffer(uint32_t fileId) const { return mActiveBuffers.contains(fileId); }
     int exitCode() const { return mExitCode; }
     std::shared_ptr<Project> currentProject() const { return mCurrentProject.lock(); }
     void onNewMessage(const std::shared_ptr<Message> &message, const std::shared_ptr<Connection> &conn);
-    bool saveFileIds();
+    void saveFileIds();
+    bool flushFileIds();
     bool loadCompileCommands(IndexParseData &data, const Path &compileCommands, const List<String> &environment, SourceCache *cache) const;
     bool parse(IndexParseData &data,
                String &&arguments,
@@ -143,6 +170,8 @@ public:
 private:
     String guessArguments(const String &args, const Path &pwd, const Path &projectRootOverride) const;
     bool load();
+    void replayFileIdsJournal();
+    bool compactFileIds();
     void onNewConnection(SocketServer *server);
     void setCurrentProject(const std::shared_ptr<Project> &project);
     enum ClearMode {
@@ -156,6 +185,7 @@ private:
     void handleErrorMessage(const std::shared_ptr<ErrorMessage> &message, const std::shared_ptr<Connection> &conn);
     void handleLogOutputMessage(const std::shared_ptr<LogOutputMessage> &message, const std::shared_ptr<Connection> &conn);
     void handleVisitFileMessage(const std::shared_ptr<VisitFileMessage> &message, const std::shared_ptr<Connection> &conn);
+    void handleJobRequestMessage(const std::shared_ptr<JobRequestMessage> &message, const std::shared_ptr<Connection> &conn);
 
     // Queries
     void sendDiagnostics(const std::shared_ptr<QueryMessage> &query, const std::shared_ptr<Connection> &conn);
@@ -169,6 +199,7 @@ private:
     void generateTest(const std::shared_ptr<QueryMessage> &query, const std::shared_ptr<Connection> &conn);
     void findFile(const std::shared_ptr<QueryMessage> &query, const std::shared_ptr<Connection> &conn);
     void findSymbols(const std::shared_ptr<QueryMessage> &query, const std::shared_ptr<Connection> &conn);
+    void fuzzySymbols(const std::shared_ptr<QueryMessage> &query, const std::shared_ptr<Connection> &conn);
     void fixIts(const std::shared_ptr<QueryMessage> &query, const std::shared_ptr<Connection> &conn);
     void followLocation(const std::shared_ptr<QueryMessage> &query, const std::shared_ptr<Connection> &conn);
     void hasFileManager(const std::shared_ptr<QueryMessage> &query, const std::shared_ptr<Connection> &conn);
@@ -196,6 +227,10 @@ private:
     void tokens(const std::shared_ptr<QueryMessage> &query, const std::shared_ptr<Connection> &conn);
     void validate(const std::shared_ptr<QueryMessage> &query, const std::shared_ptr<Connection> &conn);
 
+    void runQueryJob(const std::shared_ptr<Project> &project,
+                     const std::shared_ptr<Connection> &conn,
+                     std::function<std::shared_ptr<QueryJob>()> &&create);
+
     std::shared_ptr<Project> projectForQuery(const std::shared_ptr<QueryMessage> &queryMessage);
     std::shared_ptr<Project> projectForMatches(const List<Match> &matches);
     std::shared_ptr<Project> addProject(const Path &path);
@@ -216,7 +251,15 @@ private:
 
     int mPollTimer, mExitCode;
     uint32_t mLastFileId;
+    FILE *mFileIdsJournal;
+    uint32_t mFileIdsJournalRecords;
+    std::atomic<bool> mFileIdsFlushPending;
+    Timer mFileIdsTimer;
     std::shared_ptr<JobScheduler> mJobScheduler;
+    std::shared_ptr<ThreadPool> mQueryThreadPool, mBackgroundThreadPool;
+    std::shared_ptr<FileMapCache> mFileMapCache;
+    std::shared_ptr<SharedCache> mSharedCache;
+    std::shared_ptr<SystemUnitStore> mSystemUnitStore;
     CompletionThread *mCompletionThread;
     Set<uint32_t> mActiveBuffers;
     Set<std::shared_ptr<Connection> > mConnections;
@@ -0,0 +1,441 @@
+/* This file is part of RTags (http://rtags.net).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include "SharedCache.h"
+
+#include <sys/time.h>
+#include <algorithm>
+
+#include "IndexDataMessage.h"
+#include "IndexerJob.h"
+#include "Project.h"
+#include "rct/EventLoop.h"
+#include "rct/Log.h"
+#include "rct/SHA256.h"
+#include "RTags.h"
+#include "Sandbox.h"
+#include "Server.h"
+#include "UnitFile.h"
+
+SharedCache::SharedCache(const Path &dir, size_t maxSize)
+    : mDir(dir.ensureTrailingSlash()), mMaxSize(maxSize), mSize(0), mHits(0), mMisses(0),
+      mStores(0), mEvictions(0)
+{
+    Path::mkdir(mDir, Path::Recursive);
+    for (const Path &file : mDir.files(Path::File))
+        mSize += file.fileSize();
+}
+
+uint64_t SharedCache::contentHash(const Path &path)
+{
+    const uint64_t modified = path.lastModifiedMs();
+    if (!modified)
+        return 0;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        std::pair<uint64_t, uint64_t> cached = mContentHashes.value(path);
+        if (!cached.first) {
+            cached = mOldContentHashes.take(path);
+            if (cached.first)
+                mContentHashes[path] = cached;
+        }
+        if (cached.first == modified)
+            return cached.second;
+    }
+    const uint64_t hash = RTags::contentHash(path);
+    if (!hash)
+        return 0;
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (mContentHashes.size() >= MaxContentHashes) {
+        std::swap(mContentHashes, mOldContentHashes);
+        mContentHashes.clear();
+    }
+    mContentHashes[path] = std::make_pair(modified, hash);
+    return hash;
+}
+
+String SharedCache::key(const std::shared_ptr<IndexerJob> &job)
+{
+    const uint64_t source = contentHash(job->sourceFile);
+    if (!source)
+        return String();
+    const Server::Options &options = Server::instance()->options();
+    SHA256 sha;
+    sha.update(String::format<64>("%d %d\n", RTags::DatabaseVersion, Sandbox::hasRoot()));
+    sha.update(String::join(options.defaultArguments, ' ') + '\n');
+    for (const Source &s : job->sources) {
+        sha.update(Sandbox::encoded(String::join(s.toCommandLine(Source::Default|Source::IncludeCompiler|Source::IncludeSourceFile), ' ')));
+        sha.update("\n");
+    }
+    sha.update(String::format<32>("%016llx", static_cast<unsigned long long>(source)));
+    return sha.hash(SHA256::Hex);
+}
+
+static inline Location remap(Location location, const Hash<uint32_t, uint32_t> &fileIds)
+{
+    if (location.isNull())
+        return location;
+    const uint32_t fileId = fileIds.value(location.fileId());
+    return fileId ? Location(fileId, location.line(), location.column()) : Location();
+}
+
+static inline Set<Location> remap(const Set<Location> &locations, const Hash<uint32_t, uint32_t> &fileIds)
+{
+    Set<Location> ret;
+    for (const Location &location : locations) {
+        const Location l = remap(location, fileIds);
+        if (!l.isNull())
+            ret.insert(l);
+    }
+    return ret;
+}
+
+static inline void remap(Symbol::Argument &argument, const Hash<uint32_t, uint32_t> &fileIds)
+{
+    argument.location = remap(argument.location, fileIds);
+    argument.cursor = remap(argument.cursor, fileIds);
+}
+
+static bool remapUnit(const String &data, const Path &path, const Hash<uint32_t, uint32_t> &fileIds, size_t *written)
+{
+    std::shared_ptr<UnitFile> unit = std::make_shared<UnitFile>();
+    if (!unit->load(data))
+        return false;
+
+    Map<UnitFile::Section, String> sections;
+    {
+        FileMap<Location, Symbol> fileMap;
+        if (!unit->open(UnitFile::Symbols, fileMap))
+            return false;
+        Map<Location, Symbol> symbols;
+        Map<Location, SymbolCore> cores;
+        for (uint32_t i=0; i<fileMap.count(); ++i) {
+            Symbol symbol = fileMap.valueAt(i);
+            symbol.location = remap(symbol.location, fileIds);
+            if (symbol.location.isNull())
+                continue;
+            for (Symbol::Argument &argument : symbol.arguments)
+                remap(argument, fileIds);
+            symbol.argumentUsage.invocation = remap(symbol.argumentUsage.invocation, fileIds);
+            symbol.argumentUsage.invokedFunction = remap(symbol.argumentUsage.invokedFunction, fileIds);
+            remap(symbol.argumentUsage.argument, fileIds);
+            cores[symbol.location] = SymbolCore(symbol);
+            symbols[symbol.location] = std::move(symbol);
+        }
+        sections[UnitFile::Symbols] = FileMap<Location, Symbol>::encode(symbols);
+        sections[UnitFile::SymbolCores] = FileMap<Location, SymbolCore>::encode(cores);
+    }
+    for (UnitFile::Section section : { UnitFile::Targets, UnitFile::Usrs, UnitFile::SymbolNames }) {
+        FileMap<String, Set<Location> > fileMap;
+        if (!unit->open(section, fileMap))
+            return false;
+        Map<String, Set<Location> > map;
+        for (uint32_t i=0; i<fileMap.count(); ++i) {
+            const Set<Location> locations = remap(fileMap.valueAt(i), fileIds);
+            if (!locations.isEmpty())
+                map[fileMap.keyAt(i)] = locations;
+        }
+        sections[section] = FileMap<String, Set<Location> >::encode(map);
+    }
+    {
+        FileMap<uint32_t, Token> fileMap;
+        if (!unit->open(UnitFile::Tokens, fileMap))
+            return false;
+        Map<uint32_t, Token> tokens;
+        for (uint32_t i=0; i<fileMap.count(); ++i) {
+            Token token = fileMap.valueAt(i);
+            token.location = remap(token.location, fileIds);
+            tokens[fileMap.keyAt(i)] = std::move(token);
+        }
+        sections[UnitFile::Tokens] = FileMap<uint32_t, Token>::encode(tokens);
+    }
+    sections[UnitFile::Info] = unit->section(UnitFile::Info);
+    if (unit->contains(UnitFile::UsrsFilter)) // usrs don't have file ids in them
+        sections[UnitFile::UsrsFilter] = unit->section(UnitFile::UsrsFilter);
+
+    Path::mkdir(path.parentDir(), Path::Recursive);
+    *written = UnitFile::write(path, sections);
+    return *written;
+}
+
+struct SharedCache::Entry
+{
+    Path path;
+    List<Path> files;
+    List<uint32_t> ids;
+    Map<uint32_t, String> units;
+    List<std::pair<uint32_t, uint32_t> > includes;
+};
+
+// Called on a background thread. Only succeeds if none of the files the
+// translation unit saw changed.
+bool SharedCache::read(const Path &path, Entry &entry)
+{
+    const String data = path.readAll();
+    if (data.isEmpty())
+        return false;
+    uint16_t version;
+    List<uint64_t> hashes;
+    Deserializer deserializer(data);
+    deserializer >> version;
+    if (version != RTags::DatabaseVersion)
+        return false;
+    deserializer >> entry.files >> entry.ids >> hashes >> entry.units >> entry.includes;
+    if (entry.files.size() != entry.ids.size() || entry.files.size() != hashes.size())
+        return false;
+    for (size_t i=0; i<entry.files.size(); ++i) {
+        entry.files[i] = Sandbox::decoded(entry.files.at(i));
+        if (contentHash(entry.files.at(i)) != hashes.at(i))
+            return false;
+    }
+    entry.path = path;
+    return true;
+}
+
+void SharedCache::import(const std::shared_ptr<IndexerJob> &job,
+                         const std::shared_ptr<Project> &project,
+                         std::function<void(const std::shared_ptr<IndexDataMessage> &)> &&callback)
+{
+    if (!job->unsavedFiles.isEmpty()) {
+        callback(std::shared_ptr<IndexDataMessage>());
+        return;
+    }
+
+    std::shared_ptr<SharedCache> self = shared_from_this();
+    std::weak_ptr<Project> weak = project;
+    std::function<void(const std::shared_ptr<IndexDataMessage> &)> cb = std::move(callback);
+    Server::instance()->startBackgroundJob([self, job, weak, cb]() {
+            auto entry = std::make_shared<Entry>();
+            const String k = self->key(job);
+            const bool found = !k.isEmpty() && self->read(self->mDir + k, *entry);
+            EventLoop::mainEventLoop()->callLater([self, job, weak, cb, entry, found]() {
+                    std::shared_ptr<Project> project = weak.lock();
+                    if (found && project && !(job->flags & IndexerJob::Aborted)) {
+                        self->claim(job, project, entry, std::function<void(const std::shared_ptr<IndexDataMessage> &)>(cb));
+                        return;
+                    }
+                    {
+                        std::lock_guard<std::mutex> lock(self->mMutex);
+                        ++self->mMisses;
+                    }
+                    cb(std::shared_ptr<IndexDataMessage>());
+                });
+        });
+}
+
+void SharedCache::claim(const std::shared_ptr<IndexerJob> &job, const std::shared_ptr<Project> &project,
+                        const std::shared_ptr<Entry> &entry,
+                        std::function<void(const std::shared_ptr<IndexDataMessage> &)> &&callback)
+{
+    auto miss = [this, &callback]() {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            ++mMisses;
+        }
+        callback(std::shared_ptr<IndexDataMessage>());
+    };
+
+    List<uint32_t> fileIds(entry->files.size());
+    auto remapped = std::make_shared<Hash<uint32_t, uint32_t> >();
+    for (size_t i=0; i<entry->files.size(); ++i) {
+        fileIds[i] = Location::insertFile(entry->files.at(i));
+        (*remapped)[entry->ids.at(i)] = fileIds.at(i);
+    }
+
+    // Claim files the way rp would. If we get one the cached translation
+    // unit didn't index we have no data for it and have to run rp.
+    const uint32_t sourceFileId = job->fileId();
+    auto msg = std::make_shared<IndexDataMessage>(job);
+    auto units = std::make_shared<List<std::pair<Path, uint32_t> > >(); // unit file path -> index in entry
+    for (size_t i=0; i<entry->files.size(); ++i) {
+        const bool visit = project->visitFile(fileIds.at(i), Location::path(fileIds.at(i)), sourceFileId);
+        if (visit) {
+            if (!entry->units.contains(i)) {
+                project->releaseFileIds(job->visited);
+                job->visited.clear();
+                miss();
+                return;
+            }
+            units->append(std::make_pair(project->unitFilePath(fileIds.at(i)), static_cast<uint32_t>(i)));
+        }
+        msg->files()[fileIds.at(i)] = visit ? IndexDataMessage::Visited : IndexDataMessage::NoFileFlag;
+    }
+
+    for (const auto &include : entry->includes) {
+        if (include.first < fileIds.size() && include.second < fileIds.size())
+            msg->includes().push_back(std::make_pair(fileIds.at(include.first), fileIds.at(include.second)));
+    }
+    msg->setProject(project->path());
+    msg->setId(job->id);
+    msg->setFileId(sourceFileId);
+    msg->setIndexerJobFlags(job->flags & ~IndexerJob::Declarations); // the cache has the full pass
+    msg->setMessage(job->sourceFile.toTilde() + " imported from shared cache");
+
+    // The files are ours now, rewriting the units happens in the background
+    std::shared_ptr<SharedCache> self = shared_from_this();
+    std::weak_ptr<Project> weak = project;
+    std::function<void(const std::shared_ptr<IndexDataMessage> &)> cb = std::move(callback);
+    Server::instance()->startBackgroundJob([self, job, weak, cb, entry, units, remapped, msg]() {
+            size_t bytesWritten = 0;
+            Path failed;
+            for (const auto &unit : *units) {
+                size_t written;
+                if (!remapUnit(entry->units.value(unit.second), unit.first, *remapped, &written)) {
+                    failed = entry->files.at(unit.second);
+                    break;
+                }
+                bytesWritten += written;
+            }
+            if (failed.isEmpty())
+                utimes(entry->path.constData(), 0); // most recently used
+            EventLoop::mainEventLoop()->callLater([self, job, weak, cb, entry, msg, failed, bytesWritten]() {
+                    std::shared_ptr<Project> project = weak.lock();
+                    if (!failed.isEmpty() || !project || job->flags & IndexerJob::Aborted) {
+                        if (!failed.isEmpty())
+                            error() << "Failed to import" << failed << "from" << entry->path;
+                        // aborted jobs had their files released by the project
+                        if (project && !(job->flags & IndexerJob::Aborted)) {
+                            project->releaseFileIds(job->visited);
+                            job->visited.clear();
+                        }
+                        {
+                            std::lock_guard<std::mutex> lock(self->mMutex);
+                            ++self->mMisses;
+                        }
+                        cb(std::shared_ptr<IndexDataMessage>());
+                        return;
+                    }
+                    msg->setParseTime(Rct::currentTimeMs());
+                    msg->setBytesWritten(bytesWritten);
+                    {
+                        std::lock_guard<std::mutex> lock(self->mMutex);
+                        ++self->mHits;
+                    }
+                    cb(msg);
+                });
+        });
+}
+
+void SharedCache::insert(const std::shared_ptr<IndexerJob> &job, const std::shared_ptr<Project> &project,
+                         const std::shared_ptr<IndexDataMessage> &message)
+{
+    if (!job->unsavedFiles.isEmpty() || message->flags() & IndexDataMessage::ParseFailure
+        || message->indexerJobFlags() & IndexerJob::Declarations) {
+        return;
+    }
+
+    // Everything that needs the project or the file ids is looked up here,
+    // hashing and reading the files happens in the background.
+    auto files = std::make_shared<List<std::pair<Path, Path> > >(); // path -> unit file path if visited
+    auto ids = std::make_shared<List<uint32_t> >();
+    Hash<uint32_t, uint32_t> indexes;
+    for (const auto &file : message->files()) {
+        indexes[file.first] = files->size();
+        files->append(std::make_pair(Location::path(file.first),
+                                     file.second & IndexDataMessage::Visited ? project->unitFilePath(file.first) : Path()));
+        ids->append(file.first);
+    }
+    auto includes = std::make_shared<List<std::pair<uint32_t, uint32_t> > >();
+    for (const auto &include : message->includes()) {
+        const auto from = indexes.find(include.first);
+        const auto to = indexes.find(include.second);
+        if (from != indexes.end() && to != indexes.end())
+            includes->append(std::make_pair(from->second, to->second));
+    }
+
+    std::shared_ptr<SharedCache> self = shared_from_this();
+    Server::instance()->startBackgroundJob([self, job, files, ids, includes]() {
+            const String k = self->key(job);
+            if (k.isEmpty())
+                return;
+            List<Path> paths;
+            List<uint64_t> hashes;
+            Map<uint32_t, String> units;
+            for (const auto &file : *files) {
+                const uint64_t hash = self->contentHash(file.first);
+                if (!hash)
+                    return;
+                if (!file.second.isEmpty()) {
+                    const String unit = file.second.readAll();
+                    if (unit.isEmpty())
+                        return;
+                    units[paths.size()] = unit;
+                }
+                paths.append(Sandbox::encoded(file.first));
+                hashes.append(hash);
+            }
+
+            String data;
+            {
+                Serializer serializer(data);
+                serializer << static_cast<uint16_t>(RTags::DatabaseVersion) << paths << *ids << hashes << units << *includes;
+            }
+
+            const Path path = self->mDir + k;
+            const int64_t old = path.fileSize();
+            if (!writeFileMapData(path, data))
+                return;
+            bool full;
+            {
+                std::lock_guard<std::mutex> lock(self->mMutex);
+                if (old > 0)
+                    self->mSize -= std::min<size_t>(self->mSize, old);
+                self->mSize += data.size();
+                ++self->mStores;
+                full = self->mSize > self->mMaxSize;
+            }
+            if (full)
+                self->evict();
+        });
+}
+
+void SharedCache::evict()
+{
+    // Other rdms write to the same directory so look at what is actually
+    // there and remove the least recently used entries.
+    List<std::pair<uint64_t, Path> > entries;
+    size_t total = 0;
+    for (const Path &file : mDir.files(Path::File)) {
+        entries.append(std::make_pair(file.lastModifiedMs(), file));
+        total += file.fileSize();
+    }
+    std::sort(entries.begin(), entries.end());
+    const size_t target = mMaxSize - (mMaxSize / 10);
+    uint64_t evictions = 0;
+    for (const auto &entry : entries) {
+        if (total <= target)
+            break;
+        const int64_t size = entry.second.fileSize();
+        if (Path::rm(entry.second)) {
+            total -= std::min<size_t>(total, size);
+            ++evictions;
+        }
+    }
+    std::lock_guard<std::mutex> lock(mMutex);
+    mSize = total;
+    mEvictions += evictions;
+}
+
+String SharedCache::toString() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    const uint64_t lookups = mHits + mMisses;
+    return String::format<256>("%s: %zu/%zu bytes, %llu hits, %llu misses (%.1f%% hit rate), %llu stores, %llu evictions",
+                               mDir.constData(), mSize, mMaxSize,
+                               static_cast<unsigned long long>(mHits), static_cast<unsigned long long>(mMisses),
+                               lookups ? (mHits * 100.0) / lookups : 0.0,
+                               static_cast<unsigned long long>(mStores),
+                               static_cast<unsigned long long>(mEvictions));
+}
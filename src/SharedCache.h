@@ -0,0 +1,78 @@
+/* This file is part of RTags (http://rtags.net).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef SharedCache_h
+#define SharedCache_h
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+
+#include "rct/Hash.h"
+#include "rct/Path.h"
+#include "rct/String.h"
+
+class IndexDataMessage;
+class IndexerJob;
+class Project;
+
+/*
+ * Content addressed cache of rp output that can be shared by every rdm on a
+ * machine. An entry is keyed by a hash of the database version, the command
+ * lines and the contents of the source file. It holds the unit files rp
+ * wrote together with the paths and content hashes of every file the
+ * translation unit saw. It is only used if none of those files changed.
+ * Imported units get their fileIds mapped to the importing rdm's.
+ */
+class SharedCache : public std::enable_shared_from_this<SharedCache>
+{
+public:
+    SharedCache(const Path &dir, size_t maxSize);
+
+    // Looks the job up, hashing and reading on a background thread. On a hit
+    // the unit files are written into the project's data dir and callback
+    // gets the IndexDataMessage rp would have sent, on a miss it gets null.
+    // callback is called on the main thread.
+    void import(const std::shared_ptr<IndexerJob> &job,
+                const std::shared_ptr<Project> &project,
+                std::function<void(const std::shared_ptr<IndexDataMessage> &)> &&callback);
+    // Stores what rp wrote for job, on a background thread
+    void insert(const std::shared_ptr<IndexerJob> &job, const std::shared_ptr<Project> &project,
+                const std::shared_ptr<IndexDataMessage> &message);
+
+    String toString() const;
+private:
+    enum { MaxContentHashes = 16384 };
+    struct Entry;
+    String key(const std::shared_ptr<IndexerJob> &job);
+    uint64_t contentHash(const Path &path);
+    bool read(const Path &path, Entry &entry);
+    void claim(const std::shared_ptr<IndexerJob> &job, const std::shared_ptr<Project> &project,
+               const std::shared_ptr<Entry> &entry,
+               std::function<void(const std::shared_ptr<IndexDataMessage> &)> &&callback);
+    void evict();
+
+    const Path mDir;
+    const size_t mMaxSize;
+    mutable std::mutex mMutex;
+    size_t mSize;
+    uint64_t mHits, mMisses, mStores, mEvictions;
+    // path -> modified, hash. Once mContentHashes is full it replaces
+    // mOldContentHashes, hits in there are moved back.
+    Hash<Path, std::pair<uint64_t, uint64_t> > mContentHashes, mOldContentHashes;
+};
+
+#endif
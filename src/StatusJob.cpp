@@ -18,11 +18,14 @@
 #include <clang-c/Index.h>
 
 #include "CompilerManager.h"
+#include "FileMapCache.h"
 #include "JobScheduler.h"
 #include "Project.h"
 #include "rct/Process.h"
 #include "RTags.h"
 #include "Server.h"
+#include "SharedCache.h"
+#include "SystemUnitStore.h"
 
 const char *StatusJob::delimiter = "*********************************";
 StatusJob::StatusJob(const std::shared_ptr<QueryMessage> &q, const std::shared_ptr<Project> &project)
@@ -36,7 +39,7 @@ int StatusJob::execute()
         return !strncasecmp(query.constData(), name, query.size());
     };
     bool matched = false;
-    const char *alternatives = "fileids|watchedpaths|dependencies|cursors|symbols|targets|symbolnames|sources|jobs|info|compilers|headererrors|memory|project";
+    const char *alternatives = "fileids|watchedpaths|dependencies|cursors|symbols|targets|symbolnames|sources|jobs|filemapcache|sharedcache|systemunits|info|compilers|headererrors|memory|project";
 
     if (match("fileids")) {
         matched = true;
@@ -79,6 +82,13 @@ int StatusJob::execute()
             << "dataDir: " << opt.dataDir << '\n'
             << "options: " << opt.options
             << "jobCount: " << opt.jobCount << '\n'
+            << "queryThreadCount: " << opt.queryThreadCount << '\n'
+            << "persistentFileMapCacheSize: " << opt.persistentFileMapCacheSize << '\n'
+            << "rpWorkerJobs: " << opt.rpWorkerJobs << '\n'
+            << "rpWorkerMaxRss: " << opt.rpWorkerMaxRss << '\n'
+            << "sharedCacheDir: " << opt.sharedCacheDir << '\n'
+            << "sharedCacheSize: " << opt.sharedCacheSize << '\n'
+            << "jobMemoryBudget: " << opt.jobMemoryBudget << '\n'
             << "rpVisitFileTimeout: " << opt.rpVisitFileTimeout << '\n'
             << "rpIndexDataMessageTimeout: " << opt.rpIndexDataMessageTimeout << '\n'
             << "rpConnectTimeout: " << opt.rpConnectTimeout << '\n'
@@ -92,11 +102,38 @@ int StatusJob::execute()
 
     if (query.isEmpty() || match("jobs")) {
         matched = true;
-        if (!write(delimiter) || !write("jobs") || !write(delimiter))
+        if (!write(delimiter) || !write("jobs") || !write(delimiter) || !flush())
             return 1;
         Server::instance()->dumpJobs(connection());
     }
 
+    if (query.isEmpty() || match("filemapcache")) {
+        matched = true;
+        if (!write(delimiter) || !write("filemapcache") || !write(delimiter))
+            return 1;
+        const std::shared_ptr<FileMapCache> cache = Server::instance()->fileMapCache();
+        if (!write(cache ? cache->toString() : String("disabled")))
+            return 1;
+    }
+
+    if (query.isEmpty() || match("sharedcache")) {
+        matched = true;
+        if (!write(delimiter) || !write("sharedcache") || !write(delimiter))
+            return 1;
+        const std::shared_ptr<SharedCache> cache = Server::instance()->sharedCache();
+        if (!write(cache ? cache->toString() : String("disabled")))
+            return 1;
+    }
+
+    if (query.isEmpty() || match("systemunits")) {
+        matched = true;
+        if (!write(delimiter) || !write("systemunits") || !write(delimiter))
+            return 1;
+        const std::shared_ptr<SystemUnitStore> store = Server::instance()->systemUnitStore();
+        if (!write(store ? store->toString() : String("disabled")))
+            return 1;
+    }
+
     std::shared_ptr<Project> proj = project();
     if (!proj) {
         if (!matched)
@@ -133,6 +170,8 @@ int StatusJob::execute()
         matched = true;
         if (!write(delimiter) || !write("dependencies") || !write(delimiter))
             return 1;
+        if (!write("  " + proj->dependencyIndex().toString()))
+            return 1;
 
         for (auto it : deps) {
             write(proj->dumpDependencies(it.first));
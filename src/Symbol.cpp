@@ -163,22 +163,26 @@ String Symbol::toString(const std::shared_ptr<Project> &project,
     if ((cursorInfoFlags & IncludeParents && filterPiece("parent"))
         || (cursorInfoFlags & (IncludeContainingFunction) && filterPiece("cf"))
         || (cursorInfoFlags & (IncludeContainingFunctionLocation) && filterPiece("cfl"))) {
-        auto syms = project->openSymbols(location.fileId());
+        auto cores = project->openSymbolCores(location.fileId());
         uint32_t idx = -1;
-        if (syms) {
-            idx = syms->lowerBound(location);
+        if (cores) {
+            idx = cores->lowerBound(location);
             if (idx == std::numeric_limits<uint32_t>::max()) {
-                idx = syms->count() - 1;
+                idx = cores->count() - 1;
             }
         }
         const unsigned int line = location.line();
         const unsigned int column = location.column();
         while (idx-- > 0) {
-            const Symbol s = syms->valueAt(idx);
-            if (s.isDefinition()
-                && s.isContainer()
-                && comparePosition(line, column, s.startLine, s.startColumn) >= 0
-                && comparePosition(line, column, s.endLine, s.endColumn) <= 0) {
+            const SymbolCore core = cores->valueAt(idx);
+            if (core.isDefinition()
+                && core.isContainer()
+                && comparePosition(line, column, core.startLine, core.startColumn) >= 0
+                && comparePosition(line, column, core.endLine, core.endColumn) <= 0) {
+                auto syms = project->openSymbols(location.fileId());
+                if (!syms)
+                    break;
+                const Symbol s = syms->valueAt(idx);
                 if (cursorInfoFlags & IncludeContainingFunctionLocation)
                     writePiece("Containing function location", "cfl", s.location.toString(locationToStringFlags));
                 if (cursorInfoFlags & IncludeContainingFunction)
@@ -261,6 +265,16 @@ bool Symbol::isContainer() const
     return RTags::isContainer(kind);
 }
 
+bool SymbolCore::isReference() const
+{
+    return RTags::isReference(kind) || (linkage == CXLinkage_External && !isDefinition() && !RTags::isFunction(kind));
+}
+
+bool SymbolCore::isContainer() const
+{
+    return RTags::isContainer(kind);
+}
+
 Value Symbol::toValue(const std::shared_ptr<Project> &project,
                       Flags<ToStringFlag> toStringFlags,
                       Flags<Location::ToStringFlag> locationToStringFlags,
@@ -420,22 +434,26 @@ Value Symbol::toValue(const std::shared_ptr<Project> &project,
             if ((f & IncludeParents && filterPiece("parent"))
                 || (f & (IncludeContainingFunction) && filterPiece("cf"))
                 || (f & (IncludeContainingFunctionLocation) && (filterPiece("cfl") || filterPiece("cflcontext")))) {
-                auto syms = project->openSymbols(symbol.location.fileId());
+                auto cores = project->openSymbolCores(symbol.location.fileId());
                 uint32_t idx = -1;
-                if (syms) {
-                    idx = syms->lowerBound(symbol.location);
+                if (cores) {
+                    idx = cores->lowerBound(symbol.location);
                     if (idx == std::numeric_limits<uint32_t>::max()) {
-                        idx = syms->count() - 1;
+                        idx = cores->count() - 1;
                     }
                 }
                 const unsigned int line = symbol.location.line();
                 const unsigned int column = symbol.location.column();
                 while (idx-- > 0) {
-                    const Symbol s = syms->valueAt(idx);
-                    if (s.isDefinition()
-                        && s.isContainer()
-                        && comparePosition(line, column, s.startLine, s.startColumn) >= 0
-                        && comparePosition(line, column, s.endLine, s.endColumn) <= 0) {
+                    const SymbolCore core = cores->valueAt(idx);
+                    if (core.isDefinition()
+                        && core.isContainer()
+                        && comparePosition(line, column, core.startLine, core.startColumn) >= 0
+                        && comparePosition(line, column, core.endLine, core.endColumn) <= 0) {
+                        auto syms = project->openSymbols(symbol.location.fileId());
+                        if (!syms)
+                            break;
+                        const Symbol s = syms->valueAt(idx);
                         if (f & IncludeContainingFunctionLocation) {
                             formatLocation(s.location, "cfl", "cflcontext");
                         }
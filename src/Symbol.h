@@ -247,6 +247,67 @@ template <> inline Deserializer &operator>>(Deserializer &s, Symbol &t)
     return s;
 }
 
+/*
+ * The fixed size part of a Symbol. Stored in its own FileMap, in the same
+ * order as the full Symbols, so lookups that only need position, kind and
+ * flags can use the FixedSize fast path instead of decoding strings, comments
+ * and argument lists.
+ */
+struct SymbolCore
+{
+    SymbolCore()
+        : enumValue(0), startLine(-1), endLine(-1), kind(CXCursor_FirstInvalid), type(CXType_Invalid),
+          symbolLength(0), flags(Symbol::None), startColumn(-1), endColumn(-1), size(0),
+          fieldOffset(-1), alignment(-1), linkage(CXLinkage_Invalid)
+    {}
+    explicit SymbolCore(const Symbol &symbol)
+        : location(symbol.location), enumValue(symbol.enumValue), startLine(symbol.startLine),
+          endLine(symbol.endLine), kind(symbol.kind), type(symbol.type), symbolLength(symbol.symbolLength),
+          flags(symbol.flags), startColumn(symbol.startColumn), endColumn(symbol.endColumn),
+          size(symbol.size), fieldOffset(symbol.fieldOffset), alignment(symbol.alignment),
+          linkage(symbol.linkage)
+    {}
+
+    Location location;
+    union {
+        int32_t stackCost;
+        int64_t enumValue;
+    };
+    int32_t startLine, endLine;
+    CXCursorKind kind;
+    CXTypeKind type;
+    uint16_t symbolLength, flags;
+    int16_t startColumn, endColumn;
+    uint16_t size;
+    int16_t fieldOffset, alignment;
+    uint16_t linkage; // CXLinkageKind, kept small so there's no padding
+
+    bool isNull() const { return location.isNull() || clang_isInvalid(kind); }
+    bool isReference() const;
+    bool isContainer() const;
+    inline bool isDefinition() const { return flags & Symbol::Definition; }
+    String kindSpelling() const { return Symbol::kindSpelling(kind); }
+};
+
+static_assert(sizeof(SymbolCore) == 48, "SymbolCore is written to disk as is and must not contain padding");
+
+template <> struct FixedSize<SymbolCore>
+{
+    static constexpr size_t value = sizeof(SymbolCore);
+};
+
+template <> inline Serializer &operator<<(Serializer &s, const SymbolCore &t)
+{
+    s.write(reinterpret_cast<const char*>(&t), sizeof(SymbolCore));
+    return s;
+}
+
+template <> inline Deserializer &operator>>(Deserializer &s, SymbolCore &t)
+{
+    s.read(reinterpret_cast<char*>(&t), sizeof(SymbolCore));
+    return s;
+}
+
 static inline Log operator<<(Log dbg, const Symbol &symbol)
 {
     const String out = "Symbol(" + symbol.toString() + ")";
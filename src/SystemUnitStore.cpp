@@ -0,0 +1,102 @@
+/* This file is part of RTags (http://rtags.net).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include "SystemUnitStore.h"
+
+#include <unistd.h>
+
+#include "FileMap.h"
+#include "Location.h"
+#include "rct/Log.h"
+#include "RTags.h"
+
+SystemUnitStore::SystemUnitStore(const Path &dir)
+    : mDir(dir.ensureTrailingSlash()), mHits(0), mMisses(0), mPublished(0)
+{
+    Path::mkdir(mDir, Path::Recursive);
+}
+
+uint64_t SystemUnitStore::key(const SourceList &sources)
+{
+    // Only what a system header can see. The project's own include paths
+    // and warning flags differ between projects that parse the same
+    // headers the same way.
+    String key = String::format<16>("%d\n", RTags::DatabaseVersion);
+    for (const Source &source : sources) {
+        key << source.compiler() << ' ' << Source::languageName(source.language)
+            << ' ' << String::number(source.flags.cast<unsigned int>()) << ' ' << source.sysRoot();
+        for (const Source::Define &define : source.defines)
+            key << ' ' << define.toString();
+        for (const Source::Include &include : source.includePaths) {
+            switch (include.type) {
+            case Source::Include::Type_System:
+            case Source::Include::Type_SystemFramework:
+            case Source::Include::Type_FileInclude:
+                key << ' ' << include.toString();
+                break;
+            default:
+                break;
+            }
+        }
+        for (const String &arg : source.arguments) {
+            if (arg.startsWith("-std=") || arg.startsWith("-f") || arg.startsWith("-m") || arg.startsWith("--target="))
+                key << ' ' << arg;
+        }
+        key << '\n';
+    }
+    return RTags::contentHash(key.constData(), key.size());
+}
+
+Path SystemUnitStore::unitFilePath(uint32_t fileId, uint64_t key) const
+{
+    return String::format<1024>("%s%016llx/%u", mDir.constData(), static_cast<unsigned long long>(key), fileId);
+}
+
+bool SystemUnitStore::isCurrent(uint32_t fileId, uint64_t key)
+{
+    const uint64_t unit = unitFilePath(fileId, key).lastModifiedMs();
+    if (unit && Location::path(fileId).lastModifiedMs() <= unit) {
+        ++mHits;
+        return true;
+    }
+    ++mMisses;
+    return false;
+}
+
+void SystemUnitStore::publish(uint32_t fileId, uint64_t key, const Path &unit)
+{
+    const Path path = unitFilePath(fileId, key);
+    if (path.lastModifiedMs() >= unit.lastModifiedMs())
+        return;
+    // Projects replace their unit files with rename(2) so the store keeps the
+    // inode it linked even after the project reindexes the header.
+    const Path tmp = fileMapTempPath(path);
+    unlink(tmp.constData());
+    if (link(unit.constData(), tmp.constData())) {
+        if (!Path::mkdir(path.parentDir(), Path::Recursive) || link(unit.constData(), tmp.constData())) {
+            warning() << "Failed to share" << unit << "as" << path << Rct::strerror();
+            return;
+        }
+    }
+    if (publishFileMap(path))
+        ++mPublished;
+}
+
+String SystemUnitStore::toString() const
+{
+    return String::format<256>("%s: %llu hits, %llu misses, %llu published", mDir.constData(),
+                               static_cast<unsigned long long>(mHits), static_cast<unsigned long long>(mMisses),
+                               static_cast<unsigned long long>(mPublished));
+}
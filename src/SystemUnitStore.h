@@ -0,0 +1,54 @@
+/* This file is part of RTags (http://rtags.net).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef SystemUnitStore_h
+#define SystemUnitStore_h
+
+#include <cstdint>
+
+#include "rct/Path.h"
+#include "rct/String.h"
+#include "Source.h"
+
+/*
+ * Unit files of system headers shared by all projects of one rdm. A header
+ * looks the same to every translation unit built with the same flags so a
+ * unit is stored under the fileId of the header and a key computed from the
+ * compiler, defines and system include paths of the job that indexed it.
+ * The first project to index a header links its unit in here, projects that
+ * come after use it instead of indexing the header themselves.
+ */
+class SystemUnitStore
+{
+public:
+    SystemUnitStore(const Path &dir);
+
+    static uint64_t key(const SourceList &sources);
+    Path unitFilePath(uint32_t fileId, uint64_t key) const;
+
+    // True if there's a unit for fileId that was written after the header
+    // was last modified
+    bool isCurrent(uint32_t fileId, uint64_t key);
+    // Shares a unit a project wrote. rp must not have seen the header change
+    // while it was parsing.
+    void publish(uint32_t fileId, uint64_t key, const Path &unit);
+
+    String toString() const;
+private:
+    const Path mDir;
+    uint64_t mHits, mMisses, mPublished;
+};
+
+#endif
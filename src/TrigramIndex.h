@@ -0,0 +1,119 @@
+/* This file is part of RTags (http://rtags.net).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef TrigramIndex_h
+#define TrigramIndex_h
+
+#include <ctype.h>
+#include <algorithm>
+#include <iterator>
+#include <memory>
+
+#include "FileMap.h"
+#include "rct/List.h"
+#include "rct/Map.h"
+#include "rct/Path.h"
+#include "rct/String.h"
+
+/*
+ * Maps every lower cased trigram in the keys of a String keyed FileMap to the
+ * sorted indexes of the keys that contain it. Lets substring, wildcard and case
+ * insensitive searches look at candidate keys only. The index refers to key
+ * indexes so it has to be rewritten whenever the FileMap it was built from is.
+ */
+class TrigramIndex
+{
+public:
+    typedef FileMap<uint32_t, List<uint32_t> > IndexMap;
+
+    static uint32_t trigram(const char *str)
+    {
+        return ((static_cast<uint32_t>(tolower(static_cast<unsigned char>(str[0]))) << 16)
+                | (static_cast<uint32_t>(tolower(static_cast<unsigned char>(str[1]))) << 8)
+                | static_cast<uint32_t>(tolower(static_cast<unsigned char>(str[2]))));
+    }
+
+    template <typename Value>
+    static bool write(const Path &path, const FileMap<String, Value> &names)
+    {
+        Map<uint32_t, List<uint32_t> > postings;
+        const auto keys = names.keyViews();
+        for (auto key = keys.begin(); key != keys.end(); ++key) {
+            const StringView name = *key;
+            for (size_t i=0; i + 3 <= name.size(); ++i) {
+                List<uint32_t> &list = postings[trigram(name.data() + i)];
+                if (list.isEmpty() || list.last() != key.index())
+                    list.append(key.index());
+            }
+        }
+        return IndexMap::write(path, postings);
+    }
+
+    bool load(const Path &path, String *error = 0)
+    {
+        std::shared_ptr<IndexMap> fileMap = std::make_shared<IndexMap>();
+        if (!fileMap->load(path, error)) {
+            mFileMap.reset();
+            return false;
+        }
+        mFileMap = fileMap;
+        return true;
+    }
+
+    void clear() { mFileMap.reset(); }
+    bool isValid() const { return mFileMap.get(); }
+
+    /*
+     * Finds the indexes of the keys that may match pattern, either as a
+     * substring or, if wildcard is set, as a Rct::wildCmp pattern. Returns
+     * false if pattern has no literal run of at least three characters in
+     * which case every key is a candidate.
+     */
+    bool candidates(const String &pattern, bool wildcard, List<uint32_t> &out) const
+    {
+        out.clear();
+        if (!mFileMap)
+            return false;
+        bool found = false;
+        const char *str = pattern.constData();
+        const size_t size = pattern.size();
+        size_t start = 0;
+        while (start < size) {
+            size_t end = start;
+            while (end < size && !(wildcard && (str[end] == '*' || str[end] == '?')))
+                ++end;
+            for (size_t i=start; i + 3 <= end; ++i) {
+                const List<uint32_t> postings = mFileMap->value(trigram(str + i));
+                if (!found) {
+                    out = postings;
+                    found = true;
+                } else {
+                    List<uint32_t> intersection;
+                    std::set_intersection(out.begin(), out.end(), postings.begin(), postings.end(),
+                                          std::back_inserter(intersection));
+                    out = std::move(intersection);
+                }
+                if (out.isEmpty())
+                    return true;
+            }
+            start = end + 1;
+        }
+        return found;
+    }
+private:
+    std::shared_ptr<IndexMap> mFileMap;
+};
+
+#endif
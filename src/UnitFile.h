@@ -0,0 +1,247 @@
+/* This file is part of RTags (http://rtags.net).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef UnitFile_h
+#define UnitFile_h
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <memory>
+
+#include "FileMap.h"
+#include "rct/Map.h"
+#include "rct/Path.h"
+#include "rct/String.h"
+
+/*
+ * All the FileMaps rp writes for one indexed file packed into a single file
+ * that is written once and mapped once. Each FileMap views its section of the
+ * shared mapping.
+ *
+ * uint32_t magic, uint32_t version, uint32_t generation, uint32_t section count
+ * { uint32_t section, uint32_t offset, uint32_t size } for each section
+ * section data, each section starting at a multiple of 8
+ *
+ * The generation is one more than that of the unit file it replaces so it
+ * identifies what is on disk across restarts, see Project::fileMapGeneration().
+ */
+class UnitFile : public std::enable_shared_from_this<UnitFile>
+{
+public:
+    enum { Magic = 0x50555452, Version = 2, HeaderSize = sizeof(uint32_t) * 4 };
+    enum Section {
+        Symbols,
+        SymbolCores,
+        SymbolNames,
+        Targets,
+        Usrs,
+        Tokens,
+        Info,
+        UsrsFilter
+    };
+
+    UnitFile()
+        : mPointer(0), mSize(0), mMapped(false), mGeneration(0)
+    {}
+
+    ~UnitFile()
+    {
+        if (mMapped)
+            munmap(const_cast<char*>(mPointer), mSize);
+    }
+
+    static size_t write(const Path &path, const Map<Section, String> &sections, uint32_t options = FileMap<int, int>::None)
+    {
+        const uint32_t headerSize = HeaderSize + (sizeof(uint32_t) * sections.size() * 3);
+        String header;
+        header.reserve(headerSize);
+        auto append = [&header](uint32_t value) { header.append(reinterpret_cast<const char*>(&value), sizeof(value)); };
+        append(Magic);
+        append(Version);
+        append(readGeneration(path) + 1);
+        append(sections.size());
+        uint32_t offset = align(headerSize);
+        for (const auto &section : sections) {
+            append(section.first);
+            append(offset);
+            append(section.second.size());
+            offset = align(offset + section.second.size());
+        }
+
+        const Path tmp = fileMapTempPath(path);
+        int fd = open(tmp.constData(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+        if (fd == -1) {
+            if (!Path::mkdir(path.parentDir(), Path::Recursive))
+                return 0;
+            fd = open(tmp.constData(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+            if (fd == -1)
+                return 0;
+        }
+        static const char padding[8] = { 0 };
+        bool ok = ::write(fd, header.constData(), header.size()) == static_cast<ssize_t>(header.size());
+        size_t written = header.size();
+        for (auto it = sections.begin(); ok && it != sections.end(); ++it) {
+            const size_t pad = align(written) - written;
+            ok = !pad || ::write(fd, padding, pad) == static_cast<ssize_t>(pad);
+            ok = ok && ::write(fd, it->second.constData(), it->second.size()) == static_cast<ssize_t>(it->second.size());
+            written += pad + it->second.size();
+        }
+        ::close(fd);
+        if (!ok) {
+            unlink(tmp.constData());
+            return 0;
+        }
+        if (!(options & FileMap<int, int>::DontPublish) && !publishFileMap(path))
+            return 0;
+        return written;
+    }
+
+    bool load(const Path &path, String *error = 0)
+    {
+        assert(!mPointer);
+        int fd;
+        eintrwrap(fd, open(path.constData(), O_RDONLY));
+        if (fd == -1) {
+            if (error)
+                *error = Rct::strerror();
+            return false;
+        }
+        struct stat st;
+        const char *pointer = static_cast<const char*>(MAP_FAILED);
+        if (!fstat(fd, &st) && st.st_size)
+            pointer = static_cast<const char*>(mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0));
+        if (pointer == MAP_FAILED && error)
+            *error = Rct::strerror();
+        int ret;
+        eintrwrap(ret, close(fd));
+        if (pointer == MAP_FAILED)
+            return false;
+        mPointer = pointer;
+        mSize = st.st_size;
+        mMapped = true;
+        return parse(error);
+    }
+
+    // Reads a unit file from memory, e.g. out of the shared cache
+    bool load(const String &data, String *error = 0)
+    {
+        assert(!mPointer);
+        mData = data;
+        mPointer = mData.constData();
+        mSize = mData.size();
+        return parse(error);
+    }
+
+    bool contains(Section section) const { return mSections.contains(section); }
+    size_t size() const { return mSize; }
+    uint32_t generation() const { return mGeneration; }
+
+    // Returns 0 if there is no readable unit file at path
+    static uint32_t readGeneration(const Path &path)
+    {
+        int fd;
+        eintrwrap(fd, open(path.constData(), O_RDONLY));
+        if (fd == -1)
+            return 0;
+        uint32_t header[4] = { 0, 0, 0, 0 };
+        const bool ok = ::read(fd, header, sizeof(header)) == sizeof(header);
+        int ret;
+        eintrwrap(ret, close(fd));
+        return ok && header[0] == Magic && header[1] == Version ? header[2] : 0;
+    }
+
+    // Unit files rp --remote sends back were numbered on the remote machine
+    static bool setGeneration(String &data, uint32_t generation)
+    {
+        uint32_t header[2] = { 0, 0 };
+        if (data.size() >= HeaderSize)
+            memcpy(header, data.constData(), sizeof(header));
+        if (header[0] != Magic || header[1] != Version)
+            return false;
+        memcpy(data.data() + (sizeof(uint32_t) * 2), &generation, sizeof(generation));
+        return true;
+    }
+
+    String section(Section section) const
+    {
+        const auto it = mSections.find(section);
+        if (it == mSections.end())
+            return String();
+        return String(mPointer + it->second.first, it->second.second);
+    }
+
+    // The FileMap keeps the mapping alive
+    template <typename Key, typename Value>
+    bool open(Section section, FileMap<Key, Value> &fileMap, String *error = 0) const
+    {
+        const auto it = mSections.find(section);
+        if (it == mSections.end() || it->second.second < sizeof(uint32_t) * 2) {
+            if (error)
+                *error = String::format<64>("No section %d", section);
+            return false;
+        }
+        fileMap.init(mPointer + it->second.first, it->second.second, shared_from_this());
+        return true;
+    }
+
+    template <typename Key, typename Value>
+    static bool load(const Path &path, Section section, FileMap<Key, Value> &fileMap, String *error = 0)
+    {
+        std::shared_ptr<UnitFile> unit = std::make_shared<UnitFile>();
+        return unit->load(path, error) && unit->open(section, fileMap, error);
+    }
+private:
+    static uint32_t align(size_t offset) { return (offset + 7) & ~static_cast<size_t>(7); }
+
+    bool parse(String *error)
+    {
+        uint32_t header[4] = { 0, 0, 0, 0 };
+        if (mSize >= sizeof(header))
+            memcpy(header, mPointer, sizeof(header));
+        if (header[0] != Magic || header[1] != Version) {
+            if (error)
+                *error = "Bad unit file header";
+            return false;
+        }
+        mGeneration = header[2];
+        const uint32_t count = header[3];
+        if (mSize < HeaderSize + (sizeof(uint32_t) * count * 3)) {
+            if (error)
+                *error = "Truncated unit file";
+            return false;
+        }
+        for (uint32_t i=0; i<count; ++i) {
+            uint32_t entry[3];
+            memcpy(entry, mPointer + HeaderSize + (sizeof(uint32_t) * i * 3), sizeof(entry));
+            if (static_cast<size_t>(entry[1]) + entry[2] > mSize) {
+                if (error)
+                    *error = "Truncated unit file";
+                return false;
+            }
+            mSections[static_cast<Section>(entry[0])] = std::make_pair(entry[1], entry[2]);
+        }
+        return true;
+    }
+
+    const char *mPointer;
+    size_t mSize;
+    bool mMapped;
+    uint32_t mGeneration;
+    String mData;
+    Map<Section, std::pair<uint32_t, uint32_t> > mSections;
+};
+
+#endif
@@ -0,0 +1,165 @@
+/* This file is part of RTags (http://rtags.net).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <http://www.gnu.org/licenses/>. */
+
+
+#ifndef UsrFilter_h
+#define UsrFilter_h
+
+#include <string.h>
+#include <cstdint>
+
+#include "rct/Hash.h"
+#include "rct/List.h"
+#include "rct/Set.h"
+#include "rct/String.h"
+#include "RTags.h"
+
+/*
+ * Bloom filter over the usrs a unit declares or refers to, the keys of its
+ * Usrs and Targets sections. Each usr sets Probes bits in a single 64 bit
+ * word picked by its hash so testing a file touches one word.
+ *
+ * uint32_t word count (a power of 2), padding, uint64_t words[]
+ */
+class UsrFilter
+{
+public:
+    enum {
+        BitsPerUsr = 12,
+        Probes = 4
+    };
+
+    static uint64_t hash(const String &usr) { return RTags::contentHash(usr.constData(), usr.size()); }
+
+    static String create(const List<uint64_t> &hashes)
+    {
+        uint32_t count = 1;
+        while (count * 64 < hashes.size() * BitsPerUsr)
+            count <<= 1;
+        String ret(sizeof(uint64_t) * (count + 1), '\0');
+        memcpy(ret.data(), &count, sizeof(count));
+        uint64_t *words = reinterpret_cast<uint64_t*>(ret.data() + sizeof(uint64_t));
+        for (uint64_t h : hashes)
+            words[h & (count - 1)] |= mask(h);
+        return ret;
+    }
+
+    static uint64_t mask(uint64_t hash)
+    {
+        uint64_t ret = 0;
+        for (int i=0; i<Probes; ++i)
+            ret |= 1ull << ((hash >> (32 + (i * 6))) & 63);
+        return ret;
+    }
+};
+
+/*
+ * The filters of all the files of a project in one array. Files without a
+ * filter, e.g. units written before rp made them, might contain anything.
+ */
+class UsrFilters
+{
+public:
+    UsrFilters()
+        : mUnused(0)
+    {}
+
+    bool set(uint32_t fileId, const String &filter)
+    {
+        uint32_t count = 0;
+        if (filter.size() >= sizeof(uint64_t))
+            memcpy(&count, filter.constData(), sizeof(count));
+        if (!count || (count & (count - 1)) || filter.size() != sizeof(uint64_t) * (count + 1)) {
+            remove(fileId);
+            return false;
+        }
+        std::pair<uint32_t, uint32_t> &range = mRanges[fileId];
+        if (range.second != count) {
+            mUnused += range.second;
+            range = std::make_pair(mWords.size(), count);
+            mWords.resize(mWords.size() + count);
+        }
+        memcpy(&mWords[range.first], filter.constData() + sizeof(uint64_t), sizeof(uint64_t) * count);
+        if (mUnused > mWords.size() / 2)
+            compact();
+        return true;
+    }
+
+    void remove(uint32_t fileId)
+    {
+        const auto it = mRanges.find(fileId);
+        if (it != mRanges.end()) {
+            mUnused += it->second.second;
+            mRanges.erase(it);
+        }
+    }
+
+    void clear()
+    {
+        mWords.clear();
+        mRanges.clear();
+        mUnused = 0;
+    }
+
+    bool contains(uint32_t fileId) const { return mRanges.contains(fileId); }
+
+    bool mightContain(uint32_t fileId, uint64_t hash) const
+    {
+        const auto it = mRanges.find(fileId);
+        if (it == mRanges.end())
+            return true;
+        const uint64_t mask = UsrFilter::mask(hash);
+        return (mWords.at(it->second.first + (hash & (it->second.second - 1))) & mask) == mask;
+    }
+
+    // Drops the files that can't have usr
+    size_t filter(Set<uint32_t> &files, const String &usr) const
+    {
+        const uint64_t hash = UsrFilter::hash(usr);
+        size_t removed = 0;
+        auto it = files.begin();
+        while (it != files.end()) {
+            if (!mightContain(*it, hash)) {
+                files.erase(it++);
+                ++removed;
+            } else {
+                ++it;
+            }
+        }
+        return removed;
+    }
+
+    size_t count() const { return mRanges.size(); }
+    size_t memoryUsage() const { return mWords.capacity() * sizeof(uint64_t); }
+private:
+    void compact()
+    {
+        List<uint64_t> words;
+        words.reserve(mWords.size() - mUnused);
+        for (auto &range : mRanges) {
+            const uint32_t offset = words.size();
+            words.insert(words.end(), mWords.begin() + range.second.first, mWords.begin() + range.second.first + range.second.second);
+            range.second.first = offset;
+        }
+        mWords = std::move(words);
+        mUnused = 0;
+    }
+
+    List<uint64_t> mWords;
+    Hash<uint32_t, std::pair<uint32_t, uint32_t> > mRanges; // fileId -> offset and word count in mWords
+    size_t mUnused;
+};
+
+#endif
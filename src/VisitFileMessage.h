@@ -16,26 +16,35 @@
 #ifndef VisitFileMessage_h
 #define VisitFileMessage_h
 
+#include "rct/List.h"
 #include "RTagsMessage.h"
 
+// Claims one or more files for the job indexing sourceFileId, answered with a
+// VisitFileResponseMessage that has an entry for each file in the same order.
+// jobId tells a job that was restarted from one that is still running on a
+// remote worker.
 class VisitFileMessage : public RTagsMessage
 {
 public:
     enum { MessageId = VisitFileId };
 
-    VisitFileMessage(const Path &file = Path(), const Path &project = Path(), uint32_t sourceFileId = 0)
-        : RTagsMessage(MessageId), mFile(file), mProject(project), mSourceFileId(sourceFileId)
+    VisitFileMessage(const List<Path> &files = List<Path>(), const Path &project = Path(),
+                     uint32_t sourceFileId = 0, uint64_t jobId = 0)
+        : RTagsMessage(MessageId), mFiles(files), mProject(project), mSourceFileId(sourceFileId), mJobId(jobId)
     {
     }
 
     Path project() const { return mProject; }
-    Path file() const { return mFile; }
+    const List<Path> &files() const { return mFiles; }
     uint32_t sourceFileId() const { return mSourceFileId; }
-    void encode(Serializer &serializer) const { serializer << mProject << mFile << mSourceFileId; }
-    void decode(Deserializer &deserializer) { deserializer >> mProject >> mFile >> mSourceFileId; }
+    uint64_t jobId() const { return mJobId; }
+    void encode(Serializer &serializer) const { serializer << mProject << mFiles << mSourceFileId << mJobId; }
+    void decode(Deserializer &deserializer) { deserializer >> mProject >> mFiles >> mSourceFileId >> mJobId; }
 private:
-    Path mFile, mProject;
+    List<Path> mFiles;
+    Path mProject;
     uint32_t mSourceFileId;
+    uint64_t mJobId;
 };
 
 #endif
@@ -16,6 +16,7 @@
 #ifndef VisitFileResponseMessage_h
 #define VisitFileResponseMessage_h
 
+#include "rct/List.h"
 #include "RTagsMessage.h"
 
 class VisitFileResponseMessage : public RTagsMessage
@@ -23,19 +24,21 @@ class VisitFileResponseMessage : public RTagsMessage
 public:
     enum { MessageId = VisitFileResponseId };
 
-    VisitFileResponseMessage(uint32_t fileId = 0, bool visit = false)
-        : RTagsMessage(MessageId), mFileId(fileId), mVisit(visit)
+    // fileId and whether the job should index the file, fileId is 0 if the
+    // job is no longer active
+    typedef List<std::pair<uint32_t, bool> > Files;
+
+    VisitFileResponseMessage(const Files &files = Files())
+        : RTagsMessage(MessageId), mFiles(files)
     {
     }
 
-    uint32_t fileId() const { return mFileId; }
-    bool visit() const { return mVisit; }
+    const Files &files() const { return mFiles; }
 
-    void encode(Serializer &serializer) const { serializer << mFileId << mVisit; }
-    void decode(Deserializer &deserializer) { deserializer >> mFileId >> mVisit; }
+    void encode(Serializer &serializer) const { serializer << mFiles; }
+    void decode(Deserializer &deserializer) { deserializer >> mFiles; }
 private:
-    uint32_t mFileId;
-    bool mVisit;
+    Files mFiles;
 };
 
 #endif
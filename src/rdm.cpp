@@ -79,6 +79,8 @@ static void signalHandler(int signal)
 #define DEFAULT_COMPILER_WRAPPERS "ccache"
 #define DEFAULT_RP_VISITFILE_TIMEOUT 60000
 #define DEFAULT_RDM_MAX_FILE_MAP_CACHE_SIZE 500
+#define DEFAULT_RDM_PERSISTENT_FILE_MAP_CACHE_SIZE 256
+#define DEFAULT_RDM_SHARED_CACHE_SIZE 1024
 #define DEFAULT_RP_INDEXER_MESSAGE_TIMEOUT 60000
 #define DEFAULT_RP_CONNECT_TIMEOUT 0 // won't time out
 #define DEFAULT_RP_CONNECT_ATTEMPTS 3
@@ -206,6 +208,16 @@ enum OptionType {
     SandboxRoot,
     PollTimer,
     NoRealPath,
+    QueryThreadCount,
+    PersistentFileMapCacheSize,
+    RpWorkerJobs,
+    RpWorkerMaxRss,
+    SharedCacheDir,
+    SharedCacheSize,
+    JobMemoryBudget,
+    TwoPhaseIndexing,
+    SharedSystemHeaders,
+    FileIdsFsync,
     Noop
 };
 
@@ -239,6 +251,8 @@ int main(int argc, char** argv)
     serverOpts.rpConnectTimeout = DEFAULT_RP_CONNECT_TIMEOUT;
     serverOpts.rpConnectAttempts = DEFAULT_RP_CONNECT_ATTEMPTS;
     serverOpts.maxFileMapScopeCacheSize = DEFAULT_RDM_MAX_FILE_MAP_CACHE_SIZE;
+    serverOpts.persistentFileMapCacheSize = DEFAULT_RDM_PERSISTENT_FILE_MAP_CACHE_SIZE;
+    serverOpts.sharedCacheSize = DEFAULT_RDM_SHARED_CACHE_SIZE;
     serverOpts.errorLimit = DEFAULT_ERROR_LIMIT;
     serverOpts.rpNiceValue = INT_MIN;
     serverOpts.options = Server::Wall|Server::SpellChecking;
@@ -332,7 +346,7 @@ int main(int argc, char** argv)
         { NoFileManagerWatch, "no-filemanager-watch", 'M', CommandLineParser::NoValue, "Don't use a file system watcher for filemanager." },
 #endif
         { NoFileManager, "no-filemanager", 0, CommandLineParser::NoValue, "Don't scan project directory for files. (rc -P won't work)." },
-        { NoFileLock, "no-file-lock", 0, CommandLineParser::NoValue, "Disable file locking. Not entirely safe but might improve performance on certain systems." },
+        { NoFileLock, "no-file-lock", 0, CommandLineParser::NoValue, "Ignored. File maps are published atomically and never locked." },
         { PchEnabled, "pch-enabled", 0, CommandLineParser::NoValue, "Enable PCH (experimental)." },
         { NoFilesystemWatcher, "no-filesystem-watcher", 'B', CommandLineParser::NoValue, "Disable file system watching altogether. Reindexing has to be triggered manually." },
         { ArgTransform, "arg-transform", 'V', CommandLineParser::Required, "Use arg to transform arguments. [arg] should be executable with (execv(3))." },
@@ -346,13 +360,23 @@ int main(int argc, char** argv)
         { WatchSourcesOnly, "watch-sources-only", 0, CommandLineParser::NoValue, "Only watch source files (not dependencies)." },
         { DebugLocations, "debug-locations", 0, CommandLineParser::NoValue, "Set debug locations." },
         { ValidateFileMaps, "validate-file-maps", 0, CommandLineParser::NoValue, "Spend some time validating project data on startup." },
-        { TcpPort, "tcp-port", 0, CommandLineParser::Required, "Listen on this tcp socket (default none)." },
+        { TcpPort, "tcp-port", 0, CommandLineParser::Required, "Listen on this tcp socket (default none). rp --remote <host>:<port> connects here to run jobs for this rdm." },
         { RpPath, "rp-path", 0, CommandLineParser::Required, String::format<256>("Path to rp (default %s).", defaultRP().constData()) },
         { LogTimestamp, "log-timestamp", 0, CommandLineParser::NoValue, "Add timestamp to logs." },
         { LogFlushOption, "log-flush", 0, CommandLineParser::NoValue, "Flush stderr/stdout after each log." },
         { SandboxRoot, "sandbox-root",  0, CommandLineParser::Required, "Create index using relative paths by stripping dir (enables copying of tag index db files without need to reindex)." },
         { PollTimer, "poll-timer", 0, CommandLineParser::Required, "Poll the database of the current project every <arg> seconds. " },
         { NoRealPath, "no-realpath", 0, CommandLineParser::NoValue, "Don't use realpath(3) for files" },
+        { QueryThreadCount, "query-thread-count", 0, CommandLineParser::Required, "Run symbol/reference queries on a pool of <arg> threads instead of the main thread. Each running query may keep up to --max-file-map-cache-size files open (default 0, disabled)." },
+        { PersistentFileMapCacheSize, "persistent-file-map-cache-size", 0, CommandLineParser::Required, "Keep up to <arg> megabytes of file maps mapped between queries, 0 disables (default " STR(DEFAULT_RDM_PERSISTENT_FILE_MAP_CACHE_SIZE) ")." },
+        { RpWorkerJobs, "rp-worker-jobs", 0, CommandLineParser::Required, "Keep rp processes running between jobs and replace them after <arg> jobs, 0 starts one rp per job (default 0)." },
+        { RpWorkerMaxRss, "rp-worker-max-rss", 0, CommandLineParser::Required, "Replace a running rp once its peak RSS reaches <arg> megabytes, 0 means no limit (default 0). Only used with --rp-worker-jobs." },
+        { SharedCacheDir, "shared-cache-dir", 0, CommandLineParser::Required, "Share index results for identical translation units with other rdms through this directory (default none)." },
+        { SharedCacheSize, "shared-cache-size", 0, CommandLineParser::Required, "Evict the least recently used entries once the shared cache exceeds <arg> megabytes (default " STR(DEFAULT_RDM_SHARED_CACHE_SIZE) ")." },
+        { JobMemoryBudget, "job-memory-budget", 0, CommandLineParser::Required, "Hold off on starting rp jobs that would take the running ones above <arg> megabytes, going by what each source needed last time. 0 means no limit (default 0)." },
+        { TwoPhaseIndexing, "two-phase-indexing", 0, CommandLineParser::NoValue, "Index new sources in two passes. The first skips function bodies and only indexes declarations, the second, queued behind the remaining first passes, fills in references and tokens." },
+        { SharedSystemHeaders, "shared-system-headers", 0, CommandLineParser::NoValue, "Index each system header once for all projects built with the same flags instead of once per project." },
+        { FileIdsFsync, "fileids-fsync", 0, CommandLineParser::Required, "When to fsync the file ids database: never, compaction (when the journal of new ids is folded into the snapshot) or always (after every append to the journal) (default compaction)." },
         { Noop, "config", 'c', CommandLineParser::Required, "Use this file (instead of ~/.rdmrc)." },
         { Noop, "no-rc", 'N', CommandLineParser::NoValue, "Don't load any rc files." }
     };
@@ -443,6 +467,69 @@ int main(int argc, char** argv)
                 return { String::format<1024>("Invalid argument to --poll-timer %s", value.constData()), CommandLineParser::Parse_Error };
             }
             break; }
+        case QueryThreadCount: {
+            bool ok;
+            serverOpts.queryThreadCount = String(value).toLong(&ok);
+            if (!ok || serverOpts.queryThreadCount < 0) {
+                return { String::format<1024>("Invalid argument to --query-thread-count %s", value.constData()), CommandLineParser::Parse_Error };
+            }
+            break; }
+        case PersistentFileMapCacheSize: {
+            bool ok;
+            serverOpts.persistentFileMapCacheSize = String(value).toLong(&ok);
+            if (!ok || serverOpts.persistentFileMapCacheSize < 0) {
+                return { String::format<1024>("Invalid argument to --persistent-file-map-cache-size %s", value.constData()), CommandLineParser::Parse_Error };
+            }
+            break; }
+        case RpWorkerJobs: {
+            bool ok;
+            serverOpts.rpWorkerJobs = String(value).toLong(&ok);
+            if (!ok || serverOpts.rpWorkerJobs < 0) {
+                return { String::format<1024>("Invalid argument to --rp-worker-jobs %s", value.constData()), CommandLineParser::Parse_Error };
+            }
+            break; }
+        case RpWorkerMaxRss: {
+            bool ok;
+            serverOpts.rpWorkerMaxRss = String(value).toLong(&ok);
+            if (!ok || serverOpts.rpWorkerMaxRss < 0) {
+                return { String::format<1024>("Invalid argument to --rp-worker-max-rss %s", value.constData()), CommandLineParser::Parse_Error };
+            }
+            break; }
+        case SharedCacheDir: {
+            serverOpts.sharedCacheDir = std::move(value);
+            serverOpts.sharedCacheDir.resolve();
+            break; }
+        case SharedCacheSize: {
+            bool ok;
+            serverOpts.sharedCacheSize = String(value).toLong(&ok);
+            if (!ok || serverOpts.sharedCacheSize <= 0) {
+                return { String::format<1024>("Invalid argument to --shared-cache-size %s", value.constData()), CommandLineParser::Parse_Error };
+            }
+            break; }
+        case JobMemoryBudget: {
+            bool ok;
+            serverOpts.jobMemoryBudget = String(value).toLong(&ok);
+            if (!ok || serverOpts.jobMemoryBudget < 0) {
+                return { String::format<1024>("Invalid argument to --job-memory-budget %s", value.constData()), CommandLineParser::Parse_Error };
+            }
+            break; }
+        case TwoPhaseIndexing: {
+            serverOpts.options |= Server::TwoPhaseIndexing;
+            break; }
+        case SharedSystemHeaders: {
+            serverOpts.options |= Server::SharedSystemHeaders;
+            break; }
+        case FileIdsFsync: {
+            if (value == "never") {
+                serverOpts.fileIdsFsync = Server::Fsync_Never;
+            } else if (value == "compaction") {
+                serverOpts.fileIdsFsync = Server::Fsync_Compaction;
+            } else if (value == "always") {
+                serverOpts.fileIdsFsync = Server::Fsync_Always;
+            } else {
+                return { String::format<1024>("Invalid argument to --fileids-fsync %s", value.constData()), CommandLineParser::Parse_Error };
+            }
+            break; }
         case CleanSlate: {
             serverOpts.options |= Server::ClearProjects;
             break; }
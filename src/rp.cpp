@@ -15,10 +15,16 @@
 
 #define RTAGS_SINGLE_THREAD
 #include <signal.h>
+#include <sys/resource.h>
 #include <syslog.h>
+#include <unistd.h>
 
 #include "ClangIndexer.h"
+#include "JobRequestMessage.h"
+#include "JobResponseMessage.h"
 #include "Project.h"
+#include "RClient.h"
+#include "rct/Connection.h"
 #include "rct/Log.h"
 #include "rct/StopWatch.h"
 #include "rct/String.h"
@@ -56,16 +62,121 @@ public:
     }
 };
 
+enum ReadResult {
+    ReadOk,
+    ReadEOF,
+    ReadError
+};
+
+static ReadResult readJob(String &data)
+{
+    uint32_t size;
+    if (!fread(&size, sizeof(size), 1, stdin))
+        return feof(stdin) ? ReadEOF : ReadError;
+    data.resize(size);
+    if (!fread(&data[0], size, 1, stdin))
+        return ReadError;
+    // FILE *f = fopen("/tmp/data", "w");
+    // fwrite(data.constData(), data.size(), 1, f);
+    // fclose(f);
+    return ReadOk;
+}
+
+static size_t peakRss()
+{
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage))
+        return 0;
+#ifdef OS_Darwin
+    return usage.ru_maxrss;
+#else
+    return usage.ru_maxrss * 1024;
+#endif
+}
+
+// Runs jobs for an rdm started with --tcp-port, one at a time. Run several
+// to index in parallel. The sources have to be at the same paths as on the
+// machine running rdm, e.g. on a shared mount.
+static int runRemoteWorker(const String &address, Path dataDir)
+{
+    const size_t colon = address.lastIndexOf(':');
+    const String host = colon == String::npos ? String("127.0.0.1") : address.left(colon);
+    const int port = atoi(address.constData() + (colon == String::npos ? 0 : colon + 1));
+    if (port <= 0 || port > 65535) {
+        error() << "Invalid --remote" << address << "expected <host>:<port>";
+        return 1;
+    }
+    if (dataDir.isEmpty())
+        dataDir = String::format<128>("/tmp/rp-remote-%d/", getpid());
+    dataDir = dataDir.ensureTrailingSlash();
+    if (!Path::mkdir(dataDir, Path::Recursive)) {
+        error() << "Can't create" << dataDir;
+        return 1;
+    }
+
+    std::shared_ptr<Connection> connection = Connection::create(RClient::NumOptions);
+    if (!connection->connectTcp(host, static_cast<uint16_t>(port), 10000)) {
+        error() << "Failed to connect to rdm on" << address;
+        return 1;
+    }
+    List<String> jobs;
+    bool waiting = false;
+    connection->newMessage().connect([&jobs, &waiting](const std::shared_ptr<Message> &message, const std::shared_ptr<Connection> &) {
+            if (message->messageId() == JobResponseMessage::MessageId) {
+                jobs.append(std::static_pointer_cast<JobResponseMessage>(message)->job());
+                if (waiting)
+                    EventLoop::eventLoop()->quit();
+            }
+        });
+    connection->disconnected().connect(std::bind([]() { EventLoop::eventLoop()->quit(); }));
+
+    char hostName[256];
+    if (gethostname(hostName, sizeof(hostName)))
+        strcpy(hostName, "unknown");
+    hostName[sizeof(hostName) - 1] = '\0';
+    const String name = String::format<320>("%s:%d", hostName, getpid());
+    while (connection->isConnected()) {
+        // The previous job has been acknowledged, ask for the next one
+        if (!connection->send(JobRequestMessage(name)))
+            break;
+        waiting = true;
+        while (jobs.isEmpty() && connection->isConnected())
+            EventLoop::eventLoop()->exec();
+        waiting = false;
+        if (jobs.isEmpty())
+            break;
+        ClangIndexer indexer(connection);
+        indexer.setRemoteDataDir(dataDir);
+        if (!indexer.exec(jobs.takeFirst()))
+            error() << "ClangIndexer error";
+    }
+    Path::rmdir(dataDir);
+    error() << "Lost connection to rdm on" << address;
+    return 0;
+}
+
 int main(int argc, char **argv)
 {
     LogLevel logLevel = LogLevel::Error;
     Path file;
+    int workerJobs = 0;
+    size_t workerMaxRss = 0;
+    String remote;
+    Path remoteDataDir;
 
     for (int i=1; i<argc; ++i) {
         if (!strcmp(argv[i], "-v") || !strcmp(argv[i], "--verbose")) {
             ++logLevel;
         } else if (!strcmp(argv[i], "--priority")) { // ignore, only for wrapping purposes
             ++i;
+        } else if (!strcmp(argv[i], "--worker-jobs") && i + 1 < argc) {
+            workerJobs = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--worker-max-rss") && i + 1 < argc) {
+            workerMaxRss = static_cast<size_t>(atol(argv[++i])) * 1024 * 1024;
+        } else if (!strcmp(argv[i], "--remote") && i + 1 < argc) {
+            remote = argv[++i];
+        } else if (!strcmp(argv[i], "--remote-data-dir") && i + 1 < argc) {
+            remoteDataDir = argv[++i];
         } else {
             file = argv[i];
         }
@@ -90,22 +201,45 @@ int main(int argc, char **argv)
     eventLoop->init(EventLoop::MainEventLoop);
     String data;
 
-    if (!file.isEmpty()) {
+    if (!remote.isEmpty()) {
+        return runRemoteWorker(remote, remoteDataDir);
+    } else if (!file.isEmpty()) {
         data = file.readAll();
+    } else if (workerJobs > 0) {
+        // Keep running jobs written to stdin by rdm over the same
+        // connection. The last job tells rdm not to send any more.
+        std::shared_ptr<Connection> connection = Connection::create(RClient::NumOptions);
+        for (int job=1; true; ++job) {
+            switch (readJob(data)) {
+            case ReadOk:
+                break;
+            case ReadEOF:
+                return 0;
+            case ReadError:
+                error() << "Failed to read from stdin";
+                return 2;
+            }
+            const bool last = job >= workerJobs || (workerMaxRss && peakRss() >= workerMaxRss);
+            ClangIndexer indexer(connection);
+            indexer.setWorkerExit(last);
+            if (!indexer.exec(data)) {
+                error() << "ClangIndexer error";
+                return 3;
+            }
+            if (last)
+                return 0;
+        }
     } else {
-        uint32_t size;
-        if (!fread(&size, sizeof(size), 1, stdin)) {
+        switch (readJob(data)) {
+        case ReadOk:
+            break;
+        case ReadEOF:
             error() << "Failed to read from stdin";
             return 1;
-        }
-        data.resize(size);
-        if (!fread(&data[0], size, 1, stdin)) {
+        case ReadError:
             error() << "Failed to read from stdin";
             return 2;
         }
-        // FILE *f = fopen("/tmp/data", "w");
-        // fwrite(data.constData(), data.size(), 1, f);
-        // fclose(f);
     }
     ClangIndexer indexer;
     if (!indexer.exec(data)) {
@@ -0,0 +1,61 @@
+#!/bin/bash
+
+# Indexes a few files with an rdm that doesn't spawn rp itself (-j 0) and a
+# handful of rp --remote workers on localhost, then checks every file got
+# indexed. Usage: remote-workers.sh [workers] [port]
+
+WORKERS=${1:-3}
+PORT=${2:-12526}
+DIR="$( cd "$( dirname "${BASH_SOURCE[0]}" )" && pwd )/remote-workers"
+
+rm -rf $DIR
+mkdir -p $DIR/data && cd $DIR && touch README
+
+for i in 1 2 3 4 5 6; do
+    cat << EOF > file$i.cpp
+#include <string>
+#include <vector>
+
+int function$i(const std::vector<std::string> &strings)
+{
+    return strings.size() + $i;
+}
+EOF
+done
+
+PIDS=
+cleanup()
+{
+    [ -n "$PIDS" ] && kill $PIDS 2>/dev/null
+    wait 2>/dev/null
+}
+trap cleanup EXIT
+
+rdm -j 0 --tcp-port $PORT -n $DIR/rdm.socket -d $DIR/data -o -L $DIR/rdm.log &
+PIDS="$PIDS $!"
+sleep 1
+
+for i in $(seq 1 $WORKERS); do
+    rp --remote 127.0.0.1:$PORT --remote-data-dir $DIR/worker$i 2> $DIR/worker$i.log &
+    PIDS="$PIDS $!"
+done
+
+for i in 1 2 3 4 5 6; do
+    rc -n $DIR/rdm.socket --compile "g++ -c $DIR/file$i.cpp"
+done
+
+sleep 1
+while [ "$(rc -n $DIR/rdm.socket --is-indexing)" = "1" ]; do
+    rc -n $DIR/rdm.socket --status jobs | grep -A$WORKERS "Remote rp workers"
+    sleep 1
+done
+
+FAILED=0
+for i in 1 2 3 4 5 6; do
+    if ! rc -n $DIR/rdm.socket -F function$i | grep -q "file$i.cpp"; then
+        echo "function$i wasn't indexed"
+        FAILED=1
+    fi
+done
+[ $FAILED = 0 ] && echo "Indexed all files with $WORKERS remote workers"
+exit $FAILED